@@ -0,0 +1,850 @@
+/*
+ * balloc.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/percpu.h>
+#include <linux/blkdev.h>
+#include <linux/sched/signal.h>
+
+#include "sfs.h"
+#include "sfs_trace.h"
+
+/*
+ * The data bitmap (dmap) starts at dmap_blkaddr and spans block_count_dmap
+ * blocks, bit n tracks data block data_blkaddr + n. Each map block covers
+ * SFS_MAP_BITS_PER_BLK entries, the same layout mkfs uses.
+ */
+static inline u32 sfs_dmap_nbits(struct sfs_sb_info *sbi, u32 map)
+{
+	u32 total = le32_to_cpu(sbi->raw_super->block_count_data);
+
+	return min_t(u32, SFS_MAP_BITS_PER_BLK,
+		     total - map * SFS_MAP_BITS_PER_BLK);
+}
+
+/* the dmap blocks are pinned, see bitmap.c */
+static inline struct buffer_head *sfs_read_dmap(struct super_block *sb,
+						u32 map)
+{
+	return sfs_bitmap_get(&SFS_SB(sb)->s_dmap, map);
+}
+
+/*
+ * Clear the dmap bits of the blocks from @block up to the first one whose
+ * bit differs from that of @block, at most @len blocks and within one map
+ * block. *@was_set tells how the bits were, already clear ones are left
+ * alone. Returns the number of blocks looked at, or -EIO.
+ */
+static int sfs_dmap_clear(struct super_block *sb, u32 block, u32 len,
+			  bool *was_set)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	u32 bit = block - le32_to_cpu(sbi->raw_super->data_blkaddr);
+	u32 map = bit / SFS_MAP_BITS_PER_BLK;
+	u32 off = bit % SFS_MAP_BITS_PER_BLK;
+	u32 n = min_t(u32, len, SFS_MAP_BITS_PER_BLK - off);
+	struct buffer_head *bh;
+	u32 i;
+
+	bh = sfs_read_dmap(sb, map);
+	if (!bh)
+		return -EIO;
+
+	spin_lock(sfs_group_lock(sbi, sfs_block_group(sbi, block)));
+	*was_set = test_bit_le(off, bh->b_data);
+	for (i = 0; i < n; i++) {
+		if (!!test_bit_le(off + i, bh->b_data) != *was_set)
+			break;
+		if (*was_set)
+			__clear_bit_le(off + i, bh->b_data);
+	}
+	spin_unlock(sfs_group_lock(sbi, sfs_block_group(sbi, block)));
+
+	if (*was_set)
+		sfs_bitmap_dirty(&sbi->s_dmap, map);
+	brelse(bh);
+	return i;
+}
+
+/*
+ * Set the dmap bits of @len blocks from @block, all within one allocation
+ * group. The caller owns the blocks, the group lock only keeps the other
+ * bits of the same word intact. -EUCLEAN means some bits were set already,
+ * i.e. the run was in the free space index but is in use. On error the
+ * map is left as it was.
+ */
+static int sfs_dmap_set(struct super_block *sb, u32 block, u32 len)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	u32 bit = block - le32_to_cpu(sbi->raw_super->data_blkaddr);
+	struct buffer_head *bh;
+	u32 map, n, i, off, done = 0;
+	bool was_set;
+	int err = 0, ret;
+
+	while (done < len) {
+		map = (bit + done) / SFS_MAP_BITS_PER_BLK;
+		off = (bit + done) % SFS_MAP_BITS_PER_BLK;
+		n = min_t(u32, len - done, SFS_MAP_BITS_PER_BLK - off);
+		bh = sfs_read_dmap(sb, map);
+		if (!bh) {
+			err = -EIO;
+			break;
+		}
+
+		spin_lock(sfs_group_lock(sbi, sfs_block_group(sbi, block)));
+		if (find_next_bit_le(bh->b_data, off + n, off) < off + n) {
+			err = -EUCLEAN;
+		} else {
+			for (i = 0; i < n; i++)
+				__set_bit_le(off + i, bh->b_data);
+		}
+		spin_unlock(sfs_group_lock(sbi, sfs_block_group(sbi, block)));
+
+		if (!err)
+			sfs_bitmap_dirty(&sbi->s_dmap, map);
+		brelse(bh);
+		if (err)
+			break;
+		done += n;
+	}
+
+	/* undo the map blocks this call filled, they are set all through */
+	while (err && done) {
+		ret = sfs_dmap_clear(sb, block, done, &was_set);
+		if (ret < 0)
+			break;
+		block += ret;
+		done -= ret;
+	}
+	return err;
+}
+
+/*
+ * Free space index
+ *
+ * Every run of free data blocks is kept in two rbtrees of its allocation
+ * group, one sorted by start block for next-fit and merging, one by
+ * length for best-fit, so allocation does not have to scan dmap bytes.
+ * Both trees and ag_free are protected by the group lock.
+ */
+static struct kmem_cache *sfs_free_extent_cachep;
+
+static struct sfs_free_extent *sfs_fe_lookup(struct sfs_alloc_group *ag,
+					     u32 block)
+{
+	struct rb_node *n = ag->ag_free_by_start.rb_node;
+	struct sfs_free_extent *fe, *best = NULL;
+
+	/* the last extent starting at or before @block */
+	while (n) {
+		fe = rb_entry(n, struct sfs_free_extent, fe_start_node);
+		if (block < fe->fe_start) {
+			n = n->rb_left;
+		} else {
+			best = fe;
+			n = n->rb_right;
+		}
+	}
+	return best;
+}
+
+static struct sfs_free_extent *sfs_fe_next(struct sfs_alloc_group *ag,
+					   struct sfs_free_extent *fe)
+{
+	struct rb_node *n;
+
+	n = fe ? rb_next(&fe->fe_start_node) :
+		 rb_first(&ag->ag_free_by_start);
+	return n ? rb_entry(n, struct sfs_free_extent, fe_start_node) : NULL;
+}
+
+static void sfs_fe_insert_start(struct sfs_alloc_group *ag,
+				struct sfs_free_extent *new)
+{
+	struct rb_node **p = &ag->ag_free_by_start.rb_node;
+	struct rb_node *parent = NULL;
+	struct sfs_free_extent *fe;
+
+	while (*p) {
+		parent = *p;
+		fe = rb_entry(parent, struct sfs_free_extent, fe_start_node);
+		if (new->fe_start < fe->fe_start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->fe_start_node, parent, p);
+	rb_insert_color(&new->fe_start_node, &ag->ag_free_by_start);
+}
+
+static void sfs_fe_insert_len(struct sfs_alloc_group *ag,
+			      struct sfs_free_extent *new)
+{
+	struct rb_node **p = &ag->ag_free_by_len.rb_node;
+	struct rb_node *parent = NULL;
+	struct sfs_free_extent *fe;
+
+	while (*p) {
+		parent = *p;
+		fe = rb_entry(parent, struct sfs_free_extent, fe_len_node);
+		if (new->fe_len < fe->fe_len ||
+		    (new->fe_len == fe->fe_len && new->fe_start < fe->fe_start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->fe_len_node, parent, p);
+	rb_insert_color(&new->fe_len_node, &ag->ag_free_by_len);
+}
+
+/* smallest extent of at least @len blocks, else the largest one */
+static struct sfs_free_extent *sfs_fe_best_fit(struct sfs_alloc_group *ag,
+					       u32 len)
+{
+	struct rb_node *n = ag->ag_free_by_len.rb_node;
+	struct sfs_free_extent *fe, *best = NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct sfs_free_extent, fe_len_node);
+		if (fe->fe_len >= len) {
+			best = fe;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	if (!best && (n = rb_last(&ag->ag_free_by_len)))
+		best = rb_entry(n, struct sfs_free_extent, fe_len_node);
+	return best;
+}
+
+/*
+ * take [start, start + len) out of @fe, @spare is used when the range
+ * splits @fe in two and is set to NULL then
+ */
+static void sfs_fe_carve(struct sfs_alloc_group *ag,
+			 struct sfs_free_extent *fe, u32 start, u32 len,
+			 struct sfs_free_extent **spare)
+{
+	u32 fe_end = fe->fe_start + fe->fe_len;
+	struct sfs_free_extent *tail;
+
+	rb_erase(&fe->fe_len_node, &ag->ag_free_by_len);
+	if (start == fe->fe_start) {
+		fe->fe_start += len;
+		fe->fe_len -= len;
+		if (!fe->fe_len) {
+			rb_erase(&fe->fe_start_node, &ag->ag_free_by_start);
+			kmem_cache_free(sfs_free_extent_cachep, fe);
+			return;
+		}
+	} else if (start + len == fe_end) {
+		fe->fe_len -= len;
+	} else {
+		tail = *spare;
+		*spare = NULL;
+		fe->fe_len = start - fe->fe_start;
+		tail->fe_start = start + len;
+		tail->fe_len = fe_end - tail->fe_start;
+		sfs_fe_insert_start(ag, tail);
+		sfs_fe_insert_len(ag, tail);
+	}
+	sfs_fe_insert_len(ag, fe);
+}
+
+/* give [start, start + len) back, merging with the neighbours */
+static void sfs_fe_put(struct sfs_alloc_group *ag, u32 start, u32 len,
+		       struct sfs_free_extent **spare)
+{
+	struct sfs_free_extent *prev, *next, *fe;
+	bool merge_prev, merge_next;
+
+	prev = sfs_fe_lookup(ag, start);
+	next = sfs_fe_next(ag, prev);
+	if ((prev && prev->fe_start + prev->fe_len > start) ||
+	    (next && start + len > next->fe_start)) {
+		WARN_ONCE(1, "sfs: freeing free blocks %u+%u", start, len);
+		return;
+	}
+
+	merge_prev = prev && prev->fe_start + prev->fe_len == start;
+	merge_next = next && start + len == next->fe_start;
+
+	if (merge_prev && merge_next) {
+		rb_erase(&next->fe_start_node, &ag->ag_free_by_start);
+		rb_erase(&next->fe_len_node, &ag->ag_free_by_len);
+		rb_erase(&prev->fe_len_node, &ag->ag_free_by_len);
+		prev->fe_len += len + next->fe_len;
+		sfs_fe_insert_len(ag, prev);
+		kmem_cache_free(sfs_free_extent_cachep, next);
+	} else if (merge_prev) {
+		rb_erase(&prev->fe_len_node, &ag->ag_free_by_len);
+		prev->fe_len += len;
+		sfs_fe_insert_len(ag, prev);
+	} else if (merge_next) {
+		rb_erase(&next->fe_len_node, &ag->ag_free_by_len);
+		next->fe_start = start;
+		next->fe_len += len;
+		sfs_fe_insert_len(ag, next);
+	} else {
+		fe = *spare;
+		*spare = NULL;
+		fe->fe_start = start;
+		fe->fe_len = len;
+		sfs_fe_insert_start(ag, fe);
+		sfs_fe_insert_len(ag, fe);
+	}
+}
+
+/*
+ * Split the data area into allocation groups of SFS_BLOCKS_PER_GROUP
+ * blocks and build the free space index of each from the dmap. Runs that
+ * continue across dmap blocks of the same group are joined into one
+ * extent. Every CPU starts allocating from its own group.
+ */
+int sfs_build_alloc_groups(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	u32 data_blkaddr = le32_to_cpu(sbi->raw_super->data_blkaddr);
+	u32 total = le32_to_cpu(sbi->raw_super->block_count_data);
+	struct sfs_free_extent *fe;
+	struct sfs_alloc_group *ag;
+	struct buffer_head *bh;
+	u32 group, map, nbits, zero, one, start;
+	int cpu;
+
+	sbi->s_ngroups = DIV_ROUND_UP(total, SFS_BLOCKS_PER_GROUP);
+	sbi->s_groups = kvcalloc(sbi->s_ngroups, sizeof(struct sfs_alloc_group),
+				 GFP_KERNEL);
+	if (!sbi->s_groups)
+		return -ENOMEM;
+
+	sbi->s_group_hint = alloc_percpu(unsigned int);
+	if (!sbi->s_group_hint)
+		goto fail;
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(sbi->s_group_hint, cpu) = cpu % sbi->s_ngroups;
+
+	for (group = 0; group < sbi->s_ngroups; group++) {
+		ag = &sbi->s_groups[group];
+		ag->ag_start = data_blkaddr + group * SFS_BLOCKS_PER_GROUP;
+		ag->ag_len = min_t(u32, SFS_BLOCKS_PER_GROUP,
+				   total - group * SFS_BLOCKS_PER_GROUP);
+		ag->ag_free_by_start = RB_ROOT;
+		ag->ag_free_by_len = RB_ROOT;
+		fe = NULL;
+
+		for (map = group * SFS_MAPS_PER_GROUP;
+		     map < DIV_ROUND_UP(group * SFS_BLOCKS_PER_GROUP + ag->ag_len,
+					SFS_MAP_BITS_PER_BLK); map++) {
+			nbits = sfs_dmap_nbits(sbi, map);
+			bh = sfs_read_dmap(sb, map);
+			if (!bh)
+				goto fail_group;
+
+			for (zero = find_next_zero_bit_le(bh->b_data, nbits, 0);
+			     zero < nbits;
+			     zero = find_next_zero_bit_le(bh->b_data, nbits, one)) {
+				one = find_next_bit_le(bh->b_data, nbits, zero);
+				start = data_blkaddr +
+					map * SFS_MAP_BITS_PER_BLK + zero;
+				ag->ag_free += one - zero;
+
+				if (fe && fe->fe_start + fe->fe_len == start) {
+					fe->fe_len += one - zero;
+					continue;
+				}
+				if (fe)
+					sfs_fe_insert_len(ag, fe);
+				fe = kmem_cache_alloc(sfs_free_extent_cachep,
+						      GFP_KERNEL);
+				if (!fe) {
+					brelse(bh);
+					goto fail_group;
+				}
+				fe->fe_start = start;
+				fe->fe_len = one - zero;
+				sfs_fe_insert_start(ag, fe);
+			}
+			brelse(bh);
+		}
+		if (fe)
+			sfs_fe_insert_len(ag, fe);
+	}
+	return 0;
+
+fail_group:
+	if (fe)
+		sfs_fe_insert_len(ag, fe);
+fail:
+	sfs_destroy_alloc_groups(sbi);
+	return -ENOMEM;
+}
+
+void sfs_destroy_alloc_groups(struct sfs_sb_info *sbi)
+{
+	struct sfs_free_extent *fe, *tmp;
+	u32 group;
+
+	if (sbi->s_groups) {
+		for (group = 0; group < sbi->s_ngroups; group++)
+			rbtree_postorder_for_each_entry_safe(fe, tmp,
+				&sbi->s_groups[group].ag_free_by_start,
+				fe_start_node)
+				kmem_cache_free(sfs_free_extent_cachep, fe);
+		kvfree(sbi->s_groups);
+		sbi->s_groups = NULL;
+	}
+	free_percpu(sbi->s_group_hint);
+	sbi->s_group_hint = NULL;
+}
+
+int __init sfs_init_free_extent_cache(void)
+{
+	sfs_free_extent_cachep = kmem_cache_create("sfs_free_extent",
+				sizeof(struct sfs_free_extent), 0,
+				SLAB_RECLAIM_ACCOUNT, NULL);
+	if (sfs_free_extent_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void sfs_destroy_free_extent_cache(void)
+{
+	kmem_cache_destroy(sfs_free_extent_cachep);
+}
+
+/*
+ * Keep a margin over the per-CPU counter error before trusting the cheap
+ * approximate reads.
+ */
+#define SFS_FREEBLOCKS_WATERMARK	(4 * (percpu_counter_batch * nr_cpu_ids))
+
+static bool sfs_has_free_blocks(struct sfs_sb_info *sbi, s64 nblocks)
+{
+	s64 free, dirty;
+
+	free = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
+	dirty = percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+	if (free - dirty < nblocks + SFS_FREEBLOCKS_WATERMARK) {
+		free = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+		dirty = percpu_counter_sum_positive(&sbi->s_dirtyblocks_counter);
+	}
+	return free - dirty >= nblocks;
+}
+
+/*
+ * Give back the blocks held by the journal and the discard queue, so an
+ * allocation can retry. Outside a handle the running transaction is
+ * committed first, so its frees come back too. Returns false if there
+ * were none.
+ */
+bool sfs_reclaim_held_blocks(struct super_block *sb)
+{
+	bool freed;
+
+	if (!current->journal_info)
+		sfs_journal_force_commit(sb);
+	freed = sfs_journal_checkpoint(sb);
+
+	/* the checkpoint may have queued blocks for discard */
+	return sfs_discard_flush(sb) || freed;
+}
+
+/*
+ * Delayed allocation: write() only takes a reservation against the free
+ * block count, the physical blocks are picked at writeback time.
+ */
+int sfs_reserve_blocks(struct sfs_sb_info *sbi, unsigned int count)
+{
+	if (!sfs_has_free_blocks(sbi, count) &&
+	    !(sfs_reclaim_held_blocks(sbi->sb) &&
+	      sfs_has_free_blocks(sbi, count)))
+		return -ENOSPC;
+	percpu_counter_add(&sbi->s_dirtyblocks_counter, count);
+	return 0;
+}
+
+void sfs_release_blocks(struct sfs_sb_info *sbi, unsigned int count)
+{
+	percpu_counter_sub(&sbi->s_dirtyblocks_counter, count);
+}
+
+/*
+ * pick the run to allocate from @ag, the caller holds the group lock.
+ * Next-fit: if @goal is free the run starts there, and a free extent right
+ * after @goal is used when it is big enough. Otherwise the run is taken
+ * best-fit from the smallest extent that holds @want blocks.
+ */
+static struct sfs_free_extent *sfs_ag_pick(struct sfs_alloc_group *ag,
+					   u32 goal, u32 want, bool split,
+					   u32 *start)
+{
+	struct sfs_free_extent *fe, *next;
+
+	fe = sfs_fe_lookup(ag, goal);
+	if (goal && fe && goal < fe->fe_start + fe->fe_len) {
+		/* without a spare node only the head of an extent is taken */
+		*start = split ? goal : fe->fe_start;
+		return fe;
+	}
+
+	next = sfs_fe_next(ag, fe);
+	if (goal && next && next->fe_len >= want)
+		fe = next;
+	else
+		fe = sfs_fe_best_fit(ag, want);
+	if (fe)
+		*start = fe->fe_start;
+	return fe;
+}
+
+/*
+ * sfs_new_blocks - allocate a run of data blocks
+ * @inode: owner of the blocks
+ * @goal: preferred first block, 0 for none
+ * @count: in: wanted length, out: allocated length
+ * @reserved: the blocks were reserved by sfs_reserve_blocks()
+ * @err: error code on failure
+ *
+ * The search starts in the group of @goal, or in the current group of
+ * this CPU when there is no goal, and moves on to the next groups when
+ * it is full. With -o alloc=bestfit only the group of @goal is kept.
+ * Only the lock of the group being searched is taken, so writers on
+ * different CPUs do not serialize on one another.
+ *
+ * Returns the first block of the run, 0 on failure.
+ */
+u32 sfs_new_blocks(struct inode *inode, u32 goal, unsigned int *count,
+		   bool reserved, int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_free_extent *spare, *fe;
+	struct sfs_alloc_group *ag;
+	unsigned int want = *count;
+	bool bestfit = test_opt(sbi, BESTFIT);
+	u64 t0 = ktime_get_ns();
+	u32 group, start = 0, len = 0;
+	u32 i;
+
+	if (!reserved && !sfs_has_free_blocks(sbi, 1) &&
+	    !(sfs_reclaim_held_blocks(sb) && sfs_has_free_blocks(sbi, 1))) {
+		*err = -ENOSPC;
+		return 0;
+	}
+
+	if (sfs_block_in_data(sbi, goal)) {
+		group = sfs_block_group(sbi, goal);
+	} else {
+		goal = 0;
+		group = raw_cpu_read(*sbi->s_group_hint) % sbi->s_ngroups;
+	}
+
+	spare = kmem_cache_alloc(sfs_free_extent_cachep, GFP_NOFS);
+	for (i = 0; i < sbi->s_ngroups; i++) {
+		ag = &sbi->s_groups[group];
+		if (READ_ONCE(ag->ag_free)) {
+			spin_lock(sfs_group_lock(sbi, group));
+			fe = sfs_ag_pick(ag, i || bestfit ? 0 : goal, want,
+					 spare != NULL, &start);
+			if (fe) {
+				len = min_t(u32, want,
+					    fe->fe_start + fe->fe_len - start);
+				sfs_fe_carve(ag, fe, start, len, &spare);
+				ag->ag_free -= len;
+				spin_unlock(sfs_group_lock(sbi, group));
+				break;
+			}
+			spin_unlock(sfs_group_lock(sbi, group));
+		}
+		if (++group == sbi->s_ngroups)
+			group = 0;
+	}
+	sfs_stat_inc(sbi, SFS_STAT_ALLOCS);
+	sfs_stat_add(sbi, SFS_STAT_ALLOC_GROUPS, len ? i + 1 : i);
+	if (!len) {
+		*err = -ENOSPC;
+		goto out;
+	}
+
+	/* stay in the group that had room the next time around */
+	if (i)
+		raw_cpu_write(*sbi->s_group_hint, group);
+
+	percpu_counter_sub(&sbi->s_freeblocks_counter, len);
+	if (reserved)
+		percpu_counter_sub(&sbi->s_dirtyblocks_counter, len);
+
+	*err = sfs_dmap_set(sb, start, len);
+	if (*err == -EUCLEAN) {
+		/*
+		 * The run is in use although the index had it free. It stays
+		 * out of the index and the free count, so nobody gets it, until
+		 * the next mount builds both again from the dmap.
+		 */
+		sfs_error(sb, "corrupted dmap, allocated blocks %u-%u are in "
+			  "use", start, start + len - 1);
+		if (reserved)
+			percpu_counter_add(&sbi->s_dirtyblocks_counter, len);
+		start = 0;
+		goto out;
+	}
+	if (*err) {
+		/* the map is not updated, the blocks can be handed out again */
+		if (!spare)
+			spare = kmem_cache_alloc(sfs_free_extent_cachep,
+						 GFP_NOFS | __GFP_NOFAIL);
+		spin_lock(sfs_group_lock(sbi, group));
+		sfs_fe_put(ag, start, len, &spare);
+		ag->ag_free += len;
+		spin_unlock(sfs_group_lock(sbi, group));
+
+		percpu_counter_add(&sbi->s_freeblocks_counter, len);
+		if (reserved)
+			percpu_counter_add(&sbi->s_dirtyblocks_counter, len);
+		start = 0;
+		goto out;
+	}
+	*count = len;
+	sfs_stat_add(sbi, SFS_STAT_ALLOC_BLOCKS, len);
+	sfs_set_sync_state(inode, SFS_SYNC_MAPS);
+out:
+	if (spare)
+		kmem_cache_free(sfs_free_extent_cachep, spare);
+	sfs_stat_lat(sbi, SFS_LAT_ALLOC, t0);
+	trace_sfs_alloc_blocks(inode, goal, want, start, start ? len : 0,
+			       *err, ktime_get_ns() - t0);
+	return start;
+}
+
+/* put a run back into the free space index of @group */
+static void sfs_ag_put(struct sfs_sb_info *sbi, u32 group, u32 block, u32 len)
+{
+	struct sfs_alloc_group *ag = &sbi->s_groups[group];
+	struct sfs_free_extent *spare;
+
+	spare = kmem_cache_alloc(sfs_free_extent_cachep,
+				 GFP_NOFS | __GFP_NOFAIL);
+	spin_lock(sfs_group_lock(sbi, group));
+	sfs_fe_put(ag, block, len, &spare);
+	ag->ag_free += len;
+	spin_unlock(sfs_group_lock(sbi, group));
+	if (spare)
+		kmem_cache_free(sfs_free_extent_cachep, spare);
+}
+
+/*
+ * Give a run of one group back to the allocator, the map is already clear.
+ */
+void sfs_put_free_blocks(struct sfs_sb_info *sbi, u32 block, u32 len)
+{
+	sfs_ag_put(sbi, sfs_block_group(sbi, block), block, len);
+	percpu_counter_add(&sbi->s_freeblocks_counter, len);
+}
+
+static void __sfs_free_blocks(struct inode *inode, u32 block,
+			      unsigned int count, bool meta)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_alloc_group *ag;
+	u64 t0 = sfs_trace_clock(sfs_free_blocks);
+	u32 len, total = count;
+	bool was_set;
+	int n;
+
+	if (!sfs_block_in_data(sbi, block) ||
+	    !sfs_block_in_data(sbi, block + count - 1)) {
+		sfs_msg(sb, KERN_ERR, "freeing blocks not in datazone - "
+			"block = %u, count = %u", block, count);
+		return;
+	}
+
+	while (count) {
+		ag = &sbi->s_groups[sfs_block_group(sbi, block)];
+		len = min_t(u32, count, ag->ag_start + ag->ag_len - block);
+
+		/* clear the map first so nobody allocates a block still in use */
+		n = sfs_dmap_clear(sb, block, len, &was_set);
+		if (n < 0)
+			return;
+		if (!was_set) {
+			/* a double free, the run is in the index already */
+			sfs_msg(sb, KERN_ERR, "bit already cleared for blocks "
+				"%u-%u", block, block + n - 1);
+			goto next;
+		}
+		sfs_set_sync_state(inode, SFS_SYNC_MAPS);
+
+		/*
+		 * Not reused nor discarded before the free is committed, replay
+		 * would bring back the owner, or log over the new contents.
+		 */
+		if (!sfs_journal_free_blocks(sb, block, n) &&
+		    !sfs_discard_queue(sb, block, n))
+			sfs_put_free_blocks(sbi, block, n);
+next:
+		block += n;
+		count -= n;
+	}
+	trace_sfs_free_blocks(inode, block - total, total, meta,
+			      sfs_trace_since(t0));
+}
+
+/*
+ * Directory blocks are metadata, the blocks of other inodes are data.
+ */
+void sfs_free_blocks(struct inode *inode, u32 block, unsigned int count)
+{
+	__sfs_free_blocks(inode, block, count, S_ISDIR(inode->i_mode));
+}
+
+/*
+ * Free indirect blocks and extent tree nodes.
+ */
+void sfs_free_meta_blocks(struct inode *inode, u32 block, unsigned int count)
+{
+	__sfs_free_blocks(inode, block, count, true);
+}
+
+#define SFS_TRIM_BATCH		16
+
+struct sfs_trim_range {
+	u32 start;
+	u32 len;
+};
+
+/*
+ * Take up to SFS_TRIM_BATCH free runs of at least @minlen blocks in
+ * [*cursor, end) out of @ag, so nobody allocates them while they are
+ * discarded. Moves *cursor past the last run looked at.
+ */
+static int sfs_trim_pick(struct sfs_sb_info *sbi, u32 group, u32 *cursor,
+			 u32 end, u32 minlen, struct sfs_trim_range *tr,
+			 struct sfs_free_extent **spare)
+{
+	struct sfs_alloc_group *ag = &sbi->s_groups[group];
+	struct sfs_free_extent *fe, *next;
+	u32 start, len;
+	int n = 0;
+
+	spin_lock(sfs_group_lock(sbi, group));
+	fe = sfs_fe_lookup(ag, *cursor);
+	if (!fe || fe->fe_start + fe->fe_len <= *cursor)
+		fe = sfs_fe_next(ag, fe);
+	for (; fe && fe->fe_start < end && n < SFS_TRIM_BATCH; fe = next) {
+		next = sfs_fe_next(ag, fe);
+		start = max(fe->fe_start, *cursor);
+		len = min(fe->fe_start + fe->fe_len, end) - start;
+		*cursor = start + len;
+		if (len < minlen)
+			continue;
+		/* a run inside an extent splits it, one spare per batch */
+		if (start > fe->fe_start &&
+		    start + len < fe->fe_start + fe->fe_len && !*spare) {
+			*cursor = start;
+			break;
+		}
+		sfs_fe_carve(ag, fe, start, len, spare);
+		ag->ag_free -= len;
+		tr[n].start = start;
+		tr[n].len = len;
+		n++;
+	}
+	if (!fe || fe->fe_start >= end)
+		*cursor = end;
+	spin_unlock(sfs_group_lock(sbi, group));
+	return n;
+}
+
+/*
+ * sfs_trim_fs - discard the free blocks of a range
+ * @sb: super block
+ * @start: first block
+ * @end: block after the range
+ * @minlen: shortest free run worth discarding
+ * @trimmed: out: # of blocks discarded
+ *
+ * The runs are found in the free space index rather than the dmap, so an
+ * empty group costs one lookup however large it is. Each batch is taken
+ * out of the index under the group lock, discarded with the lock dropped
+ * and handed back, so allocation only has to do without those blocks for
+ * the time of one batch.
+ */
+int sfs_trim_fs(struct super_block *sb, u32 start, u32 end, u32 minlen,
+		u64 *trimmed)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_trim_range tr[SFS_TRIM_BATCH];
+	struct sfs_free_extent *spare = NULL;
+	struct sfs_alloc_group *ag;
+	struct bio *bio;
+	unsigned int shift = sb->s_blocksize_bits - 9;
+	u32 group, cursor, group_end;
+	int i, n, ret, err = 0;
+
+	*trimmed = 0;
+	for (group = sfs_block_group(sbi, start);
+	     group < sbi->s_ngroups && !err; group++) {
+		ag = &sbi->s_groups[group];
+		if (ag->ag_start >= end)
+			break;
+		cursor = max(start, ag->ag_start);
+		group_end = min(end, ag->ag_start + ag->ag_len);
+
+		while (cursor < group_end && READ_ONCE(ag->ag_free) >= minlen) {
+			if (!spare) {
+				spare = kmem_cache_alloc(sfs_free_extent_cachep,
+							 GFP_KERNEL);
+				if (!spare) {
+					err = -ENOMEM;
+					break;
+				}
+			}
+			n = sfs_trim_pick(sbi, group, &cursor, group_end,
+					  minlen, tr, &spare);
+
+			/* one chain of bios for the whole batch */
+			bio = NULL;
+			for (i = 0; i < n && !err; i++)
+				err = __blkdev_issue_discard(sb->s_bdev,
+					(sector_t)tr[i].start << shift,
+					(sector_t)tr[i].len << shift,
+					GFP_KERNEL, 0, &bio);
+			if (bio) {
+				ret = submit_bio_wait(bio);
+				bio_put(bio);
+				if (!err)
+					err = ret;
+			}
+
+			for (i = 0; i < n; i++) {
+				sfs_ag_put(sbi, group, tr[i].start, tr[i].len);
+				if (!err)
+					*trimmed += tr[i].len;
+			}
+			if (err)
+				break;
+			if (fatal_signal_pending(current)) {
+				err = -ERESTARTSYS;
+				break;
+			}
+			cond_resched();
+		}
+	}
+	if (spare)
+		kmem_cache_free(sfs_free_extent_cachep, spare);
+	return err;
+}
@@ -0,0 +1,158 @@
+/*
+ * bitmap.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+
+#include "sfs.h"
+
+/*
+ * The imap and dmap blocks are read once at mount and stay pinned in the
+ * buffer cache until unmount, so allocations never wait for a bitmap read.
+ * An update only marks its map block in bm_dirty and dirties the buffer;
+ * however many bits change in between, the block is written once by the
+ * next sfs_bitmap_flush(), which submits the dirty blocks in ascending
+ * order, SFS_BITMAP_FLUSH_BATCH under each plug. Background writeback of
+ * the block device still picks them up if nobody syncs. With a journal the
+ * blocks are journaled instead and the commit writes them.
+ */
+
+#define SFS_BITMAP_RA_BLOCKS	32
+#define SFS_BITMAP_FLUSH_BATCH	64
+
+/*
+ * Read and pin the @count map blocks starting at @blkaddr.
+ */
+int sfs_bitmap_load(struct super_block *sb, struct sfs_bitmap *bm,
+		    u32 blkaddr, u32 count)
+{
+	u32 i;
+
+	bm->bm_sb = sb;
+	bm->bm_blkaddr = blkaddr;
+	bm->bm_count = count;
+	bm->bm_bh = kvcalloc(count, sizeof(struct buffer_head *), GFP_KERNEL);
+	bm->bm_dirty = kvcalloc(BITS_TO_LONGS(count), sizeof(unsigned long),
+				GFP_KERNEL);
+	if (!bm->bm_bh || !bm->bm_dirty)
+		goto fail;
+
+	for (i = 0; i < count; i++) {
+		if (i % SFS_BITMAP_RA_BLOCKS == 0) {
+			u32 j, end = min(count, i + SFS_BITMAP_RA_BLOCKS);
+			struct blk_plug plug;
+
+			blk_start_plug(&plug);
+			for (j = i; j < end; j++)
+				sb_breadahead(sb, blkaddr + j);
+			blk_finish_plug(&plug);
+		}
+		bm->bm_bh[i] = sb_bread(sb, blkaddr + i);
+		if (!bm->bm_bh[i]) {
+			sfs_msg(sb, KERN_ERR, "unable to read bitmap block %u",
+				blkaddr + i);
+			sfs_bitmap_release(bm);
+			return -EIO;
+		}
+	}
+	return 0;
+
+fail:
+	sfs_bitmap_release(bm);
+	return -ENOMEM;
+}
+
+void sfs_bitmap_release(struct sfs_bitmap *bm)
+{
+	u32 i;
+
+	if (bm->bm_bh) {
+		for (i = 0; i < bm->bm_count; i++)
+			brelse(bm->bm_bh[i]);
+		kvfree(bm->bm_bh);
+		bm->bm_bh = NULL;
+	}
+	kvfree(bm->bm_dirty);
+	bm->bm_dirty = NULL;
+}
+
+/*
+ * Map block @n with a reference of its own, released with brelse().
+ */
+struct buffer_head *sfs_bitmap_get(struct sfs_bitmap *bm, u32 n)
+{
+	if (WARN_ON_ONCE(n >= bm->bm_count))
+		return NULL;
+	get_bh(bm->bm_bh[n]);
+	return bm->bm_bh[n];
+}
+
+/*
+ * Called after changing bits of map block @n. The buffer may have been
+ * cleaned by background writeback meanwhile, so it is dirtied again; that
+ * is only a flag test when it is still dirty.
+ */
+void sfs_bitmap_dirty(struct sfs_bitmap *bm, u32 n)
+{
+	if (sfs_journaled(bm->bm_sb)) {
+		sfs_journal_dirty(bm->bm_sb, bm->bm_bh[n], NULL);
+		return;
+	}
+	if (!test_bit(n, bm->bm_dirty))
+		set_bit(n, bm->bm_dirty);
+	mark_buffer_dirty(bm->bm_bh[n]);
+}
+
+/*
+ * Write out the map blocks changed since the last flush. Bits set while the
+ * writes are in flight stay dirty for the next one. With @wait, only the
+ * blocks this call wrote are waited on, SFS_BITMAP_FLUSH_BATCH at a time.
+ */
+int sfs_bitmap_flush(struct sfs_bitmap *bm, int wait)
+{
+	struct sfs_sb_info *sbi = SFS_SB(bm->bm_sb);
+	u32 batch[SFS_BITMAP_FLUSH_BATCH];
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	u64 t0 = ktime_get_ns();
+	u32 n = 0, i, nr, written = 0;
+	int err = 0;
+
+	do {
+		nr = 0;
+		blk_start_plug(&plug);
+		for_each_set_bit_from(n, bm->bm_dirty, bm->bm_count) {
+			if (nr == SFS_BITMAP_FLUSH_BATCH)
+				break;
+			clear_bit(n, bm->bm_dirty);
+			write_dirty_buffer(bm->bm_bh[n], wait ? REQ_SYNC : 0);
+			batch[nr++] = n;
+		}
+		blk_finish_plug(&plug);
+		written += nr;
+
+		for (i = 0; wait && i < nr; i++) {
+			bh = bm->bm_bh[batch[i]];
+			wait_on_buffer(bh);
+			if (buffer_write_io_error(bh) && !buffer_uptodate(bh)) {
+				clear_buffer_write_io_error(bh);
+				set_buffer_uptodate(bh);
+				err = -EIO;
+			}
+		}
+	} while (nr == SFS_BITMAP_FLUSH_BATCH);
+
+	sfs_stat_inc(sbi, SFS_STAT_BITMAP_FLUSHES);
+	sfs_stat_add(sbi, SFS_STAT_BITMAP_BLOCKS, written);
+	sfs_stat_lat(sbi, SFS_LAT_BITMAP_FLUSH, t0);
+	return err;
+}
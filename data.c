@@ -0,0 +1,795 @@
+/*
+ * data.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/iomap.h>
+#include <linux/dax.h>
+#include <linux/writeback.h>
+
+#include "sfs.h"
+#include "sfs_trace.h"
+
+#define SFS_IND_BLOCK		(DEF_ADDRS_PER_INODE)
+#define SFS_DIND_BLOCK		(SFS_IND_BLOCK + 1)
+#define SFS_TIND_BLOCK		(SFS_DIND_BLOCK + 1)
+
+#define SFS_ADDRS_BITS		10	/* log2(DEF_ADDRS_PER_BLOCK) */
+
+/*
+ * sfs_block_to_path - parse a logical block number into the offsets
+ * to follow from i_data down to the leaf address slot.
+ *
+ * d_addr[12] maps the first blocks directly, then i_addr[0..2] are the
+ * single, double and triple indirect blocks of DEF_ADDRS_PER_BLOCK
+ * addresses each. @left is set to the number of slots that follow the
+ * leaf slot in the same array, so that callers can scan a run without
+ * walking the tree again.
+ *
+ * Returns the depth of the path, 0 if @iblock is out of range.
+ */
+static int sfs_block_to_path(struct inode *inode, sector_t iblock,
+			     int offsets[4], int *left)
+{
+	const long direct = DEF_ADDRS_PER_INODE;
+	const long ptrs = DEF_ADDRS_PER_BLOCK;
+	const long ptrs_bits = SFS_ADDRS_BITS;
+	const long double_blocks = 1L << (ptrs_bits * 2);
+	int n = 0;
+	int final = 0;
+
+	if (iblock < direct) {
+		offsets[n++] = iblock;
+		final = direct;
+	} else if ((iblock -= direct) < ptrs) {
+		offsets[n++] = SFS_IND_BLOCK;
+		offsets[n++] = iblock;
+		final = ptrs;
+	} else if ((iblock -= ptrs) < double_blocks) {
+		offsets[n++] = SFS_DIND_BLOCK;
+		offsets[n++] = iblock >> ptrs_bits;
+		offsets[n++] = iblock & (ptrs - 1);
+		final = ptrs;
+	} else if (((iblock -= double_blocks) >> (ptrs_bits * 2)) < ptrs) {
+		offsets[n++] = SFS_TIND_BLOCK;
+		offsets[n++] = iblock >> (ptrs_bits * 2);
+		offsets[n++] = (iblock >> ptrs_bits) & (ptrs - 1);
+		offsets[n++] = iblock & (ptrs - 1);
+		final = ptrs;
+	} else {
+		sfs_msg(inode->i_sb, KERN_WARNING,
+			"block > big: ino=%lu", inode->i_ino);
+		return 0;
+	}
+
+	*left = final - 1 - offsets[n - 1];
+	return n;
+}
+
+static u32 sfs_new_indirect(struct inode *inode, int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	unsigned int count = 1;
+	u32 block;
+
+	/* next to the data it maps */
+	block = sfs_new_blocks(inode, SFS_I(inode)->i_alloc_goal, &count,
+			       false, err);
+	if (!block)
+		return 0;
+
+	bh = sb_getblk(sb, block);
+	if (unlikely(!bh)) {
+		sfs_free_blocks(inode, block, 1);
+		*err = -ENOMEM;
+		return 0;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	sfs_journal_dirty(sb, bh, inode);
+	brelse(bh);
+
+	inode_add_bytes(inode, sb->s_blocksize);
+	return block;
+}
+
+/*
+ * pick the block following the previous logical block on disk so that
+ * delayed allocations of an appending file form one run
+ */
+static u32 sfs_find_goal(struct inode *inode, __le32 *p, int offset)
+{
+	u32 prev;
+
+	if (offset > 0) {
+		prev = le32_to_cpu(p[-1]);
+		if (prev != NULL_ADDR)
+			return prev + 1;
+	}
+	return SFS_I(inode)->i_alloc_goal;
+}
+
+static inline bool sfs_same_run(u32 addr, u32 next, unsigned int n)
+{
+	if (addr == NULL_ADDR)
+		return next == addr;
+	return next == addr + n;
+}
+
+/*
+ * sfs_map_blocks - look up the run of blocks starting at map->m_lblk
+ *
+ * Walks the direct and indirect pointers of @inode and returns in m_len
+ * how many blocks, at most m_len, are laid out contiguously on disk from
+ * m_lblk, with the first physical block in m_pblk. A hole is returned
+ * with m_pblk set to NULL_ADDR, a delayed allocation with NEW_ADDR. The
+ * pointers of a delayed allocation stay NULL_ADDR, it is only known to
+ * sfs_da_lookup().
+ *
+ * @flags changes the run that was found:
+ *  SFS_MAP_RESERVE	reserve space for a hole and make it a delayed
+ *			allocation, indirect blocks are allocated right away
+ *  SFS_MAP_ALLOC	allocate physical blocks for a delayed run or a
+ *			single hole block
+ *  SFS_MAP_DIRECT	with SFS_MAP_ALLOC, allocate the whole hole run
+ *  SFS_MAP_DAX		zero allocated blocks before they are mapped
+ *  SFS_MAP_UNRESERVE	turn a delayed run back into a hole
+ *  SFS_MAP_NOWAIT	only look up, fail with -EAGAIN if i_map_sem is held
+ *
+ * SFS_MAP_NEW is set in m_flags when blocks were allocated or reserved by
+ * this call,
+ * SFS_MAP_BOUNDARY when the run may go on in the next pointer array.
+ *
+ * Returns 0, or a negative errno.
+ */
+static int __sfs_map_blocks(struct inode *inode, struct sfs_map *map,
+			    int flags)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh = NULL;
+	bool create = flags & (SFS_MAP_RESERVE | SFS_MAP_ALLOC);
+	unsigned int maxblocks = map->m_len;
+	bool dirty = false, inode_dirty = false;
+	int offsets[4];
+	__le32 *p;
+	u32 addr;
+	int depth, left, i;
+	unsigned int count = 1;
+	int err = 0;
+
+	if (si->i_flags & SFS_EXTENTS_FL)
+		return sfs_ext_map_blocks(inode, map, flags);
+
+	map->m_flags = 0;
+	depth = sfs_block_to_path(inode, map->m_lblk, offsets, &left);
+	if (!depth)
+		return -EIO;
+
+	err = sfs_map_lock(inode, flags);
+	if (err)
+		return err;
+
+	p = si->i_data + offsets[0];
+	for (i = 1; i < depth; i++) {
+		addr = le32_to_cpu(*p);
+		if (addr == NULL_ADDR) {
+			if (!create) {
+				/* the whole subtree is a hole, report the leaf part */
+				count = min_t(unsigned int, maxblocks, left + 1);
+				goto out;
+			}
+			addr = sfs_new_indirect(inode, &err);
+			if (!addr)
+				goto out;
+			*p = cpu_to_le32(addr);
+			if (bh)
+				sfs_journal_dirty(sb, bh, inode);
+			else
+				inode_dirty = true;
+		}
+		brelse(bh);
+		sfs_stat_inc(SFS_SB(sb), SFS_STAT_INDIRECT_READS);
+		bh = sb_bread(sb, addr);
+		if (!bh) {
+			sfs_msg(sb, KERN_ERR, "unable to read indirect block - "
+				"inode=%lu, block=%u", inode->i_ino, addr);
+			err = -EIO;
+			goto out;
+		}
+		p = (__le32 *)bh->b_data + offsets[i];
+	}
+
+	maxblocks = min_t(unsigned int, maxblocks, left + 1);
+	addr = le32_to_cpu(*p);
+	while (count < maxblocks && sfs_same_run(addr, le32_to_cpu(p[count]), count))
+		count++;
+	if (addr == NULL_ADDR && sfs_da_lookup(inode, map->m_lblk, &count))
+		addr = NEW_ADDR;
+
+	if (addr == NULL_ADDR && (flags & SFS_MAP_RESERVE)) {
+		err = sfs_reserve_blocks(SFS_SB(sb), count);
+		if (err)
+			goto out;
+		err = sfs_da_insert(inode, map->m_lblk, count);
+		if (err) {
+			sfs_release_blocks(SFS_SB(sb), count);
+			goto out;
+		}
+		addr = NEW_ADDR;
+		map->m_flags |= SFS_MAP_NEW;
+	} else if ((addr == NULL_ADDR || addr == NEW_ADDR) &&
+		   (flags & SFS_MAP_ALLOC)) {
+		bool reserved = addr == NEW_ADDR;
+
+		u32 goal = sfs_find_goal(inode, p, offsets[depth - 1]);
+
+		/* writeback only fills the hole under the page it writes */
+		if (!reserved && !(flags & SFS_MAP_DIRECT))
+			count = 1;
+		if (flags & SFS_MAP_DAX)
+			goal = sfs_dax_goal(inode, map->m_lblk, goal, count);
+		addr = sfs_new_blocks(inode, goal, &count, reserved, &err);
+		if (!addr)
+			goto out;
+		/* DAX hands the blocks to user space as they are on disk */
+		if (flags & SFS_MAP_DAX) {
+			err = sb_issue_zeroout(sb, addr, count, GFP_NOFS);
+			if (err) {
+				sfs_free_blocks(inode, addr, count);
+				goto out;
+			}
+		}
+		for (i = 0; i < count; i++)
+			p[i] = cpu_to_le32(addr + i);
+		/* sfs_new_blocks() took over the reservation */
+		if (reserved)
+			sfs_da_remove(inode, map->m_lblk, count);
+		inode_add_bytes(inode, (loff_t)count << inode->i_blkbits);
+		si->i_alloc_goal = addr + count;
+		map->m_flags |= SFS_MAP_NEW;
+		dirty = true;
+	} else if (addr == NEW_ADDR && (flags & SFS_MAP_UNRESERVE)) {
+		sfs_release_blocks(SFS_SB(sb),
+				   sfs_da_remove(inode, map->m_lblk, count));
+		addr = NULL_ADDR;
+	}
+
+	if (dirty) {
+		if (bh)
+			sfs_journal_dirty(sb, bh, inode);
+		else
+			inode_dirty = true;
+	}
+	if (addr != NULL_ADDR && addr != NEW_ADDR)
+		sfs_es_insert(inode, map->m_lblk, addr, count);
+out:
+	brelse(bh);
+	sfs_map_unlock(inode, flags);
+
+	/* copying the inode to its buffer takes i_map_sem */
+	if (inode_dirty)
+		mark_inode_dirty(inode);
+	if (err)
+		return err;
+	if (count == left + 1 && count < map->m_len)
+		map->m_flags |= SFS_MAP_BOUNDARY;
+	map->m_pblk = addr;
+	map->m_len = count;
+	return 0;
+}
+
+/*
+ * A lookup goes on into the next pointer array as long as the run does,
+ * so a large read maps in one call across the d_addr and indirect slots.
+ */
+static int sfs_map_lookup(struct inode *inode, struct sfs_map *map, int flags)
+{
+	unsigned int want = map->m_len;
+	struct sfs_map next;
+	int err;
+
+	err = __sfs_map_blocks(inode, map, flags);
+	if (err)
+		return err;
+
+	while ((map->m_flags & SFS_MAP_BOUNDARY) && map->m_len < want) {
+		next.m_lblk = map->m_lblk + map->m_len;
+		next.m_len = want - map->m_len;
+		if (!sfs_es_lookup(inode, &next) &&
+		    __sfs_map_blocks(inode, &next, flags))
+			break;
+		if (!sfs_same_run(map->m_pblk, next.m_pblk, map->m_len))
+			break;
+		map->m_len += next.m_len;
+		map->m_flags = next.m_flags;
+	}
+	map->m_flags &= ~SFS_MAP_BOUNDARY;
+	return 0;
+}
+
+int sfs_map_blocks(struct inode *inode, struct sfs_map *map, int flags)
+{
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+	struct sfs_handle handle;
+	u64 start;
+	int err;
+
+	sfs_stat_inc(sbi, SFS_STAT_MAP_LOOKUPS);
+	/* flags only ever change holes and reservations */
+	if (sfs_es_lookup(inode, map))
+		return 0;
+
+	start = ktime_get_ns();
+	if (!(flags & ~SFS_MAP_NOWAIT)) {
+		err = sfs_map_lookup(inode, map, flags);
+	} else {
+		sfs_journal_start(inode->i_sb, &handle);
+		err = __sfs_map_blocks(inode, map, flags);
+		sfs_journal_stop(&handle);
+	}
+	sfs_stat_lat(sbi, SFS_LAT_MAP, start);
+	trace_sfs_map_blocks(inode, map, flags, err, ktime_get_ns() - start);
+	return err;
+}
+
+/*
+ * Run of pointers to free, contiguous blocks are handed to the allocator
+ * in one call.
+ */
+struct sfs_free_run {
+	u32 start;
+	u32 len;
+};
+
+static void sfs_free_run_flush(struct inode *inode, struct sfs_free_run *run)
+{
+	if (!run->len)
+		return;
+	/* directory blocks are read through the buffer cache */
+	if (S_ISDIR(inode->i_mode))
+		clean_bdev_aliases(inode->i_sb->s_bdev, run->start, run->len);
+	sfs_free_blocks(inode, run->start, run->len);
+	run->len = 0;
+}
+
+static void sfs_free_run_add(struct inode *inode, struct sfs_free_run *run,
+			     u32 block)
+{
+	if (run->len && run->start + run->len == block) {
+		run->len++;
+		return;
+	}
+	sfs_free_run_flush(inode, run);
+	run->start = block;
+	run->len = 1;
+}
+
+/*
+ * Free the blocks at or after @start (relative to this array) below the
+ * @nr pointers of @p, each of them covering @span blocks.
+ */
+static void sfs_free_tree(struct inode *inode, __le32 *p, unsigned int nr,
+			  u64 span, u64 start, struct sfs_free_run *run,
+			  bool *dirty)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	unsigned int i;
+	u64 sub_start;
+	bool sub_dirty;
+	u32 addr;
+
+	for (i = div64_u64(start, span); i < nr; i++) {
+		addr = le32_to_cpu(p[i]);
+		if (addr == NULL_ADDR)
+			continue;
+
+		if (span == 1) {
+			sfs_free_run_add(inode, run, addr);
+			p[i] = cpu_to_le32(NULL_ADDR);
+			inode_sub_bytes(inode, sb->s_blocksize);
+			*dirty = true;
+			continue;
+		}
+
+		sub_start = 0;
+		if (i == div64_u64(start, span))
+			sub_start = start - i * span;
+
+		bh = sb_bread(sb, addr);
+		if (!bh) {
+			sfs_msg(sb, KERN_ERR, "unable to read indirect block - "
+				"inode=%lu, block=%u", inode->i_ino, addr);
+			continue;
+		}
+		sub_dirty = false;
+		sfs_free_tree(inode, (__le32 *)bh->b_data, DEF_ADDRS_PER_BLOCK,
+			      div_u64(span, DEF_ADDRS_PER_BLOCK), sub_start,
+			      run, &sub_dirty);
+		if (sub_start == 0) {
+			bforget(bh);
+			sfs_free_meta_blocks(inode, addr, 1);
+			p[i] = cpu_to_le32(NULL_ADDR);
+			inode_sub_bytes(inode, sb->s_blocksize);
+			*dirty = true;
+		} else {
+			if (sub_dirty)
+				sfs_journal_dirty(sb, bh, inode);
+			brelse(bh);
+		}
+	}
+}
+
+/*
+ * One past the last block mapped below the @nr pointers of @p, each of
+ * them covering @span blocks, 0 if there is none. An indirect block that
+ * maps nothing, or can't be read, counts as mapping its first block, so
+ * that it is freed as well.
+ */
+static u64 sfs_ind_last(struct inode *inode, __le32 *p, unsigned int nr,
+			u64 span)
+{
+	struct buffer_head *bh;
+	unsigned int i;
+	u64 last = 0;
+
+	for (i = nr; i-- > 0; ) {
+		if (p[i] == cpu_to_le32(NULL_ADDR))
+			continue;
+		if (span == 1)
+			return i + 1;
+
+		bh = sb_bread(inode->i_sb, le32_to_cpu(p[i]));
+		if (bh) {
+			last = sfs_ind_last(inode, (__le32 *)bh->b_data,
+					    DEF_ADDRS_PER_BLOCK,
+					    div_u64(span, DEF_ADDRS_PER_BLOCK));
+			brelse(bh);
+		}
+		return i * span + max_t(u64, last, 1);
+	}
+	return 0;
+}
+
+/*
+ * One truncate step of a block-mapped file: free what is mapped in the
+ * last SFS_TRUNCATE_STEP blocks before *@end, but nothing before @start.
+ * *@end moves down to where the step began. Returns true once @start is
+ * reached.
+ */
+static bool sfs_ind_truncate(struct inode *inode, u64 start, u64 *end,
+			     bool *dirty)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct sfs_free_run run = { 0, 0 };
+	u64 base[DEF_IDPS_PER_INODE], cover[DEF_IDPS_PER_INODE];
+	u64 last = 0, cut;
+	int level;
+
+	base[0] = DEF_ADDRS_PER_INODE;
+	cover[0] = DEF_ADDRS_PER_BLOCK;
+	for (level = 1; level < DEF_IDPS_PER_INODE; level++) {
+		base[level] = base[level - 1] + cover[level - 1];
+		cover[level] = cover[level - 1] * DEF_ADDRS_PER_BLOCK;
+	}
+
+	/* holes are skipped, each step starts at the last mapped block */
+	for (level = DEF_IDPS_PER_INODE - 1; level >= 0 && !last; level--) {
+		last = sfs_ind_last(inode, si->i_data + SFS_IND_BLOCK + level,
+				    1, cover[level]);
+		if (last)
+			last += base[level];
+	}
+	if (!last)
+		last = sfs_ind_last(inode, si->i_data, DEF_ADDRS_PER_INODE, 1);
+
+	*end = min(*end, last);
+	if (*end <= start)
+		return true;
+	cut = *end - start > SFS_TRUNCATE_STEP ? *end - SFS_TRUNCATE_STEP :
+						 start;
+
+	if (cut < DEF_ADDRS_PER_INODE)
+		sfs_free_tree(inode, si->i_data, DEF_ADDRS_PER_INODE, 1,
+			      cut, &run, dirty);
+
+	for (level = 0; level < DEF_IDPS_PER_INODE; level++) {
+		if (cut < base[level] + cover[level])
+			sfs_free_tree(inode, si->i_data + SFS_IND_BLOCK + level,
+				      1, cover[level],
+				      cut > base[level] ? cut - base[level] : 0,
+				      &run, dirty);
+	}
+
+	sfs_free_run_flush(inode, &run);
+	*end = cut;
+	return cut == start;
+}
+
+/*
+ * Release every block that lies past @size, including the indirect blocks
+ * that no longer map anything.
+ *
+ * The blocks go from the end in steps, each in a handle of its own, so
+ * that the truncate of a big file does not outgrow the journal. Between
+ * two steps the file maps a prefix of what it did, which is as good as
+ * the final state after a crash. Called in a handle, as for a new inode
+ * discarded on error, all the steps go into that one, which is fine for
+ * the few blocks such an inode has.
+ */
+void sfs_truncate_blocks(struct inode *inode, loff_t size)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	u64 start = DIV_ROUND_UP(size, inode->i_sb->s_blocksize);
+	u32 first = min_t(u64, start, U32_MAX);
+	u64 end = U64_MAX;
+	u32 ext_end = U32_MAX;
+	struct sfs_handle handle;
+	bool done, dirty;
+
+	do {
+		sfs_journal_start(inode->i_sb, &handle);
+		down_write(&si->i_map_sem);
+		/* lookups between two steps may have cached the tail again */
+		sfs_es_invalidate(inode, first);
+		sfs_release_blocks(SFS_SB(inode->i_sb),
+				   sfs_da_remove(inode, first, U32_MAX - first));
+
+		dirty = false;
+		if (si->i_flags & SFS_EXTENTS_FL) {
+			done = sfs_ext_truncate(inode, first, &ext_end);
+			dirty = true;
+		} else {
+			done = sfs_ind_truncate(inode, start, &end, &dirty);
+		}
+		up_write(&si->i_map_sem);
+
+		if (dirty)
+			mark_inode_dirty(inode);
+		sfs_journal_stop(&handle);
+	} while (!done);
+}
+
+static int sfs_iomap_begin(struct inode *inode, loff_t offset, loff_t length,
+			   unsigned flags, struct iomap *iomap,
+			   struct iomap *srcmap)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t last = (offset + length - 1) >> blkbits;
+	struct sfs_map map;
+	int mflags = 0;
+	int ret;
+
+	if (sfs_has_inline_data(inode))
+		return sfs_iomap_inline(inode, offset, length, iomap);
+
+	map.m_lblk = offset >> blkbits;
+	map.m_len = min_t(sector_t, last - map.m_lblk + 1, UINT_MAX);
+
+	if ((flags & IOMAP_WRITE) &&
+	    ((flags & IOMAP_DIRECT) || IS_DAX(inode))) {
+		/* direct writes need real blocks, there is no page to delay */
+		if (flags & IOMAP_NOWAIT) {
+			ret = sfs_map_blocks(inode, &map, SFS_MAP_NOWAIT);
+			if (ret)
+				return ret;
+			if (map.m_pblk == NULL_ADDR || map.m_pblk == NEW_ADDR)
+				return -EAGAIN;
+			/* already allocated, no handle or i_map_sem write */
+			sfs_set_sync_state(inode, SFS_SYNC_FLUSH);
+			goto mapped;
+		}
+		mflags = SFS_MAP_ALLOC | SFS_MAP_DIRECT;
+		if (IS_DAX(inode))
+			mflags |= SFS_MAP_DAX;
+	} else if (flags & IOMAP_WRITE) {
+		mflags = SFS_MAP_RESERVE;
+	} else if (flags & IOMAP_NOWAIT) {
+		mflags = SFS_MAP_NOWAIT;
+	}
+
+	ret = sfs_map_blocks(inode, &map, mflags);
+	/* out of the handle, the blocks freed by the transaction come back */
+	if (ret == -ENOSPC && sfs_reclaim_held_blocks(inode->i_sb))
+		ret = sfs_map_blocks(inode, &map, mflags);
+	if (ret)
+		return ret;
+	if (mflags & SFS_MAP_DIRECT)
+		sfs_set_sync_state(inode, SFS_SYNC_FLUSH);
+
+mapped:
+	iomap->flags = 0;
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->dax_dev = SFS_SB(inode->i_sb)->s_daxdev;
+	iomap->offset = (u64)map.m_lblk << blkbits;
+	iomap->length = (u64)map.m_len << blkbits;
+
+	if (map.m_pblk == NULL_ADDR) {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+	} else if (map.m_pblk == NEW_ADDR) {
+		iomap->type = IOMAP_DELALLOC;
+		iomap->addr = IOMAP_NULL_ADDR;
+		/* sfs_iomap_end() may only give back what this write reserved */
+		if (map.m_flags & SFS_MAP_NEW)
+			iomap->flags |= IOMAP_F_NEW;
+	} else {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)map.m_pblk << blkbits;
+		if (map.m_flags & SFS_MAP_NEW)
+			iomap->flags |= IOMAP_F_NEW;
+	}
+	return 0;
+}
+
+static int sfs_iomap_end(struct inode *inode, loff_t offset, loff_t length,
+			 ssize_t written, unsigned flags, struct iomap *iomap)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	struct sfs_map map;
+	sector_t iblock, last;
+	int ret;
+
+	if (iomap->flags & IOMAP_F_SIZE_CHANGED)
+		mark_inode_dirty(inode);
+
+	if (iomap->type == IOMAP_INLINE) {
+		brelse(iomap->private);
+		return 0;
+	}
+
+	if (!(flags & IOMAP_WRITE) || iomap->type != IOMAP_DELALLOC ||
+	    !(iomap->flags & IOMAP_F_NEW))
+		return 0;
+
+	/*
+	 * Give back the reservation of the blocks a short write never reached.
+	 * The run was a hole before sfs_iomap_begin() reserved it, so no page
+	 * dirtied by an earlier write relies on it. Writeback may have
+	 * allocated some of it meanwhile, UNRESERVE only drops what is still
+	 * in i_da_tree, under i_map_sem.
+	 */
+	iblock = round_up(offset + max_t(ssize_t, written, 0),
+			  1 << blkbits) >> blkbits;
+	last = (offset + length - 1) >> blkbits;
+	while (iblock <= last) {
+		map.m_lblk = iblock;
+		map.m_len = min_t(sector_t, last - iblock + 1, UINT_MAX);
+		ret = sfs_map_blocks(inode, &map, SFS_MAP_UNRESERVE);
+		if (ret)
+			return ret;
+		iblock += map.m_len;
+	}
+	return 0;
+}
+
+const struct iomap_ops sfs_iomap_ops = {
+	.iomap_begin		= sfs_iomap_begin,
+	.iomap_end		= sfs_iomap_end,
+};
+
+/*
+ * Writeback picks the physical blocks for delayed allocations. The mapping
+ * covers the whole delayed run, so iomap keeps adding the following dirty
+ * pages to the same ioend and submits them as one large bio.
+ */
+static int sfs_map_blocks_wb(struct iomap_writepage_ctx *wpc,
+			     struct inode *inode, loff_t offset)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	loff_t isize = i_size_read(inode);
+	struct sfs_map map;
+	int ret;
+
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length)
+		return 0;
+
+	map.m_lblk = offset >> blkbits;
+	map.m_len = 1;
+	if (isize > offset)
+		map.m_len = min_t(loff_t, UINT_MAX,
+			(isize - offset + (1 << blkbits) - 1) >> blkbits);
+
+	ret = sfs_map_blocks(inode, &map, SFS_MAP_ALLOC);
+	if (ret)
+		return ret;
+	sfs_set_sync_state(inode, SFS_SYNC_FLUSH);
+
+	wpc->iomap.flags = 0;
+	wpc->iomap.type = IOMAP_MAPPED;
+	wpc->iomap.bdev = inode->i_sb->s_bdev;
+	wpc->iomap.offset = (u64)map.m_lblk << blkbits;
+	wpc->iomap.length = (u64)map.m_len << blkbits;
+	wpc->iomap.addr = (u64)map.m_pblk << blkbits;
+	return 0;
+}
+
+static const struct iomap_writeback_ops sfs_writeback_ops = {
+	.map_blocks		= sfs_map_blocks_wb,
+};
+
+static int sfs_readpage(struct file *file, struct page *page)
+{
+	return iomap_readpage(page, &sfs_iomap_ops);
+}
+
+static void sfs_readahead(struct readahead_control *rac)
+{
+	iomap_readahead(rac, &sfs_iomap_ops);
+}
+
+static int sfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	if (sfs_has_inline_data(page->mapping->host))
+		return sfs_write_inline_page(page, wbc, NULL);
+	return iomap_writepage(page, wbc, &wpc, &sfs_writeback_ops);
+}
+
+static int sfs_writepages(struct address_space *mapping,
+			  struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+	long nr_to_write = wbc->nr_to_write;
+	u64 t0 = sfs_trace_clock(sfs_writepages);
+	int err;
+
+	if (sfs_has_inline_data(mapping->host))
+		err = write_cache_pages(mapping, wbc, sfs_write_inline_page,
+					NULL);
+	else
+		err = iomap_writepages(mapping, wbc, &wpc, &sfs_writeback_ops);
+	trace_sfs_writepages(mapping->host, wbc, nr_to_write, err,
+			     sfs_trace_since(t0));
+	return err;
+}
+
+static sector_t sfs_bmap(struct address_space *mapping, sector_t block)
+{
+	/* bmap users read the device directly, allocate what is delayed */
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(mapping);
+	return iomap_bmap(mapping, block, &sfs_iomap_ops);
+}
+
+const struct address_space_operations sfs_aops = {
+	.readpage		= sfs_readpage,
+	.readahead		= sfs_readahead,
+	.writepage		= sfs_writepage,
+	.writepages		= sfs_writepages,
+	.set_page_dirty		= iomap_set_page_dirty,
+	.releasepage		= iomap_releasepage,
+	.invalidatepage		= iomap_invalidatepage,
+	.bmap			= sfs_bmap,
+	.direct_IO		= noop_direct_IO,
+	.migratepage		= iomap_migrate_page,
+	.is_partially_uptodate	= iomap_is_partially_uptodate,
+	.error_remove_page	= generic_error_remove_page,
+};
+
+static int sfs_dax_writepages(struct address_space *mapping,
+			      struct writeback_control *wbc)
+{
+	return dax_writeback_mapping_range(mapping,
+					   SFS_SB(mapping->host->i_sb)->s_daxdev,
+					   wbc);
+}
+
+const struct address_space_operations sfs_dax_aops = {
+	.writepages		= sfs_dax_writepages,
+	.direct_IO		= noop_direct_IO,
+	.set_page_dirty		= noop_set_page_dirty,
+	.invalidatepage		= noop_invalidatepage,
+};
@@ -0,0 +1,569 @@
+/*
+ * dir.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/bitops.h>
+#include <linux/blkdev.h>
+
+#include "sfs.h"
+#include "sfs_trace.h"
+
+/*
+ * A directory is an array of dentry blocks, a slot is in use when its bit
+ * is set in the bitmap of the block. Only NR_DENTRY_IN_BLOCK slots fit in
+ * a block, the rest of struct sfs_dentry_block is never touched.
+ *
+ * A linear directory keeps its entries in any slot of any block and lookup
+ * scans all of them. A directory with SFS_INDEX_FL is hashed (see
+ * sfs_fs.h), lookup reads a single bucket per hash level.
+ */
+
+static inline bool sfs_dir_hashed(struct inode *dir)
+{
+	return SFS_I(dir)->i_flags & SFS_INDEX_FL;
+}
+
+static inline unsigned long sfs_dir_blocks(struct inode *dir)
+{
+	return dir->i_size >> dir->i_blkbits;
+}
+
+/* blocks of the directory read ahead of readdir */
+#define SFS_DIR_RA_BLOCKS	16
+
+/* FNV-1a, the hash is part of the on-disk format */
+static u32 sfs_dentry_hash(const unsigned char *name, unsigned int len)
+{
+	u32 hash = 2166136261U;
+
+	while (len--) {
+		hash ^= *name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static inline unsigned long sfs_level_start(unsigned int level)
+{
+	return SFS_DIR_BUCKET_BLOCKS * ((1UL << level) - 1);
+}
+
+static inline unsigned long sfs_bucket_start(unsigned int level, u32 hash)
+{
+	return sfs_level_start(level) +
+		(hash & ((1U << level) - 1)) * SFS_DIR_BUCKET_BLOCKS;
+}
+
+/* # of hash levels, i_size ends on the last one */
+static unsigned int sfs_dir_levels(struct inode *dir)
+{
+	unsigned long nblocks = sfs_dir_blocks(dir);
+	unsigned int level = 0;
+
+	while (level < SFS_MAX_DIR_HASH_DEPTH &&
+	       sfs_level_start(level + 1) <= nblocks)
+		level++;
+	return level;
+}
+
+static inline unsigned int sfs_de_namelen(struct sfs_dir_entry *de)
+{
+	return strnlen((char *)de->filename, SFS_SLOT_LEN);
+}
+
+static inline bool sfs_match(const struct qstr *name, struct sfs_dir_entry *de)
+{
+	return sfs_de_namelen(de) == name->len &&
+		!memcmp(de->filename, name->name, name->len);
+}
+
+static unsigned short sfs_type_by_mode(umode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		return SFS_REG_FILE;
+	case S_IFDIR:
+		return SFS_DIR;
+	case S_IFLNK:
+		return SFS_SYMLINK;
+	}
+	return SFS_UNKNOWN;
+}
+
+static void sfs_set_de(struct sfs_dir_entry *de, const char *name,
+		       unsigned int len, struct inode *inode)
+{
+	memset(de, 0, sizeof(*de));
+	de->file_type = cpu_to_le16(sfs_type_by_mode(inode->i_mode));
+	de->i_no = cpu_to_le16(inode->i_ino);
+	de->i_addr = cpu_to_le32(sfs_ino_to_addr(SFS_SB(inode->i_sb),
+						 inode->i_ino));
+	memcpy(de->filename, name, len);
+}
+
+/*
+ * sfs_dir_bread - read block @lblk of @dir
+ *
+ * A hole reads as NULL with *err left at 0, unless @create is set in which
+ * case a zeroed block is allocated for it.
+ */
+static struct buffer_head *sfs_dir_bread(struct inode *dir, sector_t lblk,
+					 bool create, int *err)
+{
+	struct super_block *sb = dir->i_sb;
+	struct sfs_map map = { .m_lblk = lblk, .m_len = 1 };
+	struct buffer_head *bh;
+
+	*err = sfs_map_blocks(dir, &map,
+			      create ? SFS_MAP_ALLOC | SFS_MAP_DIRECT : 0);
+	if (*err || map.m_pblk == NULL_ADDR)
+		return NULL;
+
+	if (map.m_flags & SFS_MAP_NEW) {
+		bh = sb_getblk(sb, map.m_pblk);
+		if (unlikely(!bh)) {
+			*err = -ENOMEM;
+			return NULL;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, bh->b_size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		sfs_journal_dirty(dir->i_sb, bh, dir);
+		return bh;
+	}
+
+	bh = sb_bread(sb, map.m_pblk);
+	if (!bh) {
+		sfs_msg(sb, KERN_ERR, "unable to read directory block - "
+			"inode=%lu, block=%llu", dir->i_ino,
+			(unsigned long long)map.m_pblk);
+		*err = -EIO;
+	}
+	return bh;
+}
+
+/*
+ * Start reading blocks [start, end) of @dir, holes are skipped and each
+ * contiguous run goes out under one plug.
+ */
+static void sfs_dir_readahead(struct inode *dir, unsigned long start,
+			      unsigned long end)
+{
+	struct super_block *sb = dir->i_sb;
+	struct blk_plug plug;
+	struct sfs_map map;
+	unsigned int i;
+
+	blk_start_plug(&plug);
+	while (start < end) {
+		map.m_lblk = start;
+		map.m_len = end - start;
+		if (sfs_map_blocks(dir, &map, 0))
+			break;
+		if (map.m_pblk != NULL_ADDR)
+			for (i = 0; i < map.m_len; i++)
+				sb_breadahead(sb, map.m_pblk + i);
+		start += map.m_len;
+	}
+	blk_finish_plug(&plug);
+}
+
+static unsigned char sfs_filetype_table[] = {
+	[SFS_UNKNOWN]	= DT_UNKNOWN,
+	[SFS_REG_FILE]	= DT_REG,
+	[SFS_DIR]	= DT_DIR,
+	[SFS_SYMLINK]	= DT_LNK,
+};
+
+static inline unsigned char sfs_dtype(struct sfs_dir_entry *de)
+{
+	unsigned int type = le16_to_cpu(de->file_type);
+
+	if (type < ARRAY_SIZE(sfs_filetype_table))
+		return sfs_filetype_table[type];
+	return DT_UNKNOWN;
+}
+
+/*
+ * f_pos of a directory is (block << blkbits) | slot. Used slots are found
+ * with find_next_bit_le(), which tests a word of the bitmap at a time, so
+ * sparse blocks cost little more than the read.
+ */
+int sfs_readdir(struct file *file, struct dir_context *ctx)
+{
+	struct inode *inode = file_inode(file);
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+	unsigned int bits = inode->i_blkbits;
+	unsigned long nblocks = sfs_dir_blocks(inode);
+	unsigned long n = ctx->pos >> bits;
+	unsigned int slot = ctx->pos & ((1U << bits) - 1);
+	unsigned long ra_end = n;
+	struct sfs_dentry_block *db;
+	struct sfs_dir_entry *de;
+	struct buffer_head *bh;
+	int err;
+
+	for (; n < nblocks; n++, slot = 0) {
+		/* keep the next half window in flight */
+		if (n + SFS_DIR_RA_BLOCKS / 2 >= ra_end && ra_end < nblocks) {
+			unsigned long ra_start = max(n, ra_end);
+
+			ra_end = min(n + SFS_DIR_RA_BLOCKS, nblocks);
+			sfs_dir_readahead(inode, ra_start, ra_end);
+		}
+
+		bh = sfs_dir_bread(inode, n, false, &err);
+		if (err)
+			return err;
+		if (!bh)
+			continue;
+
+		db = (struct sfs_dentry_block *)bh->b_data;
+		for (slot = find_next_bit_le(db->dentry_bitmap,
+					     NR_DENTRY_IN_BLOCK, slot);
+		     slot < NR_DENTRY_IN_BLOCK;
+		     slot = find_next_bit_le(db->dentry_bitmap,
+					     NR_DENTRY_IN_BLOCK, slot + 1)) {
+			de = &db->dentry[slot];
+			ctx->pos = ((loff_t)n << bits) | slot;
+			if (!dir_emit(ctx, (char *)de->filename,
+				      sfs_de_namelen(de),
+				      sfs_addr_to_ino(sbi,
+						le32_to_cpu(de->i_addr)),
+				      sfs_dtype(de))) {
+				brelse(bh);
+				return 0;
+			}
+		}
+		brelse(bh);
+		ctx->pos = (loff_t)(n + 1) << bits;
+	}
+	return 0;
+}
+
+static struct sfs_dir_entry *sfs_find_in_block(struct buffer_head *bh,
+					       const struct qstr *name)
+{
+	struct sfs_dentry_block *db = (struct sfs_dentry_block *)bh->b_data;
+	unsigned int slot;
+
+	for (slot = find_next_bit_le(db->dentry_bitmap, NR_DENTRY_IN_BLOCK, 0);
+	     slot < NR_DENTRY_IN_BLOCK;
+	     slot = find_next_bit_le(db->dentry_bitmap, NR_DENTRY_IN_BLOCK,
+				     slot + 1)) {
+		if (sfs_match(name, &db->dentry[slot]))
+			return &db->dentry[slot];
+	}
+	return NULL;
+}
+
+static struct sfs_dir_entry *sfs_find_in_range(struct inode *dir,
+		unsigned long start, unsigned long end,
+		const struct qstr *name, struct buffer_head **res_bh, int *err)
+{
+	struct sfs_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned long n;
+
+	for (n = start; n < end; n++) {
+		bh = sfs_dir_bread(dir, n, false, err);
+		if (*err)
+			return NULL;
+		if (!bh)
+			continue;
+		sfs_stat_inc(SFS_SB(dir->i_sb), SFS_STAT_DIR_BLOCKS);
+		de = sfs_find_in_block(bh, name);
+		if (de) {
+			*res_bh = bh;
+			return de;
+		}
+		brelse(bh);
+	}
+	return NULL;
+}
+
+/*
+ * sfs_find_entry - find @name in @dir
+ *
+ * Returns the entry with the buffer holding it in *res_bh, NULL if there
+ * is no such entry, or an ERR_PTR() on I/O error.
+ */
+struct sfs_dir_entry *sfs_find_entry(struct inode *dir,
+		const struct qstr *name, struct buffer_head **res_bh)
+{
+	struct sfs_sb_info *sbi = SFS_SB(dir->i_sb);
+	struct sfs_dir_entry *de = NULL;
+	unsigned int level, nlevels;
+	unsigned long start;
+	u64 t0;
+	int err = 0;
+	u32 hash;
+
+	*res_bh = NULL;
+	if (name->len > SFS_NAME_LEN)
+		return NULL;
+
+	sfs_stat_inc(sbi, SFS_STAT_DIR_LOOKUPS);
+	t0 = ktime_get_ns();
+	if (!sfs_dir_hashed(dir)) {
+		de = sfs_find_in_range(dir, 0, sfs_dir_blocks(dir), name,
+				       res_bh, &err);
+		goto out;
+	}
+
+	hash = sfs_dentry_hash(name->name, name->len);
+	nlevels = sfs_dir_levels(dir);
+	for (level = 0; level < nlevels && !de && !err; level++) {
+		start = sfs_bucket_start(level, hash);
+		de = sfs_find_in_range(dir, start,
+				       start + SFS_DIR_BUCKET_BLOCKS, name,
+				       res_bh, &err);
+	}
+out:
+	sfs_stat_lat(sbi, SFS_LAT_DIR_LOOKUP, t0);
+	trace_sfs_dir_lookup(dir, name, de ? sfs_addr_to_ino(sbi,
+					le32_to_cpu(de->i_addr)) : 0,
+			     err, ktime_get_ns() - t0);
+	if (err)
+		return ERR_PTR(err);
+	sfs_stat_inc(sbi, de ? SFS_STAT_DIR_HITS : SFS_STAT_DIR_MISSES);
+	return de;
+}
+
+int sfs_inode_by_name(struct inode *dir, const struct qstr *name, ino_t *ino)
+{
+	struct sfs_dir_entry *de;
+	struct buffer_head *bh;
+
+	de = sfs_find_entry(dir, name, &bh);
+	if (IS_ERR(de))
+		return PTR_ERR(de);
+	if (!de)
+		return -ENOENT;
+
+	*ino = sfs_addr_to_ino(SFS_SB(dir->i_sb), le32_to_cpu(de->i_addr));
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Take a free slot in block @lblk of @dir, allocating the block if it is
+ * a hole. Returns 0, -EMLINK if the block is full, or another errno such
+ * as -ENOSPC when the block cannot be allocated.
+ */
+static int sfs_add_to_block(struct inode *dir, unsigned long lblk,
+			    const struct qstr *name, struct inode *inode)
+{
+	struct sfs_dentry_block *db;
+	struct buffer_head *bh;
+	unsigned int slot;
+	int err;
+
+	bh = sfs_dir_bread(dir, lblk, true, &err);
+	if (!bh)
+		return err;
+
+	db = (struct sfs_dentry_block *)bh->b_data;
+	slot = find_next_zero_bit_le(db->dentry_bitmap, NR_DENTRY_IN_BLOCK, 0);
+	if (slot >= NR_DENTRY_IN_BLOCK) {
+		brelse(bh);
+		return -EMLINK;
+	}
+
+	lock_buffer(bh);
+	sfs_set_de(&db->dentry[slot], (const char *)name->name, name->len,
+		   inode);
+	__set_bit_le(slot, db->dentry_bitmap);
+	unlock_buffer(bh);
+	sfs_journal_dirty(dir->i_sb, bh, dir);
+	brelse(bh);
+	return 0;
+}
+
+static int sfs_add_linear(struct inode *dir, const struct qstr *name,
+			  struct inode *inode)
+{
+	unsigned long n, nblocks = sfs_dir_blocks(dir);
+	int err;
+
+	for (n = 0; n < nblocks; n++) {
+		err = sfs_add_to_block(dir, n, name, inode);
+		if (err != -EMLINK)
+			return err;
+	}
+
+	err = sfs_add_to_block(dir, nblocks, name, inode);
+	if (!err)
+		i_size_write(dir, (loff_t)(nblocks + 1) << dir->i_blkbits);
+	return err;
+}
+
+static int sfs_add_hashed(struct inode *dir, const struct qstr *name,
+			  struct inode *inode)
+{
+	u32 hash = sfs_dentry_hash(name->name, name->len);
+	unsigned int level, nlevels = sfs_dir_levels(dir);
+	unsigned long start, n;
+	int err;
+
+	for (level = 0; level < SFS_MAX_DIR_HASH_DEPTH; level++) {
+		start = sfs_bucket_start(level, hash);
+		for (n = start; n < start + SFS_DIR_BUCKET_BLOCKS; n++) {
+			err = sfs_add_to_block(dir, n, name, inode);
+			if (err == -EMLINK)
+				continue;
+			/* a new level is all holes but the bucket we used */
+			if (!err && level >= nlevels)
+				i_size_write(dir, (loff_t)sfs_level_start(level + 1)
+					     << dir->i_blkbits);
+			return err;
+		}
+	}
+	return -ENOSPC;
+}
+
+int sfs_add_link(struct dentry *dentry, struct inode *inode)
+{
+	struct inode *dir = d_inode(dentry->d_parent);
+	const struct qstr *name = &dentry->d_name;
+	u64 t0 = sfs_trace_clock(sfs_dir_insert);
+	int err;
+
+	if (name->len > SFS_NAME_LEN)
+		return -ENAMETOOLONG;
+
+	if (sfs_dir_hashed(dir))
+		err = sfs_add_hashed(dir, name, inode);
+	else
+		err = sfs_add_linear(dir, name, inode);
+	trace_sfs_dir_insert(dir, name, inode->i_ino, err, sfs_trace_since(t0));
+	if (err)
+		return err;
+
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/*
+ * Free the slot of @de, @bh is the buffer returned by sfs_find_entry() and
+ * is released here.
+ */
+int sfs_delete_entry(struct inode *dir, struct sfs_dir_entry *de,
+		     struct buffer_head *bh)
+{
+	struct sfs_dentry_block *db = (struct sfs_dentry_block *)bh->b_data;
+	unsigned int slot = de - db->dentry;
+
+	lock_buffer(bh);
+	__clear_bit_le(slot, db->dentry_bitmap);
+	unlock_buffer(bh);
+	sfs_journal_dirty(dir->i_sb, bh, dir);
+	brelse(bh);
+
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/*
+ * Write "." and ".." into the first block of the new directory @inode, a
+ * hashed directory starts with level 0.
+ */
+int sfs_make_empty(struct inode *inode, struct inode *parent)
+{
+	struct sfs_dentry_block *db;
+	struct buffer_head *bh;
+	unsigned long nblocks = 1;
+	int err;
+
+	bh = sfs_dir_bread(inode, 0, true, &err);
+	if (!bh)
+		return err ? err : -EIO;
+
+	db = (struct sfs_dentry_block *)bh->b_data;
+	lock_buffer(bh);
+	sfs_set_de(&db->dentry[0], ".", 1, inode);
+	sfs_set_de(&db->dentry[1], "..", 2, parent);
+	__set_bit_le(0, db->dentry_bitmap);
+	__set_bit_le(1, db->dentry_bitmap);
+	unlock_buffer(bh);
+	sfs_journal_dirty(inode->i_sb, bh, inode);
+	brelse(bh);
+
+	if (sfs_dir_hashed(inode))
+		nblocks = sfs_level_start(1);
+	i_size_write(inode, (loff_t)nblocks << inode->i_blkbits);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/* does the dentry block in @bh hold anything but "." and ".."? */
+static bool sfs_block_in_use(struct buffer_head *bh)
+{
+	struct sfs_dentry_block *db = (struct sfs_dentry_block *)bh->b_data;
+	struct sfs_dir_entry *de;
+	unsigned int slot, len;
+
+	for (slot = find_next_bit_le(db->dentry_bitmap, NR_DENTRY_IN_BLOCK, 0);
+	     slot < NR_DENTRY_IN_BLOCK;
+	     slot = find_next_bit_le(db->dentry_bitmap, NR_DENTRY_IN_BLOCK,
+				     slot + 1)) {
+		de = &db->dentry[slot];
+		len = sfs_de_namelen(de);
+		if (de->filename[0] != '.' || len > 2 ||
+		    (len == 2 && de->filename[1] != '.'))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Returns 1 if @inode has no entries other than "." and "..", 0 if it
+ * has, or a negative errno. Only mapped blocks are read, the unused
+ * buckets of a hashed directory are holes.
+ */
+int sfs_empty_dir(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long start = 0, nblocks = sfs_dir_blocks(inode);
+	struct buffer_head *bh;
+	struct sfs_map map;
+	unsigned int i;
+	bool used;
+	int err;
+
+	while (start < nblocks) {
+		map.m_lblk = start;
+		map.m_len = nblocks - start;
+		err = sfs_map_blocks(inode, &map, 0);
+		if (err)
+			return err;
+		start += map.m_len;
+		if (map.m_pblk == NULL_ADDR)
+			continue;
+
+		for (i = 0; i < map.m_len; i++) {
+			bh = sb_bread(sb, map.m_pblk + i);
+			if (!bh) {
+				sfs_msg(sb, KERN_ERR, "unable to read directory "
+					"block - inode=%lu, block=%llu",
+					inode->i_ino,
+					(unsigned long long)map.m_pblk + i);
+				return -EIO;
+			}
+			used = sfs_block_in_use(bh);
+			brelse(bh);
+			if (used)
+				return 0;
+		}
+	}
+	return 1;
+}
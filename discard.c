@@ -0,0 +1,254 @@
+/*
+ * discard.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "sfs.h"
+
+/*
+ * Asynchronous discard (-o discard=async)
+ *
+ * Freed data blocks are not given back to the allocator right away. Their
+ * runs are queued in an rbtree sorted by start block, where a run next to
+ * one already queued is merged with it, so deleting a file or a whole tree
+ * ends up as a few large discards. A worker waits SFS_DISCARD_DELAY for
+ * the frees to pile up, then discards at most SFS_DISCARD_BATCH blocks
+ * every SFS_DISCARD_INTERVAL, and only after a discard completes do its
+ * blocks return to the allocator. Nobody freeing blocks waits for the
+ * device.
+ *
+ * The queued blocks are missing from the free count meanwhile. An
+ * allocation running out of space drains the queue before giving up.
+ */
+
+#define SFS_DISCARD_DELAY	HZ		/* time to merge new frees */
+#define SFS_DISCARD_INTERVAL	(HZ / 20)	/* between two batches */
+#define SFS_DISCARD_BATCH	8192		/* blocks per batch at most */
+#define SFS_DISCARD_RANGES	64		/* runs per batch at most */
+
+struct sfs_discard_range {
+	struct rb_node dr_node;
+	u32 dr_start;
+	u32 dr_len;
+};
+
+struct sfs_discard {
+	struct super_block *dc_sb;
+	spinlock_t dc_lock;		/* protects dc_root and dc_queued */
+	struct rb_root dc_root;		/* queued runs by start block */
+	u64 dc_queued;			/* # of queued blocks */
+	struct delayed_work dc_work;
+};
+
+/*
+ * Queue a run whose dmap bits are already clear. Returns false if async
+ * discard is off or the run cannot be queued, the caller gives the blocks
+ * back to the allocator then.
+ */
+bool sfs_discard_queue(struct super_block *sb, u32 start, u32 len)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_discard *dc = sbi->s_discard;
+	struct sfs_discard_range *new, *prev = NULL, *next;
+	struct rb_node **p, *parent = NULL;
+
+	if (!dc || !test_opt(sbi, DISCARD_ASYNC))
+		return false;
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+	if (!new)
+		return false;
+
+	spin_lock(&dc->dc_lock);
+	p = &dc->dc_root.rb_node;
+	while (*p) {
+		parent = *p;
+		next = rb_entry(parent, struct sfs_discard_range, dr_node);
+		if (start < next->dr_start) {
+			p = &parent->rb_left;
+		} else {
+			prev = next;
+			p = &parent->rb_right;
+		}
+	}
+	next = prev ? rb_entry_safe(rb_next(&prev->dr_node),
+				    struct sfs_discard_range, dr_node) :
+		      rb_entry_safe(rb_first(&dc->dc_root),
+				    struct sfs_discard_range, dr_node);
+
+	if (prev && prev->dr_start + prev->dr_len == start) {
+		prev->dr_len += len;
+		if (next && start + len == next->dr_start) {
+			prev->dr_len += next->dr_len;
+			rb_erase(&next->dr_node, &dc->dc_root);
+			kfree(next);
+		}
+	} else if (next && start + len == next->dr_start) {
+		/* moving the start down keeps the tree order */
+		next->dr_start = start;
+		next->dr_len += len;
+	} else {
+		new->dr_start = start;
+		new->dr_len = len;
+		rb_link_node(&new->dr_node, parent, p);
+		rb_insert_color(&new->dr_node, &dc->dc_root);
+		new = NULL;
+	}
+	dc->dc_queued += len;
+	spin_unlock(&dc->dc_lock);
+
+	kfree(new);
+	queue_delayed_work(system_long_wq, &dc->dc_work, SFS_DISCARD_DELAY);
+	return true;
+}
+
+/* hand a discarded run back, group by group */
+static void sfs_discard_release(struct sfs_sb_info *sbi, u32 start, u32 len)
+{
+	struct sfs_alloc_group *ag;
+	u32 n;
+
+	while (len) {
+		ag = &sbi->s_groups[sfs_block_group(sbi, start)];
+		n = min(len, ag->ag_start + ag->ag_len - start);
+		sfs_put_free_blocks(sbi, start, n);
+		start += n;
+		len -= n;
+	}
+}
+
+/*
+ * Discard up to @budget blocks from the lowest queued ones, as one bio
+ * chain. Returns the # of blocks given back.
+ */
+static u32 sfs_discard_batch(struct sfs_discard *dc, u32 budget)
+{
+	struct super_block *sb = dc->dc_sb;
+	unsigned int shift = sb->s_blocksize_bits - 9;
+	struct {
+		u32 start;
+		u32 len;
+	} run[SFS_DISCARD_RANGES];
+	struct sfs_discard_range *dr;
+	struct rb_node *node;
+	struct bio *bio = NULL;
+	u32 blocks = 0;
+	int i, n = 0;
+
+	spin_lock(&dc->dc_lock);
+	while (blocks < budget && n < SFS_DISCARD_RANGES &&
+	       (node = rb_first(&dc->dc_root))) {
+		dr = rb_entry(node, struct sfs_discard_range, dr_node);
+		run[n].start = dr->dr_start;
+		run[n].len = min(dr->dr_len, budget - blocks);
+		if (run[n].len == dr->dr_len) {
+			rb_erase(&dr->dr_node, &dc->dc_root);
+			kfree(dr);
+		} else {
+			dr->dr_start += run[n].len;
+			dr->dr_len -= run[n].len;
+		}
+		blocks += run[n].len;
+		n++;
+	}
+	dc->dc_queued -= blocks;
+	spin_unlock(&dc->dc_lock);
+
+	/* discard is only a hint, the blocks are free either way */
+	for (i = 0; i < n; i++)
+		if (__blkdev_issue_discard(sb->s_bdev,
+					   (sector_t)run[i].start << shift,
+					   (sector_t)run[i].len << shift,
+					   GFP_NOFS, 0, &bio))
+			break;
+	if (bio) {
+		submit_bio_wait(bio);
+		bio_put(bio);
+	}
+
+	for (i = 0; i < n; i++)
+		sfs_discard_release(SFS_SB(sb), run[i].start, run[i].len);
+	return blocks;
+}
+
+static void sfs_discard_work(struct work_struct *work)
+{
+	struct sfs_discard *dc = container_of(to_delayed_work(work),
+					      struct sfs_discard, dc_work);
+
+	sfs_discard_batch(dc, SFS_DISCARD_BATCH);
+	if (READ_ONCE(dc->dc_queued))
+		queue_delayed_work(system_long_wq, &dc->dc_work,
+				   SFS_DISCARD_INTERVAL);
+}
+
+/*
+ * Discard everything queued now, without the rate limit. Returns false if
+ * the queue was empty.
+ */
+bool sfs_discard_flush(struct super_block *sb)
+{
+	struct sfs_discard *dc = SFS_SB(sb)->s_discard;
+	bool freed = false;
+
+	if (!dc)
+		return false;
+	while (sfs_discard_batch(dc, U32_MAX))
+		freed = true;
+	return freed;
+}
+
+/*
+ * The queue exists whenever the device can discard, so remount can turn
+ * discard=async on and off while blocks are being freed.
+ */
+int sfs_discard_init(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_discard *dc;
+
+	if (!blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		if (test_opt(sbi, DISCARD_ASYNC))
+			sfs_msg(sb, KERN_WARNING, "device does not support "
+				"discard, discard=async ignored");
+		clear_opt(sbi, DISCARD_ASYNC);
+		return 0;
+	}
+
+	dc = kzalloc(sizeof(*dc), GFP_KERNEL);
+	if (!dc)
+		return -ENOMEM;
+	dc->dc_sb = sb;
+	spin_lock_init(&dc->dc_lock);
+	dc->dc_root = RB_ROOT;
+	INIT_DELAYED_WORK(&dc->dc_work, sfs_discard_work);
+	sbi->s_discard = dc;
+	return 0;
+}
+
+/*
+ * Discard what is left, the free count is complete afterwards.
+ */
+void sfs_discard_destroy(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_discard *dc = sbi->s_discard;
+
+	if (!dc)
+		return;
+
+	cancel_delayed_work_sync(&dc->dc_work);
+	sfs_discard_flush(sb);
+	WARN_ON(!RB_EMPTY_ROOT(&dc->dc_root));
+	sbi->s_discard = NULL;
+	kfree(dc);
+}
@@ -0,0 +1,476 @@
+/*
+ * extent_cache.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/shrinker.h>
+
+#include "sfs.h"
+
+/*
+ * Every inode keeps the runs of blocks that sfs_map_blocks() resolved to
+ * disk addresses in an rbtree, so the next lookup in the same run skips
+ * the indirect blocks or extent nodes. Only allocated blocks are cached:
+ * their address never changes until truncate, which drops the runs past
+ * the new size. Holes and delayed allocations always go to the map.
+ *
+ * Runs are added under i_map_sem, so a lookup can't cache blocks that a
+ * concurrent truncate is freeing. Inodes with cached runs are on the
+ * s_es_list of the super block, from which the shrinker frees them in
+ * clock order: an inode used since the last pass gets another round.
+ *
+ * The delayed allocations of an inode live in a second tree of the same
+ * runs, i_da_tree, see sfs_da_lookup().
+ */
+
+static struct kmem_cache *sfs_es_cachep;
+
+static inline u32 sfs_es_end(struct sfs_es *es)
+{
+	return es->es_lblk + es->es_len;
+}
+
+/* the run of @root holding @lblk, or the one right before it */
+static struct sfs_es *sfs_es_search(struct rb_root *root, u32 lblk,
+				    struct sfs_es **next)
+{
+	struct rb_node *node = root->rb_node;
+	struct sfs_es *es, *prev = NULL;
+
+	*next = NULL;
+	while (node) {
+		es = rb_entry(node, struct sfs_es, es_node);
+		if (lblk < es->es_lblk) {
+			*next = es;
+			node = node->rb_left;
+		} else {
+			prev = es;
+			node = node->rb_right;
+		}
+	}
+	return prev;
+}
+
+bool sfs_es_lookup(struct inode *inode, struct sfs_map *map)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+	struct sfs_es *es, *next;
+	bool hit = false;
+
+	if (RB_EMPTY_ROOT(&si->i_es_tree) || map->m_lblk >= U32_MAX)
+		goto out;
+
+	read_lock(&si->i_es_lock);
+	es = sfs_es_search(&si->i_es_tree, map->m_lblk, &next);
+	if (es && map->m_lblk < sfs_es_end(es)) {
+		map->m_pblk = es->es_pblk + (map->m_lblk - es->es_lblk);
+		map->m_len = min_t(u32, map->m_len,
+				   sfs_es_end(es) - map->m_lblk);
+		map->m_flags = 0;
+		hit = true;
+	}
+	read_unlock(&si->i_es_lock);
+
+	if (hit && !READ_ONCE(si->i_es_ref))
+		WRITE_ONCE(si->i_es_ref, true);
+out:
+	sfs_stat_inc(sbi, hit ? SFS_STAT_MAP_CACHE_HITS :
+				 SFS_STAT_MAP_CACHE_MISSES);
+	return hit;
+}
+
+static void sfs_es_erase(struct sfs_inode_info *si, struct sfs_es *es)
+{
+	rb_erase(&es->es_node, &si->i_es_tree);
+	kmem_cache_free(sfs_es_cachep, es);
+	si->i_es_nr--;
+}
+
+/* called with i_es_lock held when the inode lost its last run */
+static void sfs_es_unlist(struct sfs_sb_info *sbi, struct sfs_inode_info *si)
+{
+	spin_lock(&sbi->s_es_lock);
+	list_del_init(&si->i_es_list);
+	sbi->s_es_inodes--;
+	spin_unlock(&sbi->s_es_lock);
+}
+
+/*
+ * Remember that [lblk, lblk + len) lives at @pblk, called with i_map_sem
+ * held. The run is merged with the ones it touches.
+ */
+void sfs_es_insert(struct inode *inode, u32 lblk, u32 pblk, u32 len)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+	struct sfs_es *es, *prev, *next, *new;
+	struct rb_node **p, *parent;
+	unsigned long es_max = READ_ONCE(sbi->s_es_max);
+	u32 skip;
+
+	/* past the cap of the mount only runs that merge are cached */
+	if (es_max && atomic_long_read(&sbi->s_es_nr) >= es_max)
+		new = NULL;
+	else
+		new = kmem_cache_alloc(sfs_es_cachep, GFP_NOFS);
+
+	write_lock(&si->i_es_lock);
+	prev = sfs_es_search(&si->i_es_tree, lblk, &next);
+
+	/* keep the runs disjoint, the part already cached is the same */
+	if (prev && sfs_es_end(prev) > lblk) {
+		skip = min(len, sfs_es_end(prev) - lblk);
+		lblk += skip;
+		pblk += skip;
+		len -= skip;
+		if (!len)
+			goto out;
+		prev = sfs_es_search(&si->i_es_tree, lblk, &next);
+		if (sfs_es_end(prev) > lblk)
+			goto out;
+	}
+	if (next && lblk + len > next->es_lblk)
+		len = next->es_lblk - lblk;
+
+	if (prev && sfs_es_end(prev) == lblk &&
+	    prev->es_pblk + prev->es_len == pblk) {
+		prev->es_len += len;
+		if (next && sfs_es_end(prev) == next->es_lblk &&
+		    prev->es_pblk + prev->es_len == next->es_pblk) {
+			prev->es_len += next->es_len;
+			sfs_es_erase(si, next);
+			atomic_long_dec(&sbi->s_es_nr);
+		}
+		goto out;
+	}
+	if (next && lblk + len == next->es_lblk && pblk + len == next->es_pblk) {
+		next->es_lblk = lblk;
+		next->es_pblk = pblk;
+		next->es_len += len;
+		goto out;
+	}
+
+	if (!new)
+		goto out;
+
+	p = &si->i_es_tree.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		es = rb_entry(parent, struct sfs_es, es_node);
+		p = lblk < es->es_lblk ? &parent->rb_left : &parent->rb_right;
+	}
+	new->es_lblk = lblk;
+	new->es_pblk = pblk;
+	new->es_len = len;
+	rb_link_node(&new->es_node, parent, p);
+	rb_insert_color(&new->es_node, &si->i_es_tree);
+	new = NULL;
+
+	if (!si->i_es_nr++) {
+		spin_lock(&sbi->s_es_lock);
+		list_add_tail(&si->i_es_list, &sbi->s_es_list);
+		sbi->s_es_inodes++;
+		spin_unlock(&sbi->s_es_lock);
+	}
+	atomic_long_inc(&sbi->s_es_nr);
+out:
+	write_unlock(&si->i_es_lock);
+	if (new)
+		kmem_cache_free(sfs_es_cachep, new);
+}
+
+/*
+ * Forget the blocks from @start on, called by truncate with i_map_sem held
+ * for write.
+ */
+void sfs_es_invalidate(struct inode *inode, u32 start)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+	struct sfs_es *es, *next;
+	struct rb_node *node;
+	unsigned int dropped = 0;
+
+	if (RB_EMPTY_ROOT(&si->i_es_tree))
+		return;
+
+	write_lock(&si->i_es_lock);
+	es = sfs_es_search(&si->i_es_tree, start, &next);
+	if (es && sfs_es_end(es) > start) {
+		es->es_len = start - es->es_lblk;
+		node = rb_next(&es->es_node);
+		if (!es->es_len) {
+			sfs_es_erase(si, es);
+			dropped++;
+		}
+		next = node ? rb_entry(node, struct sfs_es, es_node) : NULL;
+	}
+	while (next) {
+		node = rb_next(&next->es_node);
+		sfs_es_erase(si, next);
+		dropped++;
+		next = node ? rb_entry(node, struct sfs_es, es_node) : NULL;
+	}
+	if (dropped && !si->i_es_nr)
+		sfs_es_unlist(sbi, si);
+	write_unlock(&si->i_es_lock);
+
+	atomic_long_sub(dropped, &sbi->s_es_nr);
+}
+
+static unsigned long __sfs_es_drop(struct sfs_inode_info *si)
+{
+	struct sfs_es *es, *tmp;
+	unsigned long nr = si->i_es_nr;
+
+	rbtree_postorder_for_each_entry_safe(es, tmp, &si->i_es_tree, es_node)
+		kmem_cache_free(sfs_es_cachep, es);
+	si->i_es_tree = RB_ROOT;
+	si->i_es_nr = 0;
+	return nr;
+}
+
+/* the inode is going away */
+void sfs_es_drop(struct inode *inode)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+	unsigned long nr;
+
+	if (RB_EMPTY_ROOT(&si->i_es_tree))
+		return;
+
+	write_lock(&si->i_es_lock);
+	nr = __sfs_es_drop(si);
+	if (nr)
+		sfs_es_unlist(sbi, si);
+	write_unlock(&si->i_es_lock);
+
+	atomic_long_sub(nr, &sbi->s_es_nr);
+}
+
+/*
+ * Delayed allocations
+ *
+ * A block that write() reserved and writeback did not place yet exists in
+ * memory only, as a run of i_da_tree holding its reservation in
+ * s_dirtyblocks_counter. The block map keeps a hole there, so neither a
+ * crash nor an unmount leaves a reservation on disk. The runs have no
+ * physical block, they are protected by i_map_sem and never reclaimed,
+ * each of their blocks is under a dirty page.
+ */
+
+static void sfs_da_link(struct sfs_inode_info *si, struct sfs_es *new)
+{
+	struct rb_node **p = &si->i_da_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct sfs_es *es;
+
+	while (*p) {
+		parent = *p;
+		es = rb_entry(parent, struct sfs_es, es_node);
+		p = new->es_lblk < es->es_lblk ? &parent->rb_left :
+						 &parent->rb_right;
+	}
+	rb_link_node(&new->es_node, parent, p);
+	rb_insert_color(&new->es_node, &si->i_da_tree);
+}
+
+/*
+ * Is @lblk a delayed allocation? *@len is cut to the end of the delayed
+ * run, or of the hole before the next one.
+ */
+bool sfs_da_lookup(struct inode *inode, u32 lblk, unsigned int *len)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct sfs_es *es, *next;
+
+	if (RB_EMPTY_ROOT(&si->i_da_tree))
+		return false;
+
+	es = sfs_es_search(&si->i_da_tree, lblk, &next);
+	if (es && lblk < sfs_es_end(es)) {
+		*len = min_t(u32, *len, sfs_es_end(es) - lblk);
+		return true;
+	}
+	if (next)
+		*len = min_t(u32, *len, next->es_lblk - lblk);
+	return false;
+}
+
+/*
+ * Record [lblk, lblk + len), a hole with blocks reserved, as a delayed
+ * allocation. Called with i_map_sem held for write.
+ */
+int sfs_da_insert(struct inode *inode, u32 lblk, u32 len)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct sfs_es *es, *next, *new;
+
+	es = sfs_es_search(&si->i_da_tree, lblk, &next);
+	if (es && sfs_es_end(es) == lblk) {
+		es->es_len += len;
+		if (next && sfs_es_end(es) == next->es_lblk) {
+			es->es_len += next->es_len;
+			rb_erase(&next->es_node, &si->i_da_tree);
+			kmem_cache_free(sfs_es_cachep, next);
+		}
+		goto out;
+	}
+	if (next && lblk + len == next->es_lblk) {
+		next->es_lblk = lblk;
+		next->es_len += len;
+		goto out;
+	}
+
+	new = kmem_cache_alloc(sfs_es_cachep, GFP_NOFS);
+	if (!new)
+		return -ENOMEM;
+	new->es_lblk = lblk;
+	new->es_pblk = NEW_ADDR;
+	new->es_len = len;
+	sfs_da_link(si, new);
+out:
+	WRITE_ONCE(si->i_da_blocks, si->i_da_blocks + len);
+	return 0;
+}
+
+/*
+ * Forget the delayed allocations in [lblk, lblk + len), called with
+ * i_map_sem held for write. Returns the number of blocks dropped, the
+ * caller hands on or releases their reservation.
+ */
+unsigned int sfs_da_remove(struct inode *inode, u32 lblk, u32 len)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct sfs_es *es, *next, *new;
+	struct rb_node *node;
+	unsigned int removed = 0;
+	u32 end = lblk + len, from, to, es_end;
+
+	if (RB_EMPTY_ROOT(&si->i_da_tree))
+		return 0;
+
+	es = sfs_es_search(&si->i_da_tree, lblk, &next);
+	if (!es || sfs_es_end(es) <= lblk)
+		es = next;
+	while (es && es->es_lblk < end) {
+		node = rb_next(&es->es_node);
+		es_end = sfs_es_end(es);
+		from = max(lblk, es->es_lblk);
+		to = min(end, es_end);
+		removed += to - from;
+
+		if (from > es->es_lblk && to < es_end) {
+			/* a hole in the middle, the tail becomes a new run */
+			new = kmem_cache_alloc(sfs_es_cachep,
+					       GFP_NOFS | __GFP_NOFAIL);
+			new->es_lblk = to;
+			new->es_pblk = NEW_ADDR;
+			new->es_len = es_end - to;
+			es->es_len = from - es->es_lblk;
+			sfs_da_link(si, new);
+			break;
+		}
+		if (from > es->es_lblk) {
+			es->es_len = from - es->es_lblk;
+		} else if (to < es_end) {
+			es->es_lblk = to;
+			es->es_len = es_end - to;
+		} else {
+			rb_erase(&es->es_node, &si->i_da_tree);
+			kmem_cache_free(sfs_es_cachep, es);
+		}
+		es = node ? rb_entry(node, struct sfs_es, es_node) : NULL;
+	}
+
+	WRITE_ONCE(si->i_da_blocks, si->i_da_blocks - removed);
+	return removed;
+}
+
+static unsigned long sfs_es_count(struct shrinker *shrink,
+				  struct shrink_control *sc)
+{
+	struct sfs_sb_info *sbi = container_of(shrink, struct sfs_sb_info,
+					       s_es_shrinker);
+	unsigned long nr = atomic_long_read(&sbi->s_es_nr);
+
+	return nr ? nr : SHRINK_EMPTY;
+}
+
+/*
+ * The list lock nests outside of i_es_lock here, so the inode lock is
+ * only tried. An inode that is busy or was used lately goes to the tail.
+ */
+static unsigned long sfs_es_scan(struct shrinker *shrink,
+				 struct shrink_control *sc)
+{
+	struct sfs_sb_info *sbi = container_of(shrink, struct sfs_sb_info,
+					       s_es_shrinker);
+	struct sfs_inode_info *si;
+	unsigned long freed = 0, nr;
+	unsigned long budget;
+
+	spin_lock(&sbi->s_es_lock);
+	/* every inode gets at most two looks, one to clear its reference */
+	budget = 2 * sbi->s_es_inodes;
+	while (freed < sc->nr_to_scan && budget-- &&
+	       !list_empty(&sbi->s_es_list)) {
+		si = list_first_entry(&sbi->s_es_list, struct sfs_inode_info,
+				      i_es_list);
+		if (READ_ONCE(si->i_es_ref) || !write_trylock(&si->i_es_lock)) {
+			WRITE_ONCE(si->i_es_ref, false);
+			list_move_tail(&si->i_es_list, &sbi->s_es_list);
+			continue;
+		}
+		nr = __sfs_es_drop(si);
+		list_del_init(&si->i_es_list);
+		sbi->s_es_inodes--;
+		write_unlock(&si->i_es_lock);
+
+		atomic_long_sub(nr, &sbi->s_es_nr);
+		freed += nr;
+	}
+	spin_unlock(&sbi->s_es_lock);
+	return freed;
+}
+
+int sfs_es_register(struct sfs_sb_info *sbi)
+{
+	spin_lock_init(&sbi->s_es_lock);
+	INIT_LIST_HEAD(&sbi->s_es_list);
+	sbi->s_es_inodes = 0;
+	atomic_long_set(&sbi->s_es_nr, 0);
+
+	sbi->s_es_shrinker.count_objects = sfs_es_count;
+	sbi->s_es_shrinker.scan_objects = sfs_es_scan;
+	sbi->s_es_shrinker.seeks = DEFAULT_SEEKS;
+	return register_shrinker(&sbi->s_es_shrinker);
+}
+
+void sfs_es_unregister(struct sfs_sb_info *sbi)
+{
+	unregister_shrinker(&sbi->s_es_shrinker);
+}
+
+int __init sfs_init_es_cache(void)
+{
+	sfs_es_cachep = kmem_cache_create("sfs_extent_cache",
+				sizeof(struct sfs_es), 0,
+				SLAB_RECLAIM_ACCOUNT, NULL);
+	if (sfs_es_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void sfs_destroy_es_cache(void)
+{
+	kmem_cache_destroy(sfs_es_cachep);
+}
@@ -0,0 +1,662 @@
+/*
+ * extents.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+
+#include "sfs.h"
+
+/*
+ * Block map of SFS_EXTENTS_FL files, a B+tree of extents rooted in i_data
+ * (see sfs_fs.h). Holes and delayed allocations are not in the tree, the
+ * latter are only known to sfs_da_lookup(). Index nodes are split when
+ * full and freed when empty, the tree only grows at the root. Everything
+ * here runs under i_map_sem.
+ */
+
+#define SFS_EXT_MAX_DEPTH	4
+
+#define SFS_EXT_ROOT_MAX	((sizeof(((struct sfs_inode_info *)0)->i_data) - \
+				  sizeof(struct sfs_extent_header)) /	\
+				 sizeof(struct sfs_extent))
+#define SFS_EXT_BLOCK_MAX	((SFS_BLKSIZE -				\
+				  sizeof(struct sfs_extent_header)) /	\
+				 sizeof(struct sfs_extent))
+
+/* one node on the way from the root down to a leaf */
+struct sfs_ext_path {
+	struct buffer_head *p_bh;		/* NULL for the root */
+	struct sfs_extent_header *p_hdr;
+	int p_idx;				/* entry followed or found */
+};
+
+static inline struct sfs_extent_header *sfs_ext_root(struct inode *inode)
+{
+	return (struct sfs_extent_header *)SFS_I(inode)->i_data;
+}
+
+static inline struct sfs_extent *sfs_ext_first(struct sfs_extent_header *eh)
+{
+	return (struct sfs_extent *)(eh + 1);
+}
+
+static inline u16 sfs_ext_entries(struct sfs_extent_header *eh)
+{
+	return le16_to_cpu(eh->eh_entries);
+}
+
+static inline void sfs_ext_set_entries(struct sfs_extent_header *eh, int n)
+{
+	eh->eh_entries = cpu_to_le16(n);
+}
+
+static inline bool sfs_ext_full(struct sfs_extent_header *eh)
+{
+	return sfs_ext_entries(eh) == le16_to_cpu(eh->eh_max);
+}
+
+static inline void sfs_ext_set(struct sfs_extent *ex, u32 lblk, u32 len,
+			       u32 pblk)
+{
+	ex->e_lblk = cpu_to_le32(lblk);
+	ex->e_len = cpu_to_le32(len);
+	ex->e_pblk = cpu_to_le32(pblk);
+}
+
+void sfs_ext_init(struct inode *inode)
+{
+	struct sfs_extent_header *eh = sfs_ext_root(inode);
+
+	memset(SFS_I(inode)->i_data, 0, sizeof(SFS_I(inode)->i_data));
+	eh->eh_magic = cpu_to_le16(SFS_EXT_MAGIC);
+	eh->eh_max = cpu_to_le16(SFS_EXT_ROOT_MAX);
+}
+
+static bool sfs_ext_valid(struct sfs_extent_header *eh, int depth,
+			  unsigned int max)
+{
+	return le16_to_cpu(eh->eh_magic) == SFS_EXT_MAGIC &&
+		le16_to_cpu(eh->eh_max) == max &&
+		le16_to_cpu(eh->eh_depth) == depth &&
+		sfs_ext_entries(eh) <= max &&
+		(depth == 0 || sfs_ext_entries(eh) > 0);
+}
+
+static void sfs_ext_drop_path(struct sfs_ext_path *path, int depth)
+{
+	int i;
+
+	for (i = 0; i <= depth; i++) {
+		brelse(path[i].p_bh);
+		path[i].p_bh = NULL;
+	}
+}
+
+/*
+ * The root lives in the inode, which the callers of sfs_ext_map_blocks()
+ * and sfs_ext_truncate() mark dirty once i_map_sem is dropped.
+ */
+static void sfs_ext_dirty(struct inode *inode, struct sfs_ext_path *p)
+{
+	if (p->p_bh)
+		sfs_journal_dirty(inode->i_sb, p->p_bh, inode);
+}
+
+/* last entry of @eh starting at or before @lblk, -1 if there is none */
+static int sfs_ext_search(struct sfs_extent_header *eh, u32 lblk)
+{
+	struct sfs_extent *ex = sfs_ext_first(eh);
+	int lo = 0, hi = sfs_ext_entries(eh) - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (le32_to_cpu(ex[mid].e_lblk) <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+/*
+ * Walk down to the leaf that covers @lblk. Returns the depth of the tree,
+ * path[depth] being the leaf, or a negative errno.
+ */
+static int sfs_ext_find(struct inode *inode, u32 lblk,
+			struct sfs_ext_path *path)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_extent_header *eh = sfs_ext_root(inode);
+	struct buffer_head *bh;
+	int depth = le16_to_cpu(eh->eh_depth);
+	u32 child;
+	int i;
+
+	if (depth > SFS_EXT_MAX_DEPTH ||
+	    !sfs_ext_valid(eh, depth, SFS_EXT_ROOT_MAX)) {
+		sfs_msg(sb, KERN_ERR, "corrupted extent root - inode=%lu",
+			inode->i_ino);
+		return -EUCLEAN;
+	}
+
+	path[0].p_bh = NULL;
+	path[0].p_hdr = eh;
+	for (i = 0; ; i++) {
+		path[i].p_idx = sfs_ext_search(path[i].p_hdr, lblk);
+		if (i == depth)
+			break;
+
+		/* the first child also covers anything below its key */
+		if (path[i].p_idx < 0)
+			path[i].p_idx = 0;
+		child = le32_to_cpu(sfs_ext_first(path[i].p_hdr)
+				    [path[i].p_idx].e_pblk);
+		sfs_stat_inc(SFS_SB(sb), SFS_STAT_INDIRECT_READS);
+		bh = sb_bread(sb, child);
+		if (!bh) {
+			sfs_msg(sb, KERN_ERR, "unable to read extent block - "
+				"inode=%lu, block=%u", inode->i_ino, child);
+			sfs_ext_drop_path(path, i);
+			return -EIO;
+		}
+		eh = (struct sfs_extent_header *)bh->b_data;
+		if (!sfs_ext_valid(eh, depth - i - 1, SFS_EXT_BLOCK_MAX)) {
+			sfs_msg(sb, KERN_ERR, "corrupted extent block - "
+				"inode=%lu, block=%u", inode->i_ino, child);
+			brelse(bh);
+			sfs_ext_drop_path(path, i);
+			return -EUCLEAN;
+		}
+		path[i + 1].p_bh = bh;
+		path[i + 1].p_hdr = eh;
+	}
+	return depth;
+}
+
+/* first block mapped after the leaf entry of @path, U32_MAX if none */
+static u32 sfs_ext_next(struct sfs_ext_path *path, int depth)
+{
+	int i, idx;
+
+	for (i = depth; i >= 0; i--) {
+		idx = path[i].p_idx + 1;
+		if (idx < sfs_ext_entries(path[i].p_hdr))
+			return le32_to_cpu(sfs_ext_first(path[i].p_hdr)
+					   [idx].e_lblk);
+	}
+	return U32_MAX;
+}
+
+static struct buffer_head *sfs_ext_new_node(struct inode *inode, int depth,
+					    int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_extent_header *eh;
+	struct buffer_head *bh;
+	unsigned int count = 1;
+	u32 block;
+
+	block = sfs_new_blocks(inode, SFS_I(inode)->i_alloc_goal, &count,
+			       false, err);
+	if (!block)
+		return NULL;
+
+	bh = sb_getblk(sb, block);
+	if (unlikely(!bh)) {
+		sfs_free_blocks(inode, block, 1);
+		*err = -ENOMEM;
+		return NULL;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	eh = (struct sfs_extent_header *)bh->b_data;
+	eh->eh_magic = cpu_to_le16(SFS_EXT_MAGIC);
+	eh->eh_max = cpu_to_le16(SFS_EXT_BLOCK_MAX);
+	eh->eh_depth = cpu_to_le16(depth);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	sfs_journal_dirty(sb, bh, inode);
+
+	inode_add_bytes(inode, sb->s_blocksize);
+	return bh;
+}
+
+static void sfs_ext_free_node(struct inode *inode, struct buffer_head *bh)
+{
+	u32 block = bh->b_blocknr;
+
+	bforget(bh);
+	sfs_free_meta_blocks(inode, block, 1);
+	inode_sub_bytes(inode, inode->i_sb->s_blocksize);
+}
+
+/* move the entries of the full root into a new block below it */
+static int sfs_ext_grow(struct inode *inode)
+{
+	struct sfs_extent_header *root = sfs_ext_root(inode);
+	struct sfs_extent_header *eh;
+	struct buffer_head *bh;
+	int depth = le16_to_cpu(root->eh_depth);
+	int n = sfs_ext_entries(root);
+	int err;
+
+	if (depth >= SFS_EXT_MAX_DEPTH)
+		return -EFBIG;
+
+	bh = sfs_ext_new_node(inode, depth, &err);
+	if (!bh)
+		return err;
+
+	eh = (struct sfs_extent_header *)bh->b_data;
+	memcpy(sfs_ext_first(eh), sfs_ext_first(root),
+	       n * sizeof(struct sfs_extent));
+	sfs_ext_set_entries(eh, n);
+
+	sfs_ext_set(sfs_ext_first(root),
+		    le32_to_cpu(sfs_ext_first(root)->e_lblk), 0, bh->b_blocknr);
+	sfs_ext_set_entries(root, 1);
+	root->eh_depth = cpu_to_le16(depth + 1);
+
+	sfs_journal_dirty(inode->i_sb, bh, inode);
+	brelse(bh);
+	return 0;
+}
+
+/* split the full node path[i] in two, its parent has room for the key */
+static int sfs_ext_split(struct inode *inode, struct sfs_ext_path *path,
+			 int i)
+{
+	struct sfs_extent_header *eh = path[i].p_hdr;
+	struct sfs_extent_header *parent = path[i - 1].p_hdr;
+	struct sfs_extent_header *neh;
+	struct sfs_extent *pex = sfs_ext_first(parent);
+	struct buffer_head *bh;
+	int n = sfs_ext_entries(eh), keep = n / 2;
+	int pn = sfs_ext_entries(parent), pidx = path[i - 1].p_idx + 1;
+	int err;
+
+	bh = sfs_ext_new_node(inode, le16_to_cpu(eh->eh_depth), &err);
+	if (!bh)
+		return err;
+
+	neh = (struct sfs_extent_header *)bh->b_data;
+	memcpy(sfs_ext_first(neh), sfs_ext_first(eh) + keep,
+	       (n - keep) * sizeof(struct sfs_extent));
+	sfs_ext_set_entries(neh, n - keep);
+	sfs_ext_set_entries(eh, keep);
+
+	memmove(&pex[pidx + 1], &pex[pidx],
+		(pn - pidx) * sizeof(struct sfs_extent));
+	sfs_ext_set(&pex[pidx], le32_to_cpu(sfs_ext_first(neh)->e_lblk), 0,
+		    bh->b_blocknr);
+	sfs_ext_set_entries(parent, pn + 1);
+
+	sfs_journal_dirty(inode->i_sb, bh, inode);
+	brelse(bh);
+	sfs_ext_dirty(inode, &path[i]);
+	sfs_ext_dirty(inode, &path[i - 1]);
+	return 0;
+}
+
+/* can (@lblk, @pblk) directly follow @ex? */
+static bool sfs_ext_follows(struct sfs_extent *ex, u32 lblk, u32 pblk)
+{
+	u32 len = le32_to_cpu(ex->e_len);
+	u32 start = le32_to_cpu(ex->e_pblk);
+
+	return le32_to_cpu(ex->e_lblk) + len == lblk && start + len == pblk;
+}
+
+/*
+ * Map [lblk, lblk + len) to @pblk, the range must be a hole. The extent
+ * is merged with its neighbours in the same leaf when they are contiguous.
+ */
+static int sfs_ext_insert(struct inode *inode, u32 lblk, u32 pblk, u32 len)
+{
+	struct sfs_ext_path path[SFS_EXT_MAX_DEPTH + 1];
+	struct sfs_extent_header *eh;
+	struct sfs_extent *ex;
+	bool left, right;
+	int depth, idx, n, i, err;
+
+retry:
+	depth = sfs_ext_find(inode, lblk, path);
+	if (depth < 0)
+		return depth;
+
+	eh = path[depth].p_hdr;
+	ex = sfs_ext_first(eh);
+	n = sfs_ext_entries(eh);
+	idx = path[depth].p_idx;
+
+	left = idx >= 0 && sfs_ext_follows(&ex[idx], lblk, pblk);
+	right = false;
+	if (idx + 1 < n) {
+		struct sfs_extent new;
+
+		sfs_ext_set(&new, lblk, len, pblk);
+		right = sfs_ext_follows(&new, le32_to_cpu(ex[idx + 1].e_lblk),
+					le32_to_cpu(ex[idx + 1].e_pblk));
+	}
+
+	if (left) {
+		len += le32_to_cpu(ex[idx].e_len);
+		if (right) {
+			len += le32_to_cpu(ex[idx + 1].e_len);
+			memmove(&ex[idx + 1], &ex[idx + 2],
+				(n - idx - 2) * sizeof(struct sfs_extent));
+			sfs_ext_set_entries(eh, n - 1);
+		}
+		ex[idx].e_len = cpu_to_le32(len);
+		goto out;
+	}
+	if (right) {
+		sfs_ext_set(&ex[idx + 1], lblk,
+			    len + le32_to_cpu(ex[idx + 1].e_len), pblk);
+		goto out;
+	}
+
+	if (n == le16_to_cpu(eh->eh_max)) {
+		/* split the lowest full node that has room above it */
+		for (i = depth; i > 0; i--)
+			if (!sfs_ext_full(path[i - 1].p_hdr))
+				break;
+		if (i)
+			err = sfs_ext_split(inode, path, i);
+		else
+			err = sfs_ext_grow(inode);
+		sfs_ext_drop_path(path, depth);
+		if (err)
+			return err;
+		goto retry;
+	}
+
+	idx++;
+	memmove(&ex[idx + 1], &ex[idx], (n - idx) * sizeof(struct sfs_extent));
+	sfs_ext_set(&ex[idx], lblk, len, pblk);
+	sfs_ext_set_entries(eh, n + 1);
+out:
+	sfs_ext_dirty(inode, &path[depth]);
+	sfs_ext_drop_path(path, depth);
+	return 0;
+}
+
+/* the leaf path[i] went empty, free it and any index node left empty */
+static void sfs_ext_remove_node(struct inode *inode, struct sfs_ext_path *path,
+				int i)
+{
+	struct sfs_extent_header *root = sfs_ext_root(inode);
+	struct sfs_extent_header *parent;
+	struct sfs_extent *pex;
+	int idx, n;
+
+	for (; i > 0 && !sfs_ext_entries(path[i].p_hdr); i--) {
+		sfs_ext_free_node(inode, path[i].p_bh);
+		path[i].p_bh = NULL;
+
+		parent = path[i - 1].p_hdr;
+		pex = sfs_ext_first(parent);
+		idx = path[i - 1].p_idx;
+		n = sfs_ext_entries(parent);
+		memmove(&pex[idx], &pex[idx + 1],
+			(n - idx - 1) * sizeof(struct sfs_extent));
+		sfs_ext_set_entries(parent, n - 1);
+		sfs_ext_dirty(inode, &path[i - 1]);
+	}
+
+	if (!sfs_ext_entries(root) && root->eh_depth)
+		root->eh_depth = 0;
+}
+
+/* @len blocks at @off into the extent at @pblk are no longer mapped */
+static void sfs_ext_release(struct inode *inode, u32 pblk, u32 off, u32 len)
+{
+	sfs_free_blocks(inode, pblk + off, len);
+	inode_sub_bytes(inode, (loff_t)len << inode->i_blkbits);
+}
+
+/*
+ * Unmap [start, end), the blocks go back to the allocator.
+ */
+static int sfs_ext_remove(struct inode *inode, u32 start, u32 end)
+{
+	struct sfs_ext_path path[SFS_EXT_MAX_DEPTH + 1];
+	struct sfs_extent_header *eh;
+	struct sfs_extent *ex;
+	u32 es, el, ep, ee, from, to;
+	int depth, idx, n, err;
+
+	while (start < end) {
+		depth = sfs_ext_find(inode, start, path);
+		if (depth < 0)
+			return depth;
+
+		eh = path[depth].p_hdr;
+		ex = sfs_ext_first(eh);
+		n = sfs_ext_entries(eh);
+		idx = path[depth].p_idx;
+		if (idx < 0 || le32_to_cpu(ex[idx].e_lblk) +
+			       le32_to_cpu(ex[idx].e_len) <= start)
+			idx++;
+
+		if (idx >= n) {
+			/* nothing left in this leaf, go on with the next one */
+			path[depth].p_idx = n - 1;
+			start = sfs_ext_next(path, depth);
+			sfs_ext_drop_path(path, depth);
+			if (start == U32_MAX)
+				break;
+			continue;
+		}
+
+		es = le32_to_cpu(ex[idx].e_lblk);
+		el = le32_to_cpu(ex[idx].e_len);
+		ep = le32_to_cpu(ex[idx].e_pblk);
+		ee = es + el;
+		if (es >= end) {
+			sfs_ext_drop_path(path, depth);
+			break;
+		}
+		from = max(start, es);
+		to = min(end, ee);
+
+		if (es < from && ee > to) {
+			/* a hole in the middle, the tail becomes a new extent */
+			ex[idx].e_len = cpu_to_le32(from - es);
+			sfs_ext_dirty(inode, &path[depth]);
+			sfs_ext_drop_path(path, depth);
+			sfs_ext_release(inode, ep, from - es, to - from);
+
+			err = sfs_ext_insert(inode, to, ep + (to - es), ee - to);
+			if (err) {
+				sfs_msg(inode->i_sb, KERN_ERR, "unable to split "
+					"extent - inode=%lu, block=%u, err=%d",
+					inode->i_ino, to, err);
+				sfs_ext_release(inode, ep, to - es, ee - to);
+			}
+			return err;
+		}
+
+		if (es < from) {
+			ex[idx].e_len = cpu_to_le32(from - es);
+		} else if (ee > to) {
+			sfs_ext_set(&ex[idx], to, ee - to, ep + (to - es));
+		} else {
+			memmove(&ex[idx], &ex[idx + 1],
+				(n - idx - 1) * sizeof(struct sfs_extent));
+			sfs_ext_set_entries(eh, n - 1);
+		}
+		sfs_ext_dirty(inode, &path[depth]);
+		sfs_ext_release(inode, ep, from - es, to - from);
+
+		if (!sfs_ext_entries(eh))
+			sfs_ext_remove_node(inode, path, depth);
+		sfs_ext_drop_path(path, depth);
+		start = to;
+	}
+	return 0;
+}
+
+/*
+ * sfs_ext_map_blocks - sfs_map_blocks() for extent-mapped files
+ */
+int sfs_ext_map_blocks(struct inode *inode, struct sfs_map *map, int flags)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+	struct sfs_ext_path path[SFS_EXT_MAX_DEPTH + 1];
+	struct sfs_extent *ex;
+	u32 lblk = map->m_lblk;
+	u32 addr = NULL_ADDR, goal = si->i_alloc_goal;
+	u32 es, ep, next;
+	unsigned int count;
+	bool dirty = false;
+	int depth, idx;
+	int err = 0;
+
+	map->m_flags = 0;
+	if (map->m_lblk >= U32_MAX)
+		return -EIO;
+
+	err = sfs_map_lock(inode, flags);
+	if (err)
+		return err;
+
+	depth = sfs_ext_find(inode, lblk, path);
+	if (depth < 0) {
+		err = depth;
+		goto out;
+	}
+
+	ex = sfs_ext_first(path[depth].p_hdr);
+	idx = path[depth].p_idx;
+	count = map->m_len;
+	if (idx >= 0) {
+		es = le32_to_cpu(ex[idx].e_lblk);
+		ep = le32_to_cpu(ex[idx].e_pblk);
+		if (lblk < es + le32_to_cpu(ex[idx].e_len)) {
+			addr = ep + (lblk - es);
+			count = min(count, es + le32_to_cpu(ex[idx].e_len) - lblk);
+		}
+		/* keep extending the extent on the left */
+		goal = ep + (lblk - es);
+	}
+	if (addr == NULL_ADDR) {
+		next = sfs_ext_next(path, depth);
+		count = min(count, next - lblk);
+	}
+	sfs_ext_drop_path(path, depth);
+
+	if (addr == NULL_ADDR && sfs_da_lookup(inode, lblk, &count))
+		addr = NEW_ADDR;
+
+	if (addr == NULL_ADDR && (flags & SFS_MAP_RESERVE)) {
+		err = sfs_reserve_blocks(sbi, count);
+		if (err)
+			goto out;
+		err = sfs_da_insert(inode, lblk, count);
+		if (err) {
+			sfs_release_blocks(sbi, count);
+			goto out;
+		}
+		addr = NEW_ADDR;
+		map->m_flags |= SFS_MAP_NEW;
+	} else if ((addr == NULL_ADDR || addr == NEW_ADDR) &&
+		   (flags & SFS_MAP_ALLOC)) {
+		bool reserved = addr == NEW_ADDR;
+
+		if (!reserved && !(flags & SFS_MAP_DIRECT))
+			count = 1;
+		if (flags & SFS_MAP_DAX)
+			goal = sfs_dax_goal(inode, lblk, goal, count);
+		addr = sfs_new_blocks(inode, goal, &count, reserved, &err);
+		if (!addr)
+			goto out;
+		if (flags & SFS_MAP_DAX) {
+			err = sb_issue_zeroout(inode->i_sb, addr, count,
+					       GFP_NOFS);
+			if (err) {
+				sfs_free_blocks(inode, addr, count);
+				goto out;
+			}
+		}
+		dirty = true;
+		/* sfs_new_blocks() took over the reservation */
+		if (reserved)
+			sfs_da_remove(inode, lblk, count);
+		err = sfs_ext_insert(inode, lblk, addr, count);
+		if (err) {
+			sfs_free_blocks(inode, addr, count);
+			goto out;
+		}
+		inode_add_bytes(inode, (loff_t)count << inode->i_blkbits);
+		si->i_alloc_goal = addr + count;
+		map->m_flags |= SFS_MAP_NEW;
+	} else if (addr == NEW_ADDR && (flags & SFS_MAP_UNRESERVE)) {
+		sfs_release_blocks(sbi, sfs_da_remove(inode, lblk, count));
+		addr = NULL_ADDR;
+	}
+	if (addr != NULL_ADDR && addr != NEW_ADDR)
+		sfs_es_insert(inode, lblk, addr, count);
+out:
+	sfs_map_unlock(inode, flags);
+
+	if (dirty)
+		mark_inode_dirty(inode);
+	if (err)
+		return err;
+	map->m_pblk = addr;
+	map->m_len = count;
+	return 0;
+}
+
+/*
+ * One truncate step, see sfs_truncate_blocks(): release the blocks from
+ * @start on that the last extent before *@end maps, at most the blocks of
+ * SFS_TRUNCATE_STEP dmap blocks. *@end moves down to where the step began.
+ * Called with i_map_sem held, the caller marks the inode dirty. Returns
+ * true once @start is reached.
+ */
+bool sfs_ext_truncate(struct inode *inode, u32 start, u32 *end)
+{
+	struct sfs_ext_path path[SFS_EXT_MAX_DEPTH + 1];
+	struct sfs_extent *ex;
+	u32 es = 0, ee = 0, cut;
+	int depth, err;
+
+	depth = sfs_ext_find(inode, *end - 1, path);
+	if (depth < 0) {
+		err = depth;
+		goto fail;
+	}
+	if (path[depth].p_idx >= 0) {
+		ex = &sfs_ext_first(path[depth].p_hdr)[path[depth].p_idx];
+		es = le32_to_cpu(ex->e_lblk);
+		ee = min(es + le32_to_cpu(ex->e_len), *end);
+	}
+	sfs_ext_drop_path(path, depth);
+
+	if (ee <= start) {
+		*end = start;
+		return true;
+	}
+	cut = max(es, start);
+	if (ee - cut > SFS_TRUNCATE_STEP * SFS_MAP_BITS_PER_BLK)
+		cut = ee - SFS_TRUNCATE_STEP * SFS_MAP_BITS_PER_BLK;
+
+	err = sfs_ext_remove(inode, cut, U32_MAX);
+	if (err)
+		goto fail;
+	*end = cut;
+	return cut == start;
+fail:
+	sfs_msg(inode->i_sb, KERN_ERR, "unable to truncate extents - "
+		"inode=%lu, err=%d", inode->i_ino, err);
+	return true;
+}
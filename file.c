@@ -0,0 +1,449 @@
+/*
+ * file.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/iomap.h>
+#include <linux/dax.h>
+
+#include "sfs.h"
+
+static ssize_t sfs_dio_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
+	}
+
+	file_accessed(iocb->ki_filp);
+	ret = iomap_dio_rw(iocb, to, &sfs_iomap_ops, NULL,
+			   is_sync_kiocb(iocb));
+	inode_unlock_shared(inode);
+	return ret;
+}
+
+#ifdef CONFIG_FS_DAX
+static ssize_t sfs_dax_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
+	}
+	ret = dax_iomap_rw(iocb, to, &sfs_iomap_ops);
+	inode_unlock_shared(inode);
+
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+static ssize_t sfs_dax_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	ssize_t ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock(inode);
+	}
+
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out_unlock;
+	ret = file_update_time(file);
+	if (ret)
+		goto out_unlock;
+
+	ret = dax_iomap_rw(iocb, from, &sfs_iomap_ops);
+	if (ret > 0 && iocb->ki_pos > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos);
+		mark_inode_dirty(inode);
+	}
+
+out_unlock:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+#endif
+
+static ssize_t sfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+#ifdef CONFIG_FS_DAX
+	if (IS_DAX(file_inode(iocb->ki_filp)))
+		return sfs_dax_read_iter(iocb, to);
+#endif
+	if (iocb->ki_flags & IOCB_DIRECT)
+		return sfs_dio_read_iter(iocb, to);
+	return generic_file_read_iter(iocb, to);
+}
+
+/*
+ * i_size is only pushed out once the data is on disk, async completions
+ * run this from the dio workqueue.
+ */
+static int sfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+				unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t end = iocb->ki_pos + size;
+
+	if (error)
+		return error;
+
+	if (size && end > i_size_read(inode)) {
+		i_size_write(inode, end);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+static const struct iomap_dio_ops sfs_dio_write_ops = {
+	.end_io		= sfs_dio_write_end_io,
+};
+
+/*
+ * Direct writes that fall back to the page cache are written and dropped
+ * again, so O_DIRECT callers keep seeing their data on disk.
+ */
+static ssize_t sfs_dio_write_fallback(struct kiocb *iocb,
+				      struct iov_iter *from)
+{
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret;
+	int err;
+
+	ret = iomap_file_buffered_write(iocb, from, &sfs_iomap_ops);
+	if (ret <= 0)
+		return ret;
+	iocb->ki_pos += ret;
+
+	err = filemap_write_and_wait_range(mapping, pos, pos + ret - 1);
+	if (err)
+		return err;
+	invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT,
+				 (pos + ret - 1) >> PAGE_SHIFT);
+	return ret;
+}
+
+static ssize_t sfs_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	bool extend;
+	ssize_t ret, done;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock(inode);
+	}
+
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out_unlock;
+	ret = file_update_time(file);
+	if (ret)
+		goto out_unlock;
+
+	ret = sfs_convert_inline(inode);
+	if (ret)
+		goto out_unlock;
+
+	/* extending writes update i_size on completion, keep them in order */
+	extend = iocb->ki_pos + iov_iter_count(from) > i_size_read(inode);
+
+	ret = iomap_dio_rw(iocb, from, &sfs_iomap_ops, &sfs_dio_write_ops,
+			   is_sync_kiocb(iocb) || extend);
+	if (ret == -ENOTBLK)
+		ret = 0;
+	if (ret < 0 || !iov_iter_count(from))
+		goto out_unlock;
+
+	done = ret;
+	ret = sfs_dio_write_fallback(iocb, from);
+	if (ret >= 0)
+		ret += done;
+	else if (done)
+		ret = done;
+
+out_unlock:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static ssize_t sfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	ssize_t ret;
+
+#ifdef CONFIG_FS_DAX
+	if (IS_DAX(inode))
+		return sfs_dax_write_iter(iocb, from);
+#endif
+	if (iocb->ki_flags & IOCB_DIRECT)
+		return sfs_dio_write_iter(iocb, from);
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out_unlock;
+	ret = file_update_time(file);
+	if (ret)
+		goto out_unlock;
+
+	if (iocb->ki_pos + iov_iter_count(from) >
+	    SFS_MAX_INLINE_DATA(SFS_SB(inode->i_sb))) {
+		ret = sfs_convert_inline(inode);
+		if (ret)
+			goto out_unlock;
+	}
+
+	ret = iomap_file_buffered_write(iocb, from, &sfs_iomap_ops);
+	if (likely(ret > 0))
+		iocb->ki_pos += ret;
+
+out_unlock:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static vm_fault_t sfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	ret = iomap_page_mkwrite(vmf, &sfs_iomap_ops);
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct sfs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= sfs_page_mkwrite,
+};
+
+#ifdef CONFIG_FS_DAX
+/*
+ * DAX faults map the device directly, a PMD at a time when the file range
+ * sits on 2 MiB aligned blocks. i_dax_sem keeps truncate from freeing the
+ * blocks under the fault.
+ */
+static vm_fault_t sfs_dax_huge_fault(struct vm_fault *vmf,
+				     enum page_entry_size pe_size)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	struct sfs_inode_info *si = SFS_I(inode);
+	bool write = (vmf->flags & FAULT_FLAG_WRITE) &&
+		     (vmf->vma->vm_flags & VM_SHARED);
+	vm_fault_t ret;
+
+	if (write) {
+		sb_start_pagefault(inode->i_sb);
+		file_update_time(vmf->vma->vm_file);
+	}
+	down_read(&si->i_dax_sem);
+	ret = dax_iomap_fault(vmf, pe_size, NULL, NULL, &sfs_iomap_ops);
+	up_read(&si->i_dax_sem);
+	if (write)
+		sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static vm_fault_t sfs_dax_fault(struct vm_fault *vmf)
+{
+	return sfs_dax_huge_fault(vmf, PE_SIZE_PTE);
+}
+
+static const struct vm_operations_struct sfs_dax_vm_ops = {
+	.fault		= sfs_dax_fault,
+	.huge_fault	= sfs_dax_huge_fault,
+	.page_mkwrite	= sfs_dax_fault,
+	.pfn_mkwrite	= sfs_dax_fault,
+};
+#endif
+
+static int sfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+#ifdef CONFIG_FS_DAX
+	if (IS_DAX(file_inode(file))) {
+		vma->vm_ops = &sfs_dax_vm_ops;
+		vma->vm_flags |= VM_HUGEPAGE;
+		return 0;
+	}
+#endif
+	vma->vm_ops = &sfs_file_vm_ops;
+	return 0;
+}
+
+static int sfs_file_open(struct inode *inode, struct file *file)
+{
+	unsigned int ra_pages = READ_ONCE(SFS_SB(inode->i_sb)->s_ra_pages);
+
+	/* -o readahead= overrides the window of the device */
+	if (ra_pages)
+		file->f_ra.ra_pages = ra_pages;
+	return generic_file_open(inode, file);
+}
+
+/*
+ * Without a journal: the blocks associated with the inode (indirect or
+ * directory blocks), the bitmap blocks if it changed any bits, and the
+ * inode block if the inode is dirty in a way that matters for @datasync.
+ * Returns 1 if anything was written.
+ */
+static int sfs_sync_metadata(struct inode *inode, int datasync)
+{
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+	struct sfs_inode_info *si = SFS_I(inode);
+	int written = 0;
+	int err = 0, ret;
+
+	if (!list_empty_careful(&inode->i_mapping->private_list)) {
+		err = sync_mapping_buffers(inode->i_mapping);
+		written = 1;
+	}
+
+	if (test_and_clear_bit(SFS_SYNC_MAPS, &si->i_sync_state)) {
+		ret = sfs_bitmap_flush(&sbi->s_imap, 1);
+		if (!err)
+			err = ret;
+		ret = sfs_bitmap_flush(&sbi->s_dmap, 1);
+		if (!err)
+			err = ret;
+		/* the next fsync has to try again */
+		if (err)
+			sfs_set_sync_state(inode, SFS_SYNC_MAPS);
+		written = 1;
+	}
+
+	if (inode->i_state & (datasync ? I_DIRTY_DATASYNC : I_DIRTY_INODE)) {
+		ret = sync_inode_metadata(inode, 1);
+		if (!err)
+			err = ret;
+		written = 1;
+	}
+	return err ? err : written;
+}
+
+/*
+ * Write back the dirty pages in the range and whatever metadata is needed
+ * to read them back. With a journal that is the last transaction that
+ * changed the inode, for fdatasync the last one that changed more than its
+ * timestamps. The disk cache is flushed only when something was written
+ * and the commit block did not flush it already.
+ */
+int sfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct sfs_inode_info *si = SFS_I(inode);
+	bool flush;
+	u32 tid;
+	int ret;
+
+	ret = file_write_and_wait_range(file, start, end);
+	if (ret)
+		return ret;
+
+	flush = test_and_clear_bit(SFS_SYNC_FLUSH, &si->i_sync_state);
+
+	if (sfs_journaled(sb)) {
+		tid = datasync ? READ_ONCE(si->i_datasync_tid) :
+				 READ_ONCE(si->i_sync_tid);
+		ret = sfs_journal_commit_tid(sb, tid);
+		if (ret > 0)
+			flush = false;
+	} else {
+		ret = sfs_sync_metadata(inode, datasync);
+		if (ret > 0)
+			flush = true;
+	}
+	if (ret < 0)
+		goto fail;
+
+	if (flush) {
+		ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+		if (ret)
+			goto fail;
+	}
+	return 0;
+
+fail:
+	/* the data is not known to be stable yet, keep asking for a flush */
+	if (flush)
+		sfs_set_sync_state(inode, SFS_SYNC_FLUSH);
+	return ret;
+}
+
+const struct file_operations sfs_file_operations = {
+	.llseek		= generic_file_llseek,
+	.read_iter	= sfs_file_read_iter,
+	.write_iter	= sfs_file_write_iter,
+	.unlocked_ioctl = sfs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= sfs_compat_ioctl,
+#endif
+	.mmap		= sfs_file_mmap,
+	.open		= sfs_file_open,
+	.fsync		= sfs_fsync,
+	/* PMD-aligns the mapping, but only for DAX inodes (-o dax) */
+	.get_unmapped_area = thp_get_unmapped_area,
+/*
+	.release	= sfs_release_file,
+*/	
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= iter_file_splice_write,
+};
+
+struct inode_operations sfs_file_inode_operations = {
+	.getattr        = sfs_getattr,
+	.setattr        = sfs_setattr,
+};
@@ -0,0 +1,337 @@
+/*
+ * ialloc.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+
+#include "sfs.h"
+
+/*
+ * The inode bitmap (imap) starts at imap_blkaddr, bit n tracks inode
+ * number n + SFS_ROOT_INO. Every imap block is one inode group with its
+ * own free count, locked by the blockgroup lock of the same index.
+ */
+static inline u32 sfs_imap_nbits(struct sfs_sb_info *sbi, u32 group)
+{
+	return min_t(u32, SFS_INODES_PER_GROUP,
+		     sbi->s_inodes_count - group * SFS_INODES_PER_GROUP);
+}
+
+/* the imap blocks are pinned, see bitmap.c */
+static inline struct buffer_head *sfs_read_imap(struct super_block *sb,
+						u32 group)
+{
+	return sfs_bitmap_get(&SFS_SB(sb)->s_imap, group);
+}
+
+int sfs_build_inode_groups(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct buffer_head *bh;
+	u32 group, nbits, used, i;
+
+	sbi->s_ninode_groups = DIV_ROUND_UP(sbi->s_inodes_count,
+					    SFS_INODES_PER_GROUP);
+	sbi->s_inode_groups = kvcalloc(sbi->s_ninode_groups,
+				       sizeof(struct sfs_inode_group),
+				       GFP_KERNEL);
+	if (!sbi->s_inode_groups)
+		return -ENOMEM;
+
+	for (group = 0; group < sbi->s_ninode_groups; group++) {
+		nbits = sfs_imap_nbits(sbi, group);
+		bh = sfs_read_imap(sb, group);
+		if (!bh) {
+			kvfree(sbi->s_inode_groups);
+			sbi->s_inode_groups = NULL;
+			return -EIO;
+		}
+		used = memweight(bh->b_data, nbits / BITS_PER_BYTE);
+		for (i = round_down(nbits, BITS_PER_BYTE); i < nbits; i++)
+			used += test_bit_le(i, bh->b_data) ? 1 : 0;
+		brelse(bh);
+
+		sbi->s_inode_groups[group].ig_free = nbits - used;
+	}
+	return 0;
+}
+
+void sfs_destroy_inode_groups(struct sfs_sb_info *sbi)
+{
+	kvfree(sbi->s_inode_groups);
+	sbi->s_inode_groups = NULL;
+}
+
+/*
+ * Placement of new inodes
+ *
+ * The inode area and the data area are split into groups of their own.
+ * Inode group n is paired with the data groups at the same fraction of
+ * the data area, so "near" means the same part of the volume for both.
+ *
+ * A directory made in the root starts a new tree and is spread out: it
+ * goes to a data group with at least the average free blocks whose inode
+ * group also has at least the average free inodes, searched from a
+ * random one (Orlov's rule for top-level directories). Anything else
+ * goes where its parent is, the inode in the parent's inode group and
+ * the data from the parent's allocation goal on. So a tree written by
+ * untar or make lies together, and reading it back seeks little.
+ */
+static inline u32 sfs_data_to_inode_group(struct sfs_sb_info *sbi, u32 group)
+{
+	return div_u64((u64)group * sbi->s_ninode_groups, sbi->s_ngroups);
+}
+
+static inline u32 sfs_ino_group(ino_t ino)
+{
+	return (ino - SFS_ROOT_INO) / SFS_INODES_PER_GROUP;
+}
+
+static u32 sfs_orlov_group(struct sfs_sb_info *sbi)
+{
+	u64 avg_blocks, avg_inodes;
+	u32 group, best, best_free = 0, free, ifree, i;
+
+	avg_blocks = div_u64(percpu_counter_read_positive(
+				&sbi->s_freeblocks_counter), sbi->s_ngroups);
+	avg_inodes = div_u64(percpu_counter_read_positive(
+				&sbi->s_freeinodes_counter),
+			     sbi->s_ninode_groups);
+
+	group = best = prandom_u32_max(sbi->s_ngroups);
+	for (i = 0; i < sbi->s_ngroups; i++) {
+		free = READ_ONCE(sbi->s_groups[group].ag_free);
+		ifree = READ_ONCE(sbi->s_inode_groups[
+				sfs_data_to_inode_group(sbi, group)].ig_free);
+		if (free && free >= avg_blocks && ifree >= avg_inodes)
+			return group;
+		if (free > best_free) {
+			best = group;
+			best_free = free;
+		}
+		if (++group == sbi->s_ngroups)
+			group = 0;
+	}
+	return best;
+}
+
+/* where the blocks of @dir are going, 0 if it has none yet */
+static u32 sfs_dir_goal(struct sfs_sb_info *sbi, struct inode *dir)
+{
+	struct sfs_inode_info *si = SFS_I(dir);
+	u32 goal = READ_ONCE(si->i_alloc_goal);
+
+	/* after a remount, the block of "." */
+	if (!sfs_block_in_data(sbi, goal) && !(si->i_flags & SFS_EXTENTS_FL))
+		goal = le32_to_cpu(si->i_data[0]);
+	return sfs_block_in_data(sbi, goal) ? goal : 0;
+}
+
+/*
+ * Pick the inode group to search first and the allocation goal of a new
+ * inode of @mode in @dir.
+ */
+static void sfs_find_place(struct inode *dir, umode_t mode, u32 *group,
+			   u32 *goal)
+{
+	struct sfs_sb_info *sbi = SFS_SB(dir->i_sb);
+	u32 dgroup;
+
+	if (S_ISDIR(mode) && dir->i_ino == SFS_ROOT_INO) {
+		dgroup = sfs_orlov_group(sbi);
+		*group = sfs_data_to_inode_group(sbi, dgroup);
+		*goal = sbi->s_groups[dgroup].ag_start;
+		return;
+	}
+	*group = sfs_ino_group(dir->i_ino);
+	*goal = sfs_dir_goal(sbi, dir);
+}
+
+/*
+ * sfs_new_ino - allocate an inode number for a new inode in @dir
+ *
+ * Searches the inode groups from @group on, see sfs_find_place().
+ *
+ * Returns the inode number, 0 on failure.
+ */
+ino_t sfs_new_ino(struct inode *dir, u32 group, int *err)
+{
+	struct super_block *sb = dir->i_sb;
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_inode_group *ig;
+	struct buffer_head *bh;
+	u32 nbits, bit, i;
+
+	if (group >= sbi->s_ninode_groups)
+		group = 0;
+	for (i = 0; i < sbi->s_ninode_groups; i++) {
+		ig = &sbi->s_inode_groups[group];
+		if (!READ_ONCE(ig->ig_free))
+			goto next;
+
+		bh = sfs_read_imap(sb, group);
+		if (!bh) {
+			*err = -EIO;
+			return 0;
+		}
+		nbits = sfs_imap_nbits(sbi, group);
+
+		spin_lock(sfs_group_lock(sbi, group));
+		bit = find_next_zero_bit_le(bh->b_data, nbits, 0);
+		if (bit < nbits) {
+			__set_bit_le(bit, bh->b_data);
+			ig->ig_free--;
+			spin_unlock(sfs_group_lock(sbi, group));
+
+			sfs_bitmap_dirty(&sbi->s_imap, group);
+			brelse(bh);
+
+			percpu_counter_dec(&sbi->s_freeinodes_counter);
+			return group * SFS_INODES_PER_GROUP + bit + SFS_ROOT_INO;
+		}
+		spin_unlock(sfs_group_lock(sbi, group));
+		brelse(bh);
+next:
+		if (++group == sbi->s_ninode_groups)
+			group = 0;
+	}
+
+	*err = -ENOSPC;
+	return 0;
+}
+
+void sfs_free_ino(struct super_block *sb, ino_t ino)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct buffer_head *bh;
+	u32 bit, group;
+	bool cleared;
+
+	if (ino <= SFS_ROOT_INO || ino - SFS_ROOT_INO >= sbi->s_inodes_count) {
+		sfs_msg(sb, KERN_ERR, "freeing reserved or nonexistent inode "
+			"%lu", ino);
+		return;
+	}
+
+	bit = ino - SFS_ROOT_INO;
+	group = bit / SFS_INODES_PER_GROUP;
+	bh = sfs_read_imap(sb, group);
+	if (!bh)
+		return;
+
+	spin_lock(sfs_group_lock(sbi, group));
+	cleared = __test_and_clear_bit_le(bit % SFS_INODES_PER_GROUP,
+					  bh->b_data);
+	if (cleared)
+		sbi->s_inode_groups[group].ig_free++;
+	spin_unlock(sfs_group_lock(sbi, group));
+
+	if (!cleared)
+		sfs_msg(sb, KERN_ERR, "bit already cleared for inode %lu", ino);
+	else
+		percpu_counter_inc(&sbi->s_freeinodes_counter);
+
+	sfs_bitmap_dirty(&sbi->s_imap, group);
+	brelse(bh);
+}
+
+/*
+ * sfs_new_inode - allocate and set up a new inode in @dir
+ *
+ * The on-disk inode is cleared so that nothing of its previous owner is
+ * left behind. The inode is returned locked and hashed, the caller sets
+ * up the operations and either instantiates or discards it.
+ */
+struct inode *sfs_new_inode(struct inode *dir, umode_t mode,
+			    const struct qstr *qstr)
+{
+	struct super_block *sb = dir->i_sb;
+	struct sfs_inode_info *si;
+	struct sfs_inode *raw_inode;
+	struct buffer_head *bh;
+	struct inode *inode;
+	u32 namelen = min_t(u32, qstr->len, SFS_NAME_LEN);
+	u32 group, goal;
+	ino_t ino;
+	int err = 0;
+
+	inode = new_inode(sb);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	si = SFS_I(inode);
+
+	sfs_find_place(dir, mode, &group, &goal);
+	ino = sfs_new_ino(dir, group, &err);
+	if (!ino)
+		goto fail;
+	/* the imap bit backs both the new inode and the entry in @dir */
+	sfs_set_sync_state(inode, SFS_SYNC_MAPS);
+	sfs_set_sync_state(dir, SFS_SYNC_MAPS);
+
+	inode_init_owner(inode, dir, mode);
+	inode->i_ino = ino;
+	inode->i_blocks = 0;
+	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
+	memset(si->i_data, 0, sizeof(si->i_data));
+	si->i_flags = 0;
+	si->i_inline = 0;
+	if (S_ISREG(mode) && SFS_MAX_INLINE_DATA(SFS_SB(sb)) &&
+	    !test_opt(SFS_SB(sb), DAX))
+		si->i_inline = SFS_INLINE_DATA;
+	if (S_ISREG(mode) && (SFS_GET_SB(sb, feature) &
+			      cpu_to_le32(SFS_FEATURE_EXTENTS))) {
+		si->i_flags |= SFS_EXTENTS_FL;
+		sfs_ext_init(inode);
+	}
+	si->i_dir_start_lookup = 0;
+	si->i_alloc_goal = goal;
+
+	/*
+	 * The imap said free, but the number is live in the icache: the
+	 * bit and the on-disk inode belong to that inode and stay as they
+	 * are.
+	 */
+	if (insert_inode_locked(inode) < 0) {
+		sfs_msg(sb, KERN_ERR, "corrupted imap, inode number already "
+			"in use - inode=%lu", ino);
+		err = -EUCLEAN;
+		goto fail;
+	}
+
+	raw_inode = sfs_get_raw_inode(sb, ino, &bh);
+	if (IS_ERR(raw_inode)) {
+		err = PTR_ERR(raw_inode);
+		goto fail_ino;
+	}
+	lock_buffer(bh);
+	memset(raw_inode, 0, SFS_SB(sb)->s_inode_size);
+	raw_inode->i_pino = cpu_to_le32(dir->i_ino);
+	raw_inode->i_namelen = cpu_to_le32(namelen);
+	memcpy(raw_inode->i_name, qstr->name, namelen);
+	unlock_buffer(bh);
+	sfs_journal_dirty(sb, bh, NULL);
+	brelse(bh);
+
+	mark_inode_dirty(inode);
+	return inode;
+
+fail_ino:
+	/* unhash it before the number can be handed out again */
+	make_bad_inode(inode);
+	discard_new_inode(inode);
+	sfs_free_ino(sb, ino);
+	return ERR_PTR(err);
+fail:
+	make_bad_inode(inode);
+	iput(inode);
+	return ERR_PTR(err);
+}
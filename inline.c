@@ -0,0 +1,220 @@
+/*
+ * inline.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/iomap.h>
+#include <linux/writeback.h>
+
+#include "sfs.h"
+
+/*
+ * Small regular files keep their data in the inode slot, right after
+ * struct sfs_inode, while SFS_INLINE_DATA is set in i_inline. The page
+ * cache sees an IOMAP_INLINE extent: reads copy from the inode buffer and
+ * iomap copies buffered writes straight back into it, so page 0 of an
+ * inline file is only ever dirtied by mmap.
+ */
+
+static inline void *sfs_inline_data(struct sfs_inode *raw_inode)
+{
+	return (void *)(raw_inode + 1);
+}
+
+/*
+ * Map @offset of an inline file. The inode buffer is held in
+ * iomap->private until sfs_iomap_end().
+ */
+int sfs_iomap_inline(struct inode *inode, loff_t offset, loff_t length,
+		     struct iomap *iomap)
+{
+	struct super_block *sb = inode->i_sb;
+	struct sfs_inode *raw_inode;
+	struct buffer_head *bh;
+
+	iomap->flags = 0;
+	iomap->bdev = sb->s_bdev;
+	iomap->addr = IOMAP_NULL_ADDR;
+
+	/* only reads and zeroing go past the inline area */
+	if (offset >= SFS_MAX_INLINE_DATA(SFS_SB(sb))) {
+		iomap->type = IOMAP_HOLE;
+		iomap->offset = offset;
+		iomap->length = length;
+		return 0;
+	}
+
+	raw_inode = sfs_get_raw_inode(sb, inode->i_ino, &bh);
+	if (IS_ERR(raw_inode))
+		return PTR_ERR(raw_inode);
+
+	iomap->type = IOMAP_INLINE;
+	iomap->offset = 0;
+	iomap->length = SFS_MAX_INLINE_DATA(SFS_SB(sb));
+	iomap->inline_data = sfs_inline_data(raw_inode);
+	iomap->private = bh;
+	return 0;
+}
+
+/*
+ * Writeback of a page dirtied through mmap, copy it back into the inode.
+ */
+int sfs_write_inline_page(struct page *page, struct writeback_control *wbc,
+			  void *data)
+{
+	struct inode *inode = page->mapping->host;
+	struct sfs_inode *raw_inode;
+	struct sfs_handle handle;
+	struct buffer_head *bh;
+	loff_t size = i_size_read(inode);
+	void *kaddr;
+
+	/* converted since writeback looked at it */
+	if (!sfs_has_inline_data(inode)) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+
+	if (page->index == 0 && size) {
+		raw_inode = sfs_get_raw_inode(inode->i_sb, inode->i_ino, &bh);
+		if (IS_ERR(raw_inode)) {
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			return PTR_ERR(raw_inode);
+		}
+		sfs_journal_start(inode->i_sb, &handle);
+		kaddr = kmap_atomic(page);
+		lock_buffer(bh);
+		memcpy(sfs_inline_data(raw_inode), kaddr,
+		       min_t(loff_t, size, SFS_MAX_INLINE_DATA(SFS_SB(inode->i_sb))));
+		unlock_buffer(bh);
+		kunmap_atomic(kaddr);
+		sfs_journal_dirty(inode->i_sb, bh, inode);
+		sfs_journal_stop(&handle);
+		/* with a journal, fsync commits it */
+		if (wbc->sync_mode == WB_SYNC_ALL && !sfs_journaled(inode->i_sb))
+			sync_dirty_buffer(bh);
+		brelse(bh);
+	}
+
+	set_page_writeback(page);
+	unlock_page(page);
+	end_page_writeback(page);
+	return 0;
+}
+
+/*
+ * sfs_convert_inline - move the data of an inline file to a data block
+ *
+ * The data goes to page 0 with a delayed allocation reserved under it,
+ * writeback then picks the block like for any other file. Called with the
+ * inode lock held before the file grows past the inline area or is
+ * written with O_DIRECT.
+ */
+int sfs_convert_inline(struct inode *inode)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct address_space *mapping = inode->i_mapping;
+	unsigned int max = SFS_MAX_INLINE_DATA(SFS_SB(sb));
+	loff_t size = i_size_read(inode);
+	struct sfs_inode *raw_inode;
+	struct sfs_map map = { .m_lblk = 0, .m_len = 1 };
+	struct sfs_handle handle;
+	struct buffer_head *bh;
+	struct page *page;
+	void *kaddr;
+	int err;
+
+	if (!sfs_has_inline_data(inode))
+		return 0;
+
+	page = find_or_create_page(mapping, 0, mapping_gfp_constraint(mapping,
+							~__GFP_FS));
+	if (!page)
+		return -ENOMEM;
+
+	sfs_journal_start(sb, &handle);
+	raw_inode = sfs_get_raw_inode(sb, inode->i_ino, &bh);
+	if (IS_ERR(raw_inode)) {
+		err = PTR_ERR(raw_inode);
+		goto out_page;
+	}
+
+	if (size) {
+		err = sfs_map_blocks(inode, &map, SFS_MAP_RESERVE);
+		if (err)
+			goto out_bh;
+	}
+
+	/* an uptodate page may hold newer data from mmap */
+	if (!PageUptodate(page)) {
+		kaddr = kmap_atomic(page);
+		memcpy(kaddr, sfs_inline_data(raw_inode), min_t(loff_t, size, max));
+		memset(kaddr + min_t(loff_t, size, max), 0,
+		       PAGE_SIZE - min_t(loff_t, size, max));
+		kunmap_atomic(kaddr);
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+	}
+
+	down_write(&si->i_map_sem);
+	si->i_inline &= ~SFS_INLINE_DATA;
+	up_write(&si->i_map_sem);
+
+	lock_buffer(bh);
+	memset(sfs_inline_data(raw_inode), 0, max);
+	unlock_buffer(bh);
+	sfs_journal_dirty(sb, bh, NULL);
+
+	if (size)
+		set_page_dirty(page);
+	mark_inode_dirty(inode);
+	err = 0;
+out_bh:
+	brelse(bh);
+out_page:
+	sfs_journal_stop(&handle);
+	unlock_page(page);
+	put_page(page);
+	return err;
+}
+
+/*
+ * Clear the inline area past @size when an inline file shrinks. Writeback
+ * only copies up to i_size, so bytes left there would come back when the
+ * file grows again.
+ */
+int sfs_truncate_inline(struct inode *inode, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned int max = SFS_MAX_INLINE_DATA(SFS_SB(sb));
+	struct sfs_inode *raw_inode;
+	struct sfs_handle handle;
+	struct buffer_head *bh;
+
+	if (size >= max)
+		return 0;
+
+	sfs_journal_start(sb, &handle);
+	raw_inode = sfs_get_raw_inode(sb, inode->i_ino, &bh);
+	if (IS_ERR(raw_inode)) {
+		sfs_journal_stop(&handle);
+		return PTR_ERR(raw_inode);
+	}
+	lock_buffer(bh);
+	memset(sfs_inline_data(raw_inode) + size, 0, max - size);
+	unlock_buffer(bh);
+	sfs_journal_dirty(sb, bh, inode);
+	brelse(bh);
+	sfs_journal_stop(&handle);
+	return 0;
+}
@@ -0,0 +1,287 @@
+/*
+ * inode.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/iversion.h>
+#include <linux/iomap.h>
+#include <linux/writeback.h>
+
+#include "sfs.h"
+#include "sfs_trace.h"
+
+/*
+ * read the on-disk inode of @ino, the caller must brelse(*bhp)
+ */
+struct sfs_inode *sfs_get_raw_inode(struct super_block *sb, ino_t ino,
+				    struct buffer_head **bhp)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct buffer_head *bh;
+	unsigned long block;
+	u32 addr;
+
+	*bhp = NULL;
+	if (ino < SFS_ROOT_INO || ino - SFS_ROOT_INO >= sbi->s_inodes_count) {
+		sfs_msg(sb, KERN_ERR, "bad inode number: %lu", ino);
+		return ERR_PTR(-EINVAL);
+	}
+
+	addr = sfs_ino_to_addr(sbi, ino);
+	block = sfs_inode_block(sbi, addr);
+	if (!(bh = sb_bread(sb, block))) {
+		sfs_msg(sb, KERN_ERR, "unable to read inode block - "
+			"inode=%lu, block=%lu", ino, block);
+		return ERR_PTR(-EIO);
+	}
+
+	*bhp = bh;
+	return (struct sfs_inode *)(bh->b_data + sfs_inode_offset(sbi, addr));
+}
+
+void sfs_set_inode_ops(struct inode *inode)
+{
+	if (S_ISREG(inode->i_mode)) {
+		inode->i_op = &sfs_file_inode_operations;
+		inode->i_fop = &sfs_file_operations;
+		/* inline data lives in the inode, it cannot be mapped */
+		if (test_opt(SFS_SB(inode->i_sb), DAX) &&
+		    !sfs_has_inline_data(inode)) {
+			inode->i_flags |= S_DAX;
+			inode->i_mapping->a_ops = &sfs_dax_aops;
+		} else {
+			inode->i_mapping->a_ops = &sfs_aops;
+		}
+	} else if (S_ISDIR(inode->i_mode)) {
+		inode->i_op = &sfs_dir_inode_operations;
+		inode->i_fop = &sfs_dir_operations;
+	} else {
+		init_special_inode(inode, inode->i_mode, 0);
+	}
+}
+
+struct inode *sfs_iget(struct super_block *sb, unsigned long ino)
+{
+	struct sfs_inode_info *si;
+	struct buffer_head *bh;
+	struct sfs_inode *raw_inode;
+	struct inode *inode;
+	uid_t i_uid;
+	gid_t i_gid;
+	u64 t0;
+	int n;
+
+	inode = iget_locked(sb, ino);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	si = SFS_I(inode);
+
+	t0 = sfs_trace_clock(sfs_read_inode);
+	raw_inode = sfs_get_raw_inode(sb, ino, &bh);
+	if (IS_ERR(raw_inode)) {
+		trace_sfs_read_inode(sb, ino, 1, PTR_ERR(raw_inode),
+				     sfs_trace_since(t0));
+		iget_failed(inode);
+		return ERR_CAST(raw_inode);
+	}
+	/* a freed slot, only a stale reference leads here */
+	if (!raw_inode->i_links && !raw_inode->i_mode) {
+		brelse(bh);
+		trace_sfs_read_inode(sb, ino, 1, -ESTALE, sfs_trace_since(t0));
+		iget_failed(inode);
+		return ERR_PTR(-ESTALE);
+	}
+
+	inode->i_mode = le16_to_cpu(raw_inode->i_mode);
+	i_uid = (uid_t)le32_to_cpu(raw_inode->i_uid);
+	i_gid = (gid_t)le32_to_cpu(raw_inode->i_gid);
+	i_uid_write(inode, i_uid);
+	i_gid_write(inode, i_gid);
+	set_nlink(inode, le32_to_cpu(raw_inode->i_links));
+	inode->i_size = le64_to_cpu(raw_inode->i_size);
+	inode->i_atime.tv_sec = (signed)le64_to_cpu(raw_inode->i_atime);
+	inode->i_ctime.tv_sec = (signed)le64_to_cpu(raw_inode->i_ctime);
+	inode->i_mtime.tv_sec = (signed)le64_to_cpu(raw_inode->i_mtime);
+	inode->i_atime.tv_nsec = le32_to_cpu(raw_inode->i_atime_nsec);
+	inode->i_ctime.tv_nsec = le32_to_cpu(raw_inode->i_ctime_nsec);
+	inode->i_mtime.tv_nsec = le32_to_cpu(raw_inode->i_mtime_nsec);
+	inode->i_blocks = le64_to_cpu(raw_inode->i_blocks);
+
+	si->i_flags = le32_to_cpu(raw_inode->i_flags);
+	si->i_inline = raw_inode->i_inline;
+	si->i_dir_start_lookup = 0;
+	for (n = 0; n < DEF_ADDRS_PER_INODE; n++)
+		si->i_data[n] = raw_inode->d_addr[n];
+	for (; n < DEF_SFS_N_BLOCKS; n++)
+		si->i_data[n] = raw_inode->i_addr[n - DEF_ADDRS_PER_INODE];
+
+	brelse(bh);
+	trace_sfs_read_inode(sb, ino, 1, 0, sfs_trace_since(t0));
+
+	sfs_set_inode_ops(inode);
+
+	unlock_new_inode(inode);
+	return inode;
+}
+
+static int __sfs_write_inode(struct inode *inode, int do_sync)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct sfs_handle handle;
+	struct buffer_head *bh;
+	struct sfs_inode *raw_inode;
+	u64 t0 = sfs_trace_clock(sfs_write_inode);
+	int n, err = 0;
+
+	sfs_journal_start(sb, &handle);
+	raw_inode = sfs_get_raw_inode(sb, inode->i_ino, &bh);
+	if (IS_ERR(raw_inode)) {
+		sfs_journal_stop(&handle);
+		err = PTR_ERR(raw_inode);
+		goto out;
+	}
+
+	raw_inode->i_mode = cpu_to_le16(inode->i_mode);
+	raw_inode->i_uid = cpu_to_le32(i_uid_read(inode));
+	raw_inode->i_gid = cpu_to_le32(i_gid_read(inode));
+	raw_inode->i_links = cpu_to_le32(inode->i_nlink);
+	raw_inode->i_size = cpu_to_le64(inode->i_size);
+	raw_inode->i_blocks = cpu_to_le64(inode->i_blocks);
+	raw_inode->i_atime = cpu_to_le64(inode->i_atime.tv_sec);
+	raw_inode->i_ctime = cpu_to_le64(inode->i_ctime.tv_sec);
+	raw_inode->i_mtime = cpu_to_le64(inode->i_mtime.tv_sec);
+	raw_inode->i_atime_nsec = cpu_to_le32(inode->i_atime.tv_nsec);
+	raw_inode->i_ctime_nsec = cpu_to_le32(inode->i_ctime.tv_nsec);
+	raw_inode->i_mtime_nsec = cpu_to_le32(inode->i_mtime.tv_nsec);
+	raw_inode->i_flags = cpu_to_le32(si->i_flags);
+	raw_inode->i_inline = si->i_inline;
+
+	down_read(&si->i_map_sem);
+	for (n = 0; n < DEF_ADDRS_PER_INODE; n++)
+		raw_inode->d_addr[n] = si->i_data[n];
+	for (; n < DEF_SFS_N_BLOCKS; n++)
+		raw_inode->i_addr[n - DEF_ADDRS_PER_INODE] = si->i_data[n];
+	up_read(&si->i_map_sem);
+
+	sfs_journal_dirty(sb, bh, NULL);
+	sfs_journal_stop(&handle);
+
+	if (do_sync && sfs_journaled(sb)) {
+		err = sfs_journal_force_commit(sb);
+	} else if (do_sync) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh)) {
+			sfs_msg(sb, KERN_ERR, "IO error syncing inode %lu",
+				inode->i_ino);
+			err = -EIO;
+		}
+	}
+	brelse(bh);
+out:
+	trace_sfs_write_inode(sb, inode->i_ino, do_sync, err,
+			      sfs_trace_since(t0));
+	return err;
+}
+
+int sfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	return __sfs_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+}
+
+/*
+ * With a journal the inode is copied to its buffer whenever it is dirtied,
+ * so it commits together with whatever changed it. Lazy timestamp updates
+ * wait for sfs_write_inode().
+ */
+void sfs_dirty_inode(struct inode *inode, int flags)
+{
+	struct sfs_handle handle;
+
+	if (!sfs_journaled(inode->i_sb) || flags == I_DIRTY_TIME)
+		return;
+	sfs_journal_start(inode->i_sb, &handle);
+	__sfs_write_inode(inode, 0);
+	sfs_journal_inode(inode, flags & I_DIRTY_DATASYNC);
+	sfs_journal_stop(&handle);
+}
+
+void sfs_evict_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	bool want_delete = !inode->i_nlink && !is_bad_inode(inode);
+	bool do_sync = want_delete && inode_needs_sync(inode);
+	struct sfs_handle handle;
+
+	truncate_inode_pages_final(&inode->i_data);
+
+	if (want_delete) {
+		/*
+		 * The blocks go in steps of their own, the inode and its imap
+		 * bit then in one transaction.
+		 */
+		inode->i_size = 0;
+		sfs_truncate_blocks(inode, 0);
+		sfs_journal_start(sb, &handle);
+		__sfs_write_inode(inode, do_sync && !sfs_journaled(sb));
+	}
+
+	invalidate_inode_buffers(inode);
+	sfs_es_drop(inode);
+	/* left over when writeback failed and the pages were thrown away */
+	sfs_release_blocks(SFS_SB(sb), sfs_da_remove(inode, 0, U32_MAX));
+	clear_inode(inode);
+
+	if (want_delete) {
+		sfs_free_ino(sb, inode->i_ino);
+		sfs_journal_stop(&handle);
+		if (do_sync)
+			sfs_journal_force_commit(sb);
+	}
+}
+
+int sfs_setsize(struct inode *inode, loff_t newsize)
+{
+	loff_t oldsize = inode->i_size;
+	bool did_zero = false;
+	int error = 0;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+
+	inode_dio_wait(inode);
+
+	if (newsize > SFS_MAX_INLINE_DATA(SFS_SB(inode->i_sb))) {
+		error = sfs_convert_inline(inode);
+		if (error)
+			return error;
+	}
+
+	if (newsize < inode->i_size) {
+		error = iomap_truncate_page(inode, newsize, &did_zero,
+					    &sfs_iomap_ops);
+		if (error)
+			return error;
+	}
+
+	/* a DAX fault must not map the blocks being freed */
+	sfs_dax_sem_down_write(SFS_I(inode));
+	truncate_setsize(inode, newsize);
+	/* page 0 is settled now, writeback copies no more than newsize */
+	if (sfs_has_inline_data(inode) && newsize < oldsize)
+		error = sfs_truncate_inline(inode, newsize);
+	sfs_truncate_blocks(inode, newsize);
+	sfs_dax_sem_up_write(SFS_I(inode));
+
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	return error;
+}
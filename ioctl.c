@@ -0,0 +1,83 @@
+/*
+ * ioctl.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/capability.h>
+#include <linux/compat.h>
+#include <linux/uaccess.h>
+
+#include "sfs.h"
+
+/*
+ * FITRIM: discard the free data blocks in the byte range of @arg. Only
+ * the data area is looked at, the metadata regions are never free.
+ */
+static int sfs_ioc_trim(struct super_block *sb, void __user *arg)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	u32 data_blkaddr = le32_to_cpu(sbi->raw_super->data_blkaddr);
+	u32 data_end = data_blkaddr +
+		       le32_to_cpu(sbi->raw_super->block_count_data);
+	struct fstrim_range range;
+	u64 start, end, minlen, trimmed = 0;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!blk_queue_discard(q))
+		return -EOPNOTSUPP;
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	start = range.start >> sb->s_blocksize_bits;
+	if (start >= data_end)
+		return -EINVAL;
+	end = range.len >> sb->s_blocksize_bits;
+	end = end > data_end - start ? data_end : start + end;
+	minlen = max_t(u64, range.minlen, q->limits.discard_granularity);
+	minlen = DIV_ROUND_UP_ULL(minlen, sb->s_blocksize);
+	if (minlen > end - start)
+		goto out;
+
+	err = sfs_trim_fs(sb, max_t(u32, start, data_blkaddr), end,
+			  max_t(u64, minlen, 1), &trimmed);
+	if (err)
+		return err;
+out:
+	range.len = trimmed << sb->s_blocksize_bits;
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
+
+long sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+
+	switch (cmd) {
+	case FITRIM:
+		return sfs_ioc_trim(sb, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+long sfs_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case FITRIM:
+		break;
+	default:
+		return -ENOIOCTLCMD;
+	}
+	return sfs_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
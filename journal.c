@@ -0,0 +1,1004 @@
+/*
+ * journal.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "sfs.h"
+
+/*
+ * Metadata journal
+ *
+ * Metadata buffers are changed inside handles (sfs_journal_start/stop) and
+ * passed to sfs_journal_dirty() instead of being marked dirty. They join
+ * the running transaction and stay pinned and clean in the buffer cache,
+ * so writeback never sends half a transaction home.
+ *
+ * Every handle reserves SFS_HANDLE_CREDITS blocks of the transaction, and
+ * a handle that would not fit waits for a commit, so a transaction never
+ * outgrows the log.
+ *
+ * A commit waits for the open handles, copies every buffer of the
+ * transaction and lets the next one start right away. The copies go to
+ * the log, then the commit block is written with a cache flush and FUA,
+ * and only then are the copies written to their home location. Commits are
+ * serialized: everyone asking for one while a commit is in flight is
+ * served by the next commit, together.
+ *
+ * A logged block must not be reused before the log holding it is
+ * checkpointed, or replay would overwrite its new contents, and a freed
+ * data block must keep its contents until the free is committed, or a
+ * crash would leave its file pointing at someone else's data or at a
+ * discarded block. So freed blocks only return to the allocator, or go
+ * to discard, at the first checkpoint after their transaction commits. A
+ * checkpoint waits for the home writes, flushes the disk and marks the
+ * journal empty.
+ *
+ * File data is neither journaled nor ordered against the metadata.
+ */
+
+enum {
+	BH_SfsJournal = BH_PrivateStart,	/* in the running transaction */
+};
+BUFFER_FNS(SfsJournal, sfs_journal)
+TAS_BUFFER_FNS(SfsJournal, sfs_journal)
+
+/*
+ * a buffer of a transaction, and its contents as of the commit
+ */
+struct sfs_jentry {
+	struct list_head je_list;
+	struct buffer_head *je_bh;
+	struct page *je_copy;
+	struct sfs_journal *je_journal;
+};
+
+/*
+ * blocks freed by transaction jf_tid, all in one group
+ */
+struct sfs_jfree {
+	struct list_head jf_list;
+	u32 jf_tid;
+	u32 jf_start;
+	u32 jf_len;
+};
+
+struct sfs_journal {
+	struct super_block *j_sb;
+	struct buffer_head *j_sbh;	/* journal super block, pinned */
+	u32 j_blkaddr;			/* first block of the journal area */
+	u32 j_len;			/* # of blocks, the super block included */
+
+	spinlock_t j_lock;		/* protects the running transaction */
+	u32 j_tid;			/* running transaction */
+	struct list_head j_running;	/* its struct sfs_jentry */
+	unsigned int j_nr_running;
+	unsigned int j_reserved;	/* credits left to the open handles */
+	unsigned int j_credits;		/* given to each handle */
+	unsigned int j_max_trans;	/* most blocks one commit can log */
+	int j_updates;			/* # of open handles */
+	bool j_locked;			/* a commit waits for the handles */
+	wait_queue_head_t j_wait_updates;
+	wait_queue_head_t j_wait_locked;
+	struct list_head j_frees;	/* struct sfs_jfree, oldest first */
+
+	struct mutex j_commit_mutex;	/* one commit at a time */
+	u32 j_commit_tid;		/* last committed transaction */
+
+	struct mutex j_log_mutex;	/* protects the log state below */
+	u32 j_head;			/* next journal block to write */
+	u32 j_free;			/* # of log blocks free to write */
+	u32 j_sequence;			/* of the next logged transaction */
+	bool j_empty;			/* journal super block says empty */
+
+	atomic_t j_io;			/* log writes in flight */
+	wait_queue_head_t j_wait_io;
+	atomic_t j_inflight;		/* home writes in flight */
+	wait_queue_head_t j_wait_inflight;
+	int j_errno;
+
+	struct delayed_work j_commit_work;
+};
+
+static struct kmem_cache *sfs_jentry_cachep;
+
+static inline bool sfs_tid_geq(u32 a, u32 b)
+{
+	return (s32)(a - b) >= 0;
+}
+
+/* the log wraps around to the block after the journal super block */
+static inline u32 sfs_journal_next(struct sfs_journal *journal, u32 blk)
+{
+	return ++blk == journal->j_len ? 1 : blk;
+}
+
+/*
+ * Handles
+ *
+ * A handle covers one change of the metadata that has to reach the disk as
+ * a whole. Handles nest, only the outermost one counts. They must not be
+ * started under a lock that the holder of another handle may wait for.
+ * A change bigger than SFS_HANDLE_CREDITS blocks is split over several
+ * handles, each leaving the metadata consistent, see sfs_truncate_blocks().
+ */
+
+/* a new handle may start: no commit is closing, and its credits fit */
+static inline bool sfs_journal_room(struct sfs_journal *journal)
+{
+	return !READ_ONCE(journal->j_locked) &&
+	       READ_ONCE(journal->j_nr_running) +
+	       READ_ONCE(journal->j_reserved) + journal->j_credits <=
+	       journal->j_max_trans;
+}
+
+void sfs_journal_start(struct super_block *sb, struct sfs_handle *handle)
+{
+	struct sfs_journal *journal = SFS_SB(sb)->s_journal;
+
+	handle->h_journal = journal;
+	handle->h_nested = current->journal_info != NULL;
+	if (!journal || handle->h_nested)
+		return;
+
+	spin_lock(&journal->j_lock);
+	while (!sfs_journal_room(journal)) {
+		/* the transaction is full, have it committed */
+		if (!journal->j_locked)
+			mod_delayed_work(system_long_wq,
+					 &journal->j_commit_work, 0);
+		spin_unlock(&journal->j_lock);
+		wait_event(journal->j_wait_locked, sfs_journal_room(journal));
+		spin_lock(&journal->j_lock);
+	}
+	journal->j_updates++;
+	journal->j_reserved += journal->j_credits;
+	handle->h_credits = journal->j_credits;
+	spin_unlock(&journal->j_lock);
+
+	current->journal_info = handle;
+	/* reclaim must not wait for the commit that waits for us */
+	handle->h_nofs = memalloc_nofs_save();
+}
+
+void sfs_journal_stop(struct sfs_handle *handle)
+{
+	struct sfs_journal *journal = handle->h_journal;
+
+	if (!journal || handle->h_nested)
+		return;
+
+	memalloc_nofs_restore(handle->h_nofs);
+	current->journal_info = NULL;
+	spin_lock(&journal->j_lock);
+	journal->j_reserved -= handle->h_credits;
+	if (!--journal->j_updates && journal->j_locked)
+		wake_up(&journal->j_wait_updates);
+	spin_unlock(&journal->j_lock);
+
+	/* the credits left may let a waiting handle in */
+	if (handle->h_credits && wq_has_sleeper(&journal->j_wait_locked))
+		wake_up_all(&journal->j_wait_locked);
+}
+
+/*
+ * @inode changed in the running transaction, record it for fsync. Called
+ * in a handle, so the transaction can't commit under us.
+ */
+void sfs_journal_inode(struct inode *inode, bool datasync)
+{
+	struct sfs_journal *journal = SFS_SB(inode->i_sb)->s_journal;
+	struct sfs_inode_info *si = SFS_I(inode);
+	u32 tid;
+
+	if (!journal)
+		return;
+	tid = READ_ONCE(journal->j_tid);
+	WRITE_ONCE(si->i_sync_tid, tid);
+	if (datasync)
+		WRITE_ONCE(si->i_datasync_tid, tid);
+}
+
+/*
+ * sfs_journal_dirty - @bh was changed under the current handle
+ *
+ * @inode, when given, owns the block: its mapping or its directory
+ * entries. Without a journal the buffer is just marked dirty, and
+ * associated with @inode.
+ */
+void sfs_journal_dirty(struct super_block *sb, struct buffer_head *bh,
+		       struct inode *inode)
+{
+	struct sfs_journal *journal = SFS_SB(sb)->s_journal;
+	struct sfs_handle handle, *h;
+	struct sfs_jentry *je;
+	unsigned int nr;
+
+	if (!journal) {
+		if (inode)
+			mark_buffer_dirty_inode(bh, inode);
+		else
+			mark_buffer_dirty(bh);
+		return;
+	}
+
+	sfs_journal_start(sb, &handle);
+	if (inode)
+		sfs_journal_inode(inode, true);
+
+	/* a commit can't take it away while we are in a handle */
+	if (buffer_sfs_journal(bh))
+		goto out;
+
+	je = kmem_cache_alloc(sfs_jentry_cachep, GFP_NOFS | __GFP_NOFAIL);
+
+	spin_lock(&journal->j_lock);
+	if (test_set_buffer_sfs_journal(bh)) {
+		spin_unlock(&journal->j_lock);
+		kmem_cache_free(sfs_jentry_cachep, je);
+		goto out;
+	}
+	/* whatever it held is committed with this transaction now */
+	clear_buffer_dirty(bh);
+	get_bh(bh);
+	je->je_bh = bh;
+	je->je_copy = NULL;
+	je->je_journal = journal;
+	list_add_tail(&je->je_list, &journal->j_running);
+	nr = ++journal->j_nr_running;
+	/* charged to the outermost handle */
+	h = current->journal_info;
+	if (!WARN_ON_ONCE(!h->h_credits)) {
+		h->h_credits--;
+		journal->j_reserved--;
+	}
+	spin_unlock(&journal->j_lock);
+
+	if (nr == 1)
+		queue_delayed_work(system_long_wq, &journal->j_commit_work,
+			READ_ONCE(SFS_SB(sb)->s_commit_interval));
+	else if (nr == (journal->j_len - 1) / 4)
+		/* big enough, commit before it outgrows the log */
+		mod_delayed_work(system_long_wq, &journal->j_commit_work, 0);
+out:
+	sfs_journal_stop(&handle);
+}
+
+/*
+ * Keep the blocks from @start on, all in one group, from the allocator
+ * and from discard until a checkpoint after the running transaction
+ * commits. Returns false without a journal.
+ */
+bool sfs_journal_free_blocks(struct super_block *sb, u32 start, u32 len)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_journal *journal = sbi->s_journal;
+	struct sfs_jfree *jf, *last;
+
+	if (!journal)
+		return false;
+
+	jf = kmalloc(sizeof(*jf), GFP_NOFS | __GFP_NOFAIL);
+
+	spin_lock(&journal->j_lock);
+	last = list_empty(&journal->j_frees) ? NULL :
+		list_last_entry(&journal->j_frees, struct sfs_jfree, jf_list);
+	if (last && last->jf_tid == journal->j_tid &&
+	    last->jf_start + last->jf_len == start &&
+	    sfs_block_group(sbi, last->jf_start) == sfs_block_group(sbi, start)) {
+		last->jf_len += len;
+		spin_unlock(&journal->j_lock);
+		kfree(jf);
+		return true;
+	}
+	jf->jf_tid = journal->j_tid;
+	jf->jf_start = start;
+	jf->jf_len = len;
+	list_add_tail(&jf->jf_list, &journal->j_frees);
+	spin_unlock(&journal->j_lock);
+	return true;
+}
+
+/*
+ * Log I/O
+ */
+static void sfs_journal_end_io(struct bio *bio)
+{
+	struct sfs_journal *journal = bio->bi_private;
+
+	if (bio->bi_status)
+		WRITE_ONCE(journal->j_errno, -EIO);
+	if (atomic_dec_and_test(&journal->j_io))
+		wake_up(&journal->j_wait_io);
+	bio_put(bio);
+}
+
+static void sfs_journal_home_end_io(struct bio *bio)
+{
+	struct sfs_jentry *je = bio->bi_private;
+	struct sfs_journal *journal = je->je_journal;
+
+	if (bio->bi_status)
+		WRITE_ONCE(journal->j_errno, -EIO);
+	__free_page(je->je_copy);
+	put_bh(je->je_bh);
+	kmem_cache_free(sfs_jentry_cachep, je);
+	if (atomic_dec_and_test(&journal->j_inflight))
+		wake_up(&journal->j_wait_inflight);
+	bio_put(bio);
+}
+
+static struct bio *sfs_journal_bio(struct sfs_journal *journal, u32 block,
+				   struct page *page, unsigned int op_flags)
+{
+	struct super_block *sb = journal->j_sb;
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOFS, 1);
+	bio_set_dev(bio, sb->s_bdev);
+	bio->bi_iter.bi_sector = (sector_t)block << (sb->s_blocksize_bits - 9);
+	bio->bi_opf = REQ_OP_WRITE | op_flags;
+	bio_add_page(bio, page, sb->s_blocksize, 0);
+	return bio;
+}
+
+/* write journal block @blk, waited for by sfs_journal_wait_io() */
+static void sfs_journal_write(struct sfs_journal *journal, u32 blk,
+			      struct page *page)
+{
+	struct bio *bio;
+
+	bio = sfs_journal_bio(journal, journal->j_blkaddr + blk, page, REQ_SYNC);
+	bio->bi_end_io = sfs_journal_end_io;
+	bio->bi_private = journal;
+	atomic_inc(&journal->j_io);
+	submit_bio(bio);
+}
+
+static void sfs_journal_wait_io(struct sfs_journal *journal)
+{
+	wait_event(journal->j_wait_io, !atomic_read(&journal->j_io));
+}
+
+static struct page *sfs_journal_header(int type, u32 sequence)
+{
+	struct page *page = alloc_page(GFP_NOFS | __GFP_NOFAIL | __GFP_ZERO);
+	struct sfs_journal_header *jh = page_address(page);
+
+	jh->jh_magic = cpu_to_le32(SFS_JOURNAL_MAGIC);
+	jh->jh_type = cpu_to_le32(type);
+	jh->jh_sequence = cpu_to_le32(sequence);
+	return page;
+}
+
+/*
+ * Point the journal super block at @start, 0 for an empty journal. A sync
+ * update flushes everything written before it.
+ */
+static int sfs_journal_write_super(struct sfs_journal *journal, u32 start,
+				   bool sync)
+{
+	struct buffer_head *bh = journal->j_sbh;
+	struct sfs_journal_super *js = (struct sfs_journal_super *)bh->b_data;
+
+	lock_buffer(bh);
+	js->js_header.jh_sequence = cpu_to_le32(journal->j_sequence);
+	js->js_start = cpu_to_le32(start);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+
+	if (!sync) {
+		write_dirty_buffer(bh, REQ_SYNC);
+		return 0;
+	}
+	return __sync_dirty_buffer(bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+}
+
+/*
+ * Checkpoint, called with j_log_mutex held. Once every committed block is
+ * home and on stable storage the whole log is free again, and so are the
+ * blocks freed by the committed transactions.
+ */
+static void __sfs_journal_checkpoint(struct sfs_journal *journal)
+{
+	struct sfs_sb_info *sbi = SFS_SB(journal->j_sb);
+	struct sfs_jfree *jf, *tmp;
+	LIST_HEAD(frees);
+
+	wait_event(journal->j_wait_inflight,
+		   !atomic_read(&journal->j_inflight));
+
+	if (!journal->j_empty) {
+		if (sfs_journal_write_super(journal, 0, true)) {
+			sfs_msg(journal->j_sb, KERN_ERR, "IO error writing "
+				"journal super block");
+			WRITE_ONCE(journal->j_errno, -EIO);
+			return;
+		}
+		journal->j_empty = true;
+	}
+	journal->j_free = journal->j_len - 1;
+
+	spin_lock(&journal->j_lock);
+	list_for_each_entry_safe(jf, tmp, &journal->j_frees, jf_list) {
+		if (!sfs_tid_geq(journal->j_commit_tid, jf->jf_tid))
+			break;
+		list_move_tail(&jf->jf_list, &frees);
+	}
+	spin_unlock(&journal->j_lock);
+
+	list_for_each_entry_safe(jf, tmp, &frees, jf_list) {
+		if (!sfs_discard_queue(journal->j_sb, jf->jf_start,
+				       jf->jf_len))
+			sfs_put_free_blocks(sbi, jf->jf_start, jf->jf_len);
+		kfree(jf);
+	}
+}
+
+/*
+ * Give the blocks freed by committed transactions back to the allocator.
+ * Returns false if there were none.
+ */
+bool sfs_journal_checkpoint(struct super_block *sb)
+{
+	struct sfs_journal *journal = SFS_SB(sb)->s_journal;
+
+	if (!journal || list_empty_careful(&journal->j_frees))
+		return false;
+
+	mutex_lock(&journal->j_log_mutex);
+	__sfs_journal_checkpoint(journal);
+	mutex_unlock(&journal->j_log_mutex);
+	return true;
+}
+
+/* write the frozen copies home, waiting for the previous ones first */
+static void sfs_journal_write_home(struct sfs_journal *journal,
+				   struct list_head *list)
+{
+	struct sfs_jentry *je, *tmp;
+	struct blk_plug plug;
+	struct bio *bio;
+
+	wait_event(journal->j_wait_inflight,
+		   !atomic_read(&journal->j_inflight));
+
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(je, tmp, list, je_list) {
+		list_del(&je->je_list);
+		bio = sfs_journal_bio(journal, je->je_bh->b_blocknr,
+				      je->je_copy, 0);
+		bio->bi_end_io = sfs_journal_home_end_io;
+		bio->bi_private = je;
+		atomic_inc(&journal->j_inflight);
+		submit_bio(bio);
+	}
+	blk_finish_plug(&plug);
+}
+
+static void sfs_journal_drop(struct list_head *list)
+{
+	struct sfs_jentry *je, *tmp;
+
+	list_for_each_entry_safe(je, tmp, list, je_list) {
+		list_del(&je->je_list);
+		__free_page(je->je_copy);
+		put_bh(je->je_bh);
+		kmem_cache_free(sfs_jentry_cachep, je);
+	}
+}
+
+/*
+ * Log the @nr frozen buffers of @list as one transaction. Called with
+ * j_log_mutex held and room for it in the log.
+ */
+static int sfs_journal_log(struct sfs_journal *journal,
+			   struct list_head *list, unsigned int nr)
+{
+	struct sfs_journal_desc *jd = NULL;
+	struct sfs_jentry *je;
+	struct page *page, *tmp;
+	struct bio *bio;
+	LIST_HEAD(headers);
+	unsigned int n = 0;
+	u32 blk = journal->j_head, desc_blk = 0;
+	int err;
+
+	if (journal->j_empty)
+		sfs_journal_write_super(journal, blk, false);
+
+	list_for_each_entry(je, list, je_list) {
+		if (n % SFS_JOURNAL_DESC_MAX == 0) {
+			if (jd)
+				sfs_journal_write(journal, desc_blk,
+						  virt_to_page(jd));
+			page = sfs_journal_header(SFS_JOURNAL_DESC,
+						  journal->j_sequence);
+			list_add(&page->lru, &headers);
+			jd = page_address(page);
+			jd->jd_count = cpu_to_le32(min_t(unsigned int, nr - n,
+							 SFS_JOURNAL_DESC_MAX));
+			desc_blk = blk;
+			blk = sfs_journal_next(journal, blk);
+		}
+		jd->jd_blocks[n % SFS_JOURNAL_DESC_MAX] =
+			cpu_to_le32(je->je_bh->b_blocknr);
+		sfs_journal_write(journal, blk, je->je_copy);
+		blk = sfs_journal_next(journal, blk);
+		n++;
+	}
+	sfs_journal_write(journal, desc_blk, virt_to_page(jd));
+	sfs_journal_wait_io(journal);
+	wait_on_buffer(journal->j_sbh);
+
+	err = READ_ONCE(journal->j_errno);
+	if (!err && !buffer_uptodate(journal->j_sbh))
+		err = -EIO;
+	if (err)
+		goto out;
+
+	/* everything above is on stable storage before the commit block */
+	page = sfs_journal_header(SFS_JOURNAL_COMMIT, journal->j_sequence);
+	list_add(&page->lru, &headers);
+	bio = sfs_journal_bio(journal, journal->j_blkaddr + blk, page,
+			      REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+	err = submit_bio_wait(bio);
+	bio_put(bio);
+	if (err)
+		goto out;
+
+	journal->j_empty = false;
+	journal->j_head = sfs_journal_next(journal, blk);
+	journal->j_free -= n + DIV_ROUND_UP(n, SFS_JOURNAL_DESC_MAX) + 1;
+	journal->j_sequence++;
+out:
+	list_for_each_entry_safe(page, tmp, &headers, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	return err;
+}
+
+/*
+ * Commit the running transaction, called with j_commit_mutex held. Returns
+ * 1 if a commit block was written, 0 if there was nothing to log.
+ */
+static int sfs_journal_do_commit(struct sfs_journal *journal)
+{
+	struct super_block *sb = journal->j_sb;
+	struct sfs_jentry *je;
+	LIST_HEAD(list);
+	unsigned int nr, needed;
+	u64 t0 = ktime_get_ns();
+	u32 tid;
+	int err = 0;
+
+	/* no new handles, wait for the open ones */
+	spin_lock(&journal->j_lock);
+	journal->j_locked = true;
+	while (journal->j_updates) {
+		spin_unlock(&journal->j_lock);
+		wait_event(journal->j_wait_updates,
+			   !READ_ONCE(journal->j_updates));
+		spin_lock(&journal->j_lock);
+	}
+	tid = journal->j_tid++;
+	list_splice_init(&journal->j_running, &list);
+	nr = journal->j_nr_running;
+	journal->j_nr_running = 0;
+	spin_unlock(&journal->j_lock);
+
+	/* nobody can change the buffers now, freeze them */
+	list_for_each_entry(je, &list, je_list) {
+		je->je_copy = alloc_page(GFP_NOFS | __GFP_NOFAIL);
+		lock_buffer(je->je_bh);
+		memcpy(page_address(je->je_copy), je->je_bh->b_data,
+		       sb->s_blocksize);
+		unlock_buffer(je->je_bh);
+		clear_buffer_sfs_journal(je->je_bh);
+	}
+
+	spin_lock(&journal->j_lock);
+	journal->j_locked = false;
+	spin_unlock(&journal->j_lock);
+	wake_up_all(&journal->j_wait_locked);
+
+	mutex_lock(&journal->j_log_mutex);
+	if (!nr)
+		goto out;
+
+	needed = nr + DIV_ROUND_UP(nr, SFS_JOURNAL_DESC_MAX) + 1;
+	if (needed > journal->j_free)
+		__sfs_journal_checkpoint(journal);
+	if (needed > journal->j_free) {
+		/*
+		 * Only a handle going past its credits gets here. Half of
+		 * it must not go home, so the journal stops.
+		 */
+		sfs_msg(sb, KERN_ERR, "transaction %u of %u blocks does not "
+			"fit in the journal, aborting", tid, nr);
+		WRITE_ONCE(journal->j_errno, -EIO);
+		sfs_journal_drop(&list);
+		goto out;
+	}
+
+	err = sfs_journal_log(journal, &list, nr);
+	if (err) {
+		sfs_msg(sb, KERN_ERR, "IO error committing transaction %u",
+			tid);
+		WRITE_ONCE(journal->j_errno, err);
+		sfs_journal_drop(&list);
+		goto out;
+	}
+	sfs_journal_write_home(journal, &list);
+	sfs_stat_inc(SFS_SB(sb), SFS_STAT_JOURNAL_COMMITS);
+	sfs_stat_add(SFS_SB(sb), SFS_STAT_JOURNAL_BLOCKS, nr);
+	sfs_stat_lat(SFS_SB(sb), SFS_LAT_JOURNAL_COMMIT, t0);
+	err = 1;
+out:
+	journal->j_commit_tid = tid;
+	mutex_unlock(&journal->j_log_mutex);
+	return err;
+}
+
+static int sfs_journal_commit(struct sfs_journal *journal, u32 tid)
+{
+	int ret = 0;
+
+	mutex_lock(&journal->j_commit_mutex);
+	/* somebody else's commit may have taken it along */
+	if (!sfs_tid_geq(journal->j_commit_tid, tid))
+		ret = sfs_journal_do_commit(journal);
+	if (ret >= 0 && READ_ONCE(journal->j_errno))
+		ret = READ_ONCE(journal->j_errno);
+	mutex_unlock(&journal->j_commit_mutex);
+	return ret;
+}
+
+/*
+ * sfs_journal_commit_tid - wait until transaction @tid is on stable storage
+ *
+ * Returns 1 if this call wrote a commit block, which flushed every write
+ * completed before it as well, 0 if @tid was committed already. Must not
+ * be called in a handle.
+ */
+int sfs_journal_commit_tid(struct super_block *sb, u32 tid)
+{
+	struct sfs_journal *journal = SFS_SB(sb)->s_journal;
+
+	if (!journal)
+		return 0;
+	if (WARN_ON_ONCE(current->journal_info))
+		return -EDEADLK;
+	return sfs_journal_commit(journal, tid);
+}
+
+/*
+ * sfs_journal_force_commit - wait until what is in the running transaction
+ * now is on stable storage
+ *
+ * Concurrent callers share the commit. Must not be called in a handle.
+ */
+int sfs_journal_force_commit(struct super_block *sb)
+{
+	struct sfs_journal *journal = SFS_SB(sb)->s_journal;
+	u32 tid;
+
+	if (!journal)
+		return 0;
+	if (WARN_ON_ONCE(current->journal_info))
+		return -EDEADLK;
+
+	spin_lock(&journal->j_lock);
+	tid = journal->j_tid;
+	spin_unlock(&journal->j_lock);
+	return min(sfs_journal_commit(journal, tid), 0);
+}
+
+static void sfs_journal_commit_work(struct work_struct *work)
+{
+	struct sfs_journal *journal = container_of(to_delayed_work(work),
+					struct sfs_journal, j_commit_work);
+	u32 tid;
+
+	spin_lock(&journal->j_lock);
+	tid = journal->j_tid;
+	spin_unlock(&journal->j_lock);
+	sfs_journal_commit(journal, tid);
+
+	/* hand back freed blocks and keep half of the log free */
+	mutex_lock(&journal->j_log_mutex);
+	if (!list_empty_careful(&journal->j_frees) ||
+	    journal->j_free < (journal->j_len - 1) / 2)
+		__sfs_journal_checkpoint(journal);
+	mutex_unlock(&journal->j_log_mutex);
+}
+
+/*
+ * Replay
+ */
+static int sfs_journal_type(struct buffer_head *bh, u32 sequence)
+{
+	struct sfs_journal_header *jh = (struct sfs_journal_header *)bh->b_data;
+
+	if (le32_to_cpu(jh->jh_magic) != SFS_JOURNAL_MAGIC ||
+	    le32_to_cpu(jh->jh_sequence) != sequence)
+		return 0;
+	return le32_to_cpu(jh->jh_type);
+}
+
+/*
+ * Look for the commit block of the transaction at @blk. Returns 1 and the
+ * block after it in @end, 0 if the transaction never committed.
+ */
+static int sfs_journal_scan(struct sfs_journal *journal, u32 blk,
+			    u32 sequence, u32 *end)
+{
+	struct super_block *sb = journal->j_sb;
+	struct sfs_journal_desc *jd;
+	struct buffer_head *bh;
+	u32 used = 0, count = 0;
+	int type;
+
+	while (used < journal->j_len - 1) {
+		bh = sb_bread(sb, journal->j_blkaddr + blk);
+		if (!bh)
+			return -EIO;
+		type = sfs_journal_type(bh, sequence);
+		if (type == SFS_JOURNAL_DESC) {
+			jd = (struct sfs_journal_desc *)bh->b_data;
+			count = le32_to_cpu(jd->jd_count);
+		}
+		brelse(bh);
+
+		if (type == SFS_JOURNAL_COMMIT) {
+			*end = sfs_journal_next(journal, blk);
+			return 1;
+		}
+		if (type != SFS_JOURNAL_DESC || !count ||
+		    count > SFS_JOURNAL_DESC_MAX)
+			return 0;
+
+		used += count + 1;
+		for (count++; count; count--)
+			blk = sfs_journal_next(journal, blk);
+	}
+	return 0;
+}
+
+/* copy the blocks of the committed transaction at @blk home */
+static int sfs_journal_apply(struct sfs_journal *journal, u32 blk,
+			     u32 sequence)
+{
+	struct super_block *sb = journal->j_sb;
+	u64 nr_blocks = le64_to_cpu(SFS_SB(sb)->raw_super->block_count);
+	struct sfs_journal_desc *jd;
+	struct buffer_head *bh, *lbh, *hbh;
+	u32 count, home, i;
+	int err = 0;
+
+	for (;;) {
+		bh = sb_bread(sb, journal->j_blkaddr + blk);
+		if (!bh)
+			return -EIO;
+		if (sfs_journal_type(bh, sequence) != SFS_JOURNAL_DESC) {
+			brelse(bh);
+			return 0;
+		}
+		jd = (struct sfs_journal_desc *)bh->b_data;
+		count = le32_to_cpu(jd->jd_count);
+		blk = sfs_journal_next(journal, blk);
+
+		for (i = 0; i < count; i++) {
+			home = le32_to_cpu(jd->jd_blocks[i]);
+			if (!home || home >= nr_blocks || (home >= journal->j_blkaddr &&
+			    home < journal->j_blkaddr + journal->j_len)) {
+				sfs_msg(sb, KERN_ERR, "bad block %u in journal "
+					"transaction %u", home, sequence);
+				err = -EUCLEAN;
+				break;
+			}
+			lbh = sb_bread(sb, journal->j_blkaddr + blk);
+			hbh = sb_getblk(sb, home);
+			if (!lbh || !hbh) {
+				brelse(lbh);
+				brelse(hbh);
+				err = -EIO;
+				break;
+			}
+			lock_buffer(hbh);
+			memcpy(hbh->b_data, lbh->b_data, sb->s_blocksize);
+			set_buffer_uptodate(hbh);
+			unlock_buffer(hbh);
+			mark_buffer_dirty(hbh);
+			brelse(hbh);
+			brelse(lbh);
+			blk = sfs_journal_next(journal, blk);
+		}
+		brelse(bh);
+		if (err)
+			return err;
+	}
+}
+
+static int sfs_journal_replay(struct sfs_journal *journal, u32 blk)
+{
+	struct super_block *sb = journal->j_sb;
+	unsigned int nr = 0;
+	u32 end;
+	int ret, err;
+
+	while ((ret = sfs_journal_scan(journal, blk, journal->j_sequence,
+				       &end)) > 0) {
+		err = sfs_journal_apply(journal, blk, journal->j_sequence);
+		if (err)
+			return err;
+		blk = end;
+		journal->j_sequence++;
+		nr++;
+	}
+	if (ret < 0)
+		return ret;
+
+	err = sync_blockdev(sb->s_bdev);
+	if (err)
+		return err;
+	/* the log blocks read above are stale from now on */
+	invalidate_bdev(sb->s_bdev);
+
+	err = sfs_journal_write_super(journal, 0, true);
+	if (err)
+		return err;
+	sfs_msg(sb, KERN_INFO, "recovered %u transactions from the journal",
+		nr);
+	return 0;
+}
+
+/*
+ * sfs_journal_load - set up the journal and replay it
+ *
+ * Must run before anything else reads metadata from the disk.
+ */
+int sfs_journal_load(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_super_block *raw_super = sbi->raw_super;
+	struct sfs_journal_super *js;
+	struct sfs_journal *journal;
+	u32 start;
+	int err = -EINVAL;
+
+	if (!(le32_to_cpu(raw_super->feature) & SFS_FEATURE_JOURNAL))
+		return 0;
+
+	journal = kzalloc(sizeof(*journal), GFP_KERNEL);
+	if (!journal)
+		return -ENOMEM;
+
+	journal->j_sb = sb;
+	journal->j_blkaddr = le32_to_cpu(raw_super->journal_blkaddr);
+	journal->j_len = le32_to_cpu(raw_super->block_count_journal);
+	if (journal->j_len < SFS_JOURNAL_MIN_BLOCKS ||
+	    journal->j_blkaddr + journal->j_len >
+	    le32_to_cpu(raw_super->data_blkaddr)) {
+		sfs_msg(sb, KERN_ERR, "bad journal area %u+%u",
+			journal->j_blkaddr, journal->j_len);
+		goto free_journal;
+	}
+
+	spin_lock_init(&journal->j_lock);
+	journal->j_tid = 1;
+	INIT_LIST_HEAD(&journal->j_running);
+	init_waitqueue_head(&journal->j_wait_updates);
+	init_waitqueue_head(&journal->j_wait_locked);
+	INIT_LIST_HEAD(&journal->j_frees);
+	mutex_init(&journal->j_commit_mutex);
+	mutex_init(&journal->j_log_mutex);
+	atomic_set(&journal->j_io, 0);
+	init_waitqueue_head(&journal->j_wait_io);
+	atomic_set(&journal->j_inflight, 0);
+	init_waitqueue_head(&journal->j_wait_inflight);
+	INIT_DELAYED_WORK(&journal->j_commit_work, sfs_journal_commit_work);
+
+	journal->j_sbh = sb_bread(sb, journal->j_blkaddr);
+	if (!journal->j_sbh) {
+		sfs_msg(sb, KERN_ERR, "unable to read journal super block");
+		err = -EIO;
+		goto free_journal;
+	}
+	js = (struct sfs_journal_super *)journal->j_sbh->b_data;
+	if (le32_to_cpu(js->js_header.jh_magic) != SFS_JOURNAL_MAGIC ||
+	    le32_to_cpu(js->js_header.jh_type) != SFS_JOURNAL_SUPER ||
+	    le32_to_cpu(js->js_len) != journal->j_len) {
+		sfs_msg(sb, KERN_ERR, "bad journal super block");
+		goto free_sbh;
+	}
+	journal->j_sequence = le32_to_cpu(js->js_header.jh_sequence);
+	start = le32_to_cpu(js->js_start);
+
+	if (start) {
+		if (start >= journal->j_len) {
+			sfs_msg(sb, KERN_ERR, "bad journal start %u", start);
+			goto free_sbh;
+		}
+		if (bdev_read_only(sb->s_bdev)) {
+			sfs_msg(sb, KERN_ERR, "journal needs recovery on a "
+				"read-only device");
+			err = -EROFS;
+			goto free_sbh;
+		}
+		err = sfs_journal_replay(journal, start);
+		if (err) {
+			sfs_msg(sb, KERN_ERR, "journal replay failed");
+			goto free_sbh;
+		}
+	}
+
+	journal->j_head = 1;
+	journal->j_free = journal->j_len - 1;
+	journal->j_empty = true;
+	/* the log also holds the descriptors and the commit block */
+	journal->j_max_trans = journal->j_len - 2 -
+		DIV_ROUND_UP(journal->j_len - 2, SFS_JOURNAL_DESC_MAX + 1);
+	journal->j_credits = min_t(unsigned int, SFS_HANDLE_CREDITS,
+				   journal->j_max_trans);
+	sbi->s_journal = journal;
+	return 0;
+
+free_sbh:
+	brelse(journal->j_sbh);
+free_journal:
+	kfree(journal);
+	return err;
+}
+
+/*
+ * Commit and checkpoint everything, the journal is empty afterwards.
+ */
+void sfs_journal_destroy(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_journal *journal = sbi->s_journal;
+
+	if (!journal)
+		return;
+
+	cancel_delayed_work_sync(&journal->j_commit_work);
+	sfs_journal_force_commit(sb);
+
+	mutex_lock(&journal->j_log_mutex);
+	__sfs_journal_checkpoint(journal);
+	mutex_unlock(&journal->j_log_mutex);
+	WARN_ON(!list_empty(&journal->j_frees));
+
+	brelse(journal->j_sbh);
+	kfree(journal);
+	sbi->s_journal = NULL;
+}
+
+int __init sfs_init_journal_cache(void)
+{
+	sfs_jentry_cachep = kmem_cache_create("sfs_journal_entry",
+				sizeof(struct sfs_jentry), 0,
+				SLAB_RECLAIM_ACCOUNT, NULL);
+	if (sfs_jentry_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void sfs_destroy_journal_cache(void)
+{
+	kmem_cache_destroy(sfs_jentry_cachep);
+}
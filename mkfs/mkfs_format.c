@@ -58,7 +58,9 @@ static int sfs_prepare_super_block(void) {
         u_int32_t inodes_blkaddr, data_blkaddr;
         u_int32_t block_count_imap, block_count_dmap;
         u_int32_t block_count_inodes, block_count_data;
+        u_int32_t journal_blkaddr, block_count_journal = 0;
         u_int32_t root_addr;
+	u_int32_t inode_count, inodes_per_block = 1;
 
         set_sb(magic, SFS_SUPER_MAGIC);
 
@@ -79,14 +81,37 @@ static int sfs_prepare_super_block(void) {
 	set_sb(imap_blkaddr, imap_blkaddr);
 
 	total_block_count = total_block_count - 2;
-	block_count_inodes = total_block_count >> log_base_2(SFS_NODE_RATIO);
-	block_count_imap = MAP_SIZE_ALIGN(block_count_inodes);
+	inode_count = total_block_count >> log_base_2(SFS_NODE_RATIO);
+	if (c.dense_inode) {
+		inodes_per_block = SFS_INODES_PER_BLOCK;
+		set_sb(feature, SFS_FEATURE_DENSE_INODE);
+	}
+	if (c.extents)
+		set_sb(feature, get_sb(feature) | SFS_FEATURE_EXTENTS);
+	set_sb(inode_count, inode_count);
+	block_count_inodes = (inode_count + inodes_per_block - 1) /
+							inodes_per_block;
+	block_count_imap = MAP_SIZE_ALIGN(inode_count);
 	set_sb(block_count_imap, block_count_imap);
 
+	/* the journal takes at most 1/16 of the device */
+	if (c.journal > 0) {
+		block_count_journal = min((u_int32_t)c.journal,
+					  total_block_count / 16);
+		if (block_count_journal < SFS_JOURNAL_MIN_BLOCKS) {
+			MSG(0, "Info: Device too small for a journal\n");
+			block_count_journal = 0;
+		}
+	}
+	c.journal = block_count_journal;
+	if (block_count_journal)
+		set_sb(feature, get_sb(feature) | SFS_FEATURE_JOURNAL);
+
 	dmap_blkaddr = imap_blkaddr + block_count_imap;
 	set_sb(dmap_blkaddr,dmap_blkaddr);
 
-	total_block_count = total_block_count - (block_count_imap + block_count_inodes);
+	total_block_count = total_block_count - (block_count_imap +
+				block_count_inodes + block_count_journal);
 	block_count_data = SFS_BLKSIZE * (1 + total_block_count) / (SFS_BLKSIZE + 1);
 	block_count_dmap = MAP_SIZE_ALIGN(block_count_data);
 	set_sb(block_count_dmap, block_count_dmap);
@@ -95,13 +120,23 @@ static int sfs_prepare_super_block(void) {
 	set_sb(inodes_blkaddr, inodes_blkaddr);
 	set_sb(block_count_inodes, block_count_inodes);
 
-	data_blkaddr = inodes_blkaddr + block_count_inodes;
+	journal_blkaddr = inodes_blkaddr + block_count_inodes;
+	set_sb(journal_blkaddr, block_count_journal ? journal_blkaddr : 0);
+	set_sb(block_count_journal, block_count_journal);
+
+	data_blkaddr = journal_blkaddr + block_count_journal;
 	set_sb(data_blkaddr, data_blkaddr);
 	set_sb(block_count_data, block_count_data);
 
-	root_addr = inodes_blkaddr;
+	/* the root inode is the first slot of the inode area */
+	root_addr = inodes_blkaddr * inodes_per_block;
 	set_sb(root_addr, root_addr);
 
+	/* the root directory takes one inode and one data block */
+	set_sb(free_block_count, block_count_data - 1);
+	set_sb(free_inode_count, inode_count - 1);
+	set_sb(state, SFS_VALID_FS);
+
 	return 0;
 }
 
@@ -225,6 +260,34 @@ static int sfs_write_root_inode(void)
 	return 0;
 }
 
+/*
+ * The module reads every imap and dmap block at mount and trusts them, so
+ * none may keep bits of an older file system. The two maps are adjacent.
+ */
+static int sfs_zero_maps(void)
+{
+	u_int32_t blkaddr = get_sb(imap_blkaddr);
+	u_int32_t len = get_sb(block_count_imap) + get_sb(block_count_dmap);
+	u_int32_t i;
+	u_int8_t *buf;
+
+	buf = calloc(SFS_BLKSIZE, 1);
+	if (buf == NULL) {
+		MSG(1, "\tError: Calloc Failed for map block!!!\n");
+		return -1;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (dev_write_block(buf, blkaddr + i)) {
+			MSG(1, "\tError: While writing the maps to disk!!!\n");
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
 static int sfs_update_imap(u32 blkaddr)
 {
 	char *imap = NULL;
@@ -330,6 +393,51 @@ exit:
 	return err;
 }
 
+/*
+ * Zero the log so that blocks left over by an older file system never pass
+ * for a transaction, then write an empty journal super block.
+ */
+static int sfs_write_journal(void)
+{
+	struct sfs_journal_super *js;
+	u_int32_t journal_blkaddr = get_sb(journal_blkaddr);
+	u_int32_t len = get_sb(block_count_journal);
+	u_int32_t i;
+	u_int8_t *buf;
+
+	if (!len)
+		return 0;
+
+	buf = calloc(SFS_BLKSIZE, 1);
+	if (buf == NULL) {
+		MSG(1, "\tError: Calloc Failed for journal block!!!\n");
+		return -1;
+	}
+
+	for (i = 1; i < len; i++) {
+		if (dev_write_block(buf, journal_blkaddr + i)) {
+			MSG(1, "\tError: While writing the journal to disk!!!\n");
+			free(buf);
+			return -1;
+		}
+	}
+
+	js = (struct sfs_journal_super *)buf;
+	js->js_header.jh_magic = cpu_to_le32(SFS_JOURNAL_MAGIC);
+	js->js_header.jh_type = cpu_to_le32(SFS_JOURNAL_SUPER);
+	js->js_header.jh_sequence = cpu_to_le32(1);
+	js->js_len = cpu_to_le32(len);
+	js->js_start = 0;
+	if (dev_write_block(buf, journal_blkaddr)) {
+		MSG(1, "\tError: While writing the journal super block!!!\n");
+		free(buf);
+		return -1;
+	}
+
+	free(buf);
+	return 0;
+}
+
 static int sfs_write_super_block(void)
 {
 	int index;
@@ -373,12 +481,24 @@ int sfs_format_device(void)
                 }
         }
 
+        err = sfs_zero_maps();
+        if (err < 0) {
+                MSG(0, "\tError: Failed to clear the maps!!!\n");
+                goto exit;
+        }
+
         err = sfs_create_root_dir();
         if (err < 0) {
                 MSG(0, "\tError: Failed to create the root directory!!!\n");
                 goto exit;
         }
 
+        err = sfs_write_journal();
+        if (err < 0) {
+                MSG(0, "\tError: Failed to write the journal!!!\n");
+                goto exit;
+        }
+
         err = sfs_write_super_block();
         if (err < 0) {
                 MSG(0, "\tError: Failed to write the super block!!!\n");
@@ -35,6 +35,10 @@ static void mkfs_usage(void) {
 	MSG(0, "[options]:\n");
 	MSG(0, "  -a heap-based allocation [default:0]\n");
 	MSG(0, "  -d debug level [default:0]\n");
+	MSG(0, "  -e extent-mapped files [default:1]\n");
+	MSG(0, "  -i dense inode table [default:1]\n");
+	MSG(0, "     (small files keep 108 bytes inline, 3948 with -i 0)\n");
+	MSG(0, "  -j journal blocks, 0 for none [default:1024]\n");
 	MSG(0, "  -l label\n");
 	exit(1);
 }
@@ -53,6 +57,14 @@ static void sfs_show_info(void) {
 		MSG(0, "Info: Lable = %s\n", c.vol_label);
 
 	MSG(0, "Info: Trim is %s\n", c.trim ? "enalbe": "disable");
+
+	MSG(0, "Info: Dense inode table is %s\n",
+				c.dense_inode ? "enable" : "disable");
+	MSG(0, "Info: Extents are %s\n", c.extents ? "enable" : "disable");
+	if (c.journal)
+		MSG(0, "Info: Journal of %d blocks\n", c.journal);
+	else
+		MSG(0, "Info: Journal is disable\n");
 }
 
 /*
@@ -62,6 +74,9 @@ void sfs_init_configuration(void)
 {
         c.heap = 1;
         c.trim = 1;
+	c.dense_inode = 1;
+	c.extents = 1;
+	c.journal = 1024;
         c.sector_size = DEFAULT_SECTOR_SIZE;
         c.sectors_per_block = DEFAULT_SECTORS_PER_BLOCK;
         c.vol_label = "";
@@ -73,10 +88,10 @@ void sfs_init_configuration(void)
 
 static void sfs_parse_options(int argc, char *argv[])
 {
-        static const char *option_string = "a:d:l:";
+        static const char *option_string = "a:d:e:i:j:l:";
         int32_t option=0;
 
-        while ((option = getopt(argc, argv, option_string) != EOF)) {
+        while ((option = getopt(argc, argv, option_string)) != EOF) {
                 switch (option) {
                 case 'a':
 //			config.heap = atoi(optarg);
@@ -87,6 +102,15 @@ static void sfs_parse_options(int argc, char *argv[])
 			c.dbg_lv = atoi(optarg);
 			MSG(0, "Info: Debug level = %d\n", c.dbg_lv);
                         break;
+                case 'e':
+			c.extents = atoi(optarg);
+                        break;
+                case 'i':
+			c.dense_inode = atoi(optarg);
+                        break;
+                case 'j':
+			c.journal = atoi(optarg);
+                        break;
                 case 'l':
                         if (strlen(optarg) > 512) {
                                 MSG(0, "Error: Volume Label should be less than\
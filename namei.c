@@ -0,0 +1,171 @@
+/*
+ * namei.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+
+#include "sfs.h"
+
+/*
+ * A name that is not there is spliced in as a negative dentry. There is
+ * no ->d_revalidate, so the dcache answers a repeated lookup of it, in
+ * RCU-walk, until sfs_create() or sfs_mkdir() make the very same dentry
+ * positive with d_instantiate_new(). The VFS turns it negative again on
+ * unlink and rmdir. What the walk reads of a directory, its mode, owner
+ * and i_op, is only changed under i_rwsem, and inodes are freed through
+ * ->free_inode after a grace period.
+ */
+struct dentry *sfs_lookup(struct inode *dir, struct dentry *dentry,
+			  unsigned int flags)
+{
+	struct inode *inode = NULL;
+	ino_t ino;
+	int err;
+
+	if (dentry->d_name.len > SFS_NAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	err = sfs_inode_by_name(dir, &dentry->d_name, &ino);
+	if (!err) {
+		inode = sfs_iget(dir->i_sb, ino);
+		if (inode == ERR_PTR(-ESTALE)) {
+			sfs_msg(dir->i_sb, KERN_ERR, "deleted inode referenced: "
+				"%lu", (unsigned long)ino);
+			return ERR_PTR(-EIO);
+		}
+	} else if (err != -ENOENT) {
+		return ERR_PTR(err);
+	}
+	return d_splice_alias(inode, dentry);
+}
+
+static int sfs_add_nondir(struct dentry *dentry, struct inode *inode)
+{
+	int err = sfs_add_link(dentry, inode);
+
+	if (!err) {
+		d_instantiate_new(dentry, inode);
+		return 0;
+	}
+	inode_dec_link_count(inode);
+	discard_new_inode(inode);
+	return err;
+}
+
+int sfs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
+	       bool excl)
+{
+	struct sfs_handle handle;
+	struct inode *inode;
+	int err;
+
+	sfs_journal_start(dir->i_sb, &handle);
+	inode = sfs_new_inode(dir, mode, &dentry->d_name);
+	err = PTR_ERR(inode);
+	if (IS_ERR(inode))
+		goto out;
+
+	sfs_set_inode_ops(inode);
+	mark_inode_dirty(inode);
+	err = sfs_add_nondir(dentry, inode);
+out:
+	sfs_journal_stop(&handle);
+	return err;
+}
+
+int sfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+	struct sfs_handle handle;
+	struct inode *inode;
+	int err;
+
+	sfs_journal_start(dir->i_sb, &handle);
+	inode_inc_link_count(dir);
+
+	inode = sfs_new_inode(dir, S_IFDIR | mode, &dentry->d_name);
+	err = PTR_ERR(inode);
+	if (IS_ERR(inode))
+		goto out_dir;
+
+	/* new directories are always hashed */
+	SFS_I(inode)->i_flags |= SFS_INDEX_FL;
+	sfs_set_inode_ops(inode);
+
+	inode_inc_link_count(inode);
+
+	err = sfs_make_empty(inode, dir);
+	if (err)
+		goto out_fail;
+
+	err = sfs_add_link(dentry, inode);
+	if (err)
+		goto out_fail;
+
+	d_instantiate_new(dentry, inode);
+out:
+	sfs_journal_stop(&handle);
+	return err;
+
+out_fail:
+	inode_dec_link_count(inode);
+	inode_dec_link_count(inode);
+	discard_new_inode(inode);
+out_dir:
+	inode_dec_link_count(dir);
+	goto out;
+}
+
+int sfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct sfs_dir_entry *de;
+	struct sfs_handle handle;
+	struct buffer_head *bh;
+	int err;
+
+	sfs_journal_start(dir->i_sb, &handle);
+	de = sfs_find_entry(dir, &dentry->d_name, &bh);
+	err = PTR_ERR(de);
+	if (IS_ERR(de))
+		goto out;
+	err = -ENOENT;
+	if (!de)
+		goto out;
+
+	err = sfs_delete_entry(dir, de, bh);
+	if (err)
+		goto out;
+
+	inode->i_ctime = dir->i_ctime;
+	inode_dec_link_count(inode);
+out:
+	sfs_journal_stop(&handle);
+	return err;
+}
+
+int sfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct sfs_handle handle;
+	int err;
+
+	sfs_journal_start(dir->i_sb, &handle);
+	err = sfs_empty_dir(inode);
+	if (err == 0) {
+		err = -ENOTEMPTY;
+	} else if (err > 0) {
+		err = sfs_unlink(dir, dentry);
+		if (!err) {
+			inode->i_size = 0;
+			inode_dec_link_count(inode);
+			inode_dec_link_count(dir);
+		}
+	}
+	sfs_journal_stop(&handle);
+	return err;
+}
@@ -10,14 +10,71 @@
 #define _SFS_H
 
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/blockgroup_lock.h>
 #include <linux/percpu_counter.h>
 #include <linux/rbtree.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 
 #include "sfs_fs.h"
 
 #include <linux/dcache.h>
 
+/*
+ * a run of free data blocks, see balloc.c
+ */
+struct sfs_free_extent {
+	struct rb_node fe_start_node;			/* in s_free_by_start */
+	struct rb_node fe_len_node;			/* in s_free_by_len */
+	u32 fe_start;					/* first free block */
+	u32 fe_len;					/* # of free blocks */
+};
+
+/*
+ * The data area is split into allocation groups, each with its own free
+ * extent trees and lock, so that allocations from different CPUs don't
+ * serialize. A group covers whole dmap blocks.
+ */
+#define SFS_MAPS_PER_GROUP	8
+#define SFS_BLOCKS_PER_GROUP	(SFS_MAPS_PER_GROUP * SFS_MAP_BITS_PER_BLK)
+#define SFS_INODES_PER_GROUP	SFS_MAP_BITS_PER_BLK	/* one imap block */
+
+struct sfs_alloc_group {
+	u32 ag_start;					/* first block of the group */
+	u32 ag_len;					/* # of blocks in the group */
+	u32 ag_free;					/* # of free blocks */
+	struct rb_root ag_free_by_start;		/* free extents by start */
+	struct rb_root ag_free_by_len;			/* free extents by length */
+};
+
+struct sfs_inode_group {
+	u32 ig_free;					/* # of free inodes */
+};
+
+/*
+ * the pinned blocks of the imap or the dmap, see bitmap.c
+ */
+struct sfs_bitmap {
+	struct super_block *bm_sb;
+	struct buffer_head **bm_bh;			/* one per map block */
+	unsigned long *bm_dirty;			/* blocks to flush */
+	u32 bm_blkaddr;					/* first map block */
+	u32 bm_count;					/* # of map blocks */
+};
+
+/*
+ * a cached run of mapped blocks of an inode, see extent_cache.c
+ */
+struct sfs_es {
+	struct rb_node es_node;				/* in i_es_tree */
+	u32 es_lblk;					/* first logical block */
+	u32 es_pblk;					/* first physical block */
+	u32 es_len;					/* # of blocks */
+};
+
 /*
  * sfs super-block data in memory
  */
@@ -26,8 +83,125 @@ struct sfs_sb_info {
 	struct sfs_super_block *raw_super;		/* raw super block pointer */
 
 	spinlock_t s_lock;
+	u32 s_inodes_count;				/* # of inodes */
+	u32 s_inode_size;				/* on-disk inode slot size */
+	u32 s_inodes_per_block;
+	struct percpu_counter s_freeblocks_counter;	/* free data blocks */
+	struct percpu_counter s_freeinodes_counter;	/* free inodes */
+	struct percpu_counter s_dirtyblocks_counter;	/* delayed allocation */
+
+	struct blockgroup_lock *s_blockgroup_lock;	/* per group locks */
+	struct sfs_alloc_group *s_groups;		/* data allocation groups */
+	u32 s_ngroups;
+	struct sfs_inode_group *s_inode_groups;		/* one per imap block */
+	u32 s_ninode_groups;
+	unsigned int __percpu *s_group_hint;		/* current group of a CPU */
+	struct sfs_bitmap s_imap;			/* inode bitmap */
+	struct sfs_bitmap s_dmap;			/* data bitmap */
+
+	spinlock_t s_es_lock;				/* protects s_es_list */
+	struct list_head s_es_list;			/* inodes with cached runs */
+	unsigned long s_es_inodes;			/* # of inodes on s_es_list */
+	atomic_long_t s_es_nr;				/* # of cached runs */
+	struct shrinker s_es_shrinker;
+
+	struct sfs_journal *s_journal;			/* NULL without a journal */
+	struct sfs_discard *s_discard;			/* NULL if the device can't */
+	struct dax_device *s_daxdev;			/* NULL without dax */
+
+	struct sfs_stats __percpu *s_stats;		/* see sysfs.c */
+	struct kobject s_kobj;				/* /sys/fs/sfs/<dev> */
+	struct completion s_kobj_unregister;
+
+	/* mount options, see struct sfs_mount_options */
+	unsigned int s_mount_opt;			/* SFS_MOUNT_* */
+	unsigned long s_commit_interval;		/* jiffies */
+	unsigned int s_ra_pages;			/* 0: the device's */
+	unsigned long s_es_max;				/* 0: no cap */
+};
+
+/*
+ * per-CPU statistics of a mount, see sysfs.c
+ */
+enum {
+	SFS_STAT_MAP_LOOKUPS,		/* sfs_map_blocks() calls */
+	SFS_STAT_MAP_CACHE_HITS,	/* runs found in the mapping cache */
+	SFS_STAT_MAP_CACHE_MISSES,
+	SFS_STAT_INDIRECT_READS,	/* indirect blocks, extent nodes read */
+	SFS_STAT_ALLOCS,		/* sfs_new_blocks() calls */
+	SFS_STAT_ALLOC_GROUPS,		/* allocation groups searched */
+	SFS_STAT_ALLOC_BLOCKS,		/* blocks handed out */
+	SFS_STAT_DIR_LOOKUPS,		/* sfs_find_entry() calls */
+	SFS_STAT_DIR_HITS,
+	SFS_STAT_DIR_MISSES,
+	SFS_STAT_DIR_BLOCKS,		/* directory blocks scanned for them */
+	SFS_STAT_BITMAP_FLUSHES,
+	SFS_STAT_BITMAP_BLOCKS,		/* map blocks written by the flushes */
+	SFS_STAT_JOURNAL_COMMITS,
+	SFS_STAT_JOURNAL_BLOCKS,	/* metadata blocks logged */
+	SFS_STAT_NR,
+};
+
+/* latency histograms */
+enum {
+	SFS_LAT_MAP,			/* sfs_map_blocks() past the cache */
+	SFS_LAT_ALLOC,
+	SFS_LAT_DIR_LOOKUP,
+	SFS_LAT_BITMAP_FLUSH,
+	SFS_LAT_JOURNAL_COMMIT,
+	SFS_LAT_NR,
+};
+
+#define SFS_LAT_BUCKETS		20	/* bucket n: [2^n, 2^(n+1)) us */
+
+struct sfs_stats {
+	u64 st_count[SFS_STAT_NR];
+	u64 st_lat[SFS_LAT_NR][SFS_LAT_BUCKETS];
+};
+
+/*
+ * the tunables of a mount, parsed apart so a bad remount changes nothing
+ */
+struct sfs_mount_options {
+	unsigned int s_mount_opt;		/* SFS_MOUNT_* */
+	unsigned long s_commit_interval;	/* journal commit age at most */
+	unsigned int s_ra_pages;		/* readahead window of a file */
+	unsigned long s_es_max;			/* cached mapping runs at most */
 };
 
+#define SFS_DEF_COMMIT_INTERVAL		(5 * HZ)
+
+/*
+ * Mount flags
+ */
+#define SFS_MOUNT_DISCARD_ASYNC		0x0001	/* discard freed blocks */
+#define SFS_MOUNT_DAX			0x0002	/* direct access to pmem */
+#define SFS_MOUNT_BESTFIT		0x0004	/* ignore goals within a group */
+
+/* @o is a struct sfs_sb_info or a struct sfs_mount_options */
+#define clear_opt(o, opt)		((o)->s_mount_opt &= ~SFS_MOUNT_##opt)
+#define set_opt(o, opt)			((o)->s_mount_opt |= SFS_MOUNT_##opt)
+#define test_opt(o, opt)		((o)->s_mount_opt & SFS_MOUNT_##opt)
+
+/*
+ * a journal handle, on the stack of its owner, see journal.c
+ */
+struct sfs_handle {
+	struct sfs_journal *h_journal;
+	bool h_nested;
+	unsigned int h_credits;		/* # of blocks it may still add */
+	unsigned int h_nofs;		/* memalloc_nofs_save() state */
+};
+
+/* blocks a handle may add to the running transaction */
+#define SFS_HANDLE_CREDITS	64
+
+/*
+ * blocks of a file truncate frees per handle, each may take a dmap block
+ * and the way to it in the block map, see sfs_truncate_blocks()
+ */
+#define SFS_TRUNCATE_STEP	32
+
 #define SFS_ROOT_INO		 2	/* Root inode */
 
 /*
@@ -35,28 +209,383 @@ struct sfs_sb_info {
  */
 #define SFS_BLOCK_SIZE(s)		((s)->blocksize)
 #define SFS_BLOCK_SIZE_BITS(s)		((s)->blocksize_bits)
-#define SFS_INODE_SIZE(s)		(SFS_SB(s)->inode_size)
+#define SFS_INODE_SIZE(s)		(SFS_SB(s)->s_inode_size)
+
+#define SFS_FEATURE_SUPP		(SFS_FEATURE_DENSE_INODE | \
+					 SFS_FEATURE_EXTENTS | \
+					 SFS_FEATURE_JOURNAL)
 
 struct sfs_inode_info {
 	__le32 i_data[15];
 	__u32 i_flags;
+	__u8 i_inline;			/* SFS_INLINE_DATA */
 
 	__u32 i_dir_start_lookup;
+	__u32 i_alloc_goal;		/* next block for delayed allocation */
+
+	struct rw_semaphore i_map_sem;	/* protects i_data and indirect blocks */
+#ifdef CONFIG_FS_DAX
+	struct rw_semaphore i_dax_sem;	/* DAX faults against truncate */
+#endif
+
+	rwlock_t i_es_lock;		/* protects the mapping cache */
+	struct rb_root i_es_tree;	/* cached runs by logical block */
+	unsigned int i_es_nr;		/* # of cached runs */
+	bool i_es_ref;			/* cache used since the last scan */
+	struct list_head i_es_list;	/* in s_es_list */
+	struct rb_root i_da_tree;	/* delayed allocations, by i_map_sem */
+	unsigned int i_da_blocks;	/* # of blocks in i_da_tree */
+
+	unsigned long i_sync_state;	/* SFS_SYNC_* bits */
+	u32 i_sync_tid;			/* last transaction changing the inode */
+	u32 i_datasync_tid;		/* same, timestamps left out */
 
 	struct inode vfs_inode;
 };
 
+/* i_sync_state: what the next fsync has to take care of */
+enum {
+	SFS_SYNC_FLUSH,			/* data was written, flush the cache */
+	SFS_SYNC_MAPS,			/* imap or dmap bits were changed */
+};
+
 static inline struct sfs_inode_info *SFS_I(struct inode *inode)
 {
 	return container_of(inode, struct sfs_inode_info, vfs_inode);
 }
 
+#ifdef CONFIG_FS_DAX
+#define sfs_dax_sem_down_write(si)	down_write(&(si)->i_dax_sem)
+#define sfs_dax_sem_up_write(si)	up_write(&(si)->i_dax_sem)
+#else
+#define sfs_dax_sem_down_write(si)
+#define sfs_dax_sem_up_write(si)
+#endif
+
+static inline void sfs_set_sync_state(struct inode *inode, int bit)
+{
+	unsigned long *state = &SFS_I(inode)->i_sync_state;
+
+	if (!test_bit(bit, state))
+		set_bit(bit, state);
+}
+
 static inline struct sfs_sb_info *SFS_SB(struct super_block *sb)
 {
 	return sb->s_fs_info;
 }
 
+static inline void sfs_stat_add(struct sfs_sb_info *sbi, int stat, u64 n)
+{
+	this_cpu_add(sbi->s_stats->st_count[stat], n);
+}
+
+static inline void sfs_stat_inc(struct sfs_sb_info *sbi, int stat)
+{
+	this_cpu_inc(sbi->s_stats->st_count[stat]);
+}
+
+/* account the time since @start, a ktime_get_ns() value */
+static inline void sfs_stat_lat(struct sfs_sb_info *sbi, int lat, u64 start)
+{
+	u64 us = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+	unsigned int n = us ? min_t(unsigned int, ilog2(us),
+				    SFS_LAT_BUCKETS - 1) : 0;
+
+	this_cpu_inc(sbi->s_stats->st_lat[lat][n]);
+}
+
+/*
+ * The clock is read for a tracepoint only while it is enabled, see
+ * sfs_trace.h. An event enabled halfway through reports a latency of 0.
+ */
+#define sfs_trace_clock(event)	(trace_##event##_enabled() ? ktime_get_ns() : 0)
+
+static inline u64 sfs_trace_since(u64 start)
+{
+	return start ? ktime_get_ns() - start : 0;
+}
+
+static inline bool sfs_has_inline_data(struct inode *inode)
+{
+	return SFS_I(inode)->i_inline & SFS_INLINE_DATA;
+}
+
+/* bytes of file data that fit in the inode slot: 108 dense, 3948 if not */
+#define SFS_MAX_INLINE_DATA(sbi)	\
+	((sbi)->s_inode_size - sizeof(struct sfs_inode))
+
 #define SFS_GET_SB(s, i)		(SFS_SB(s)->raw_super->i)
 
+static inline bool sfs_block_in_data(struct sfs_sb_info *sbi, u32 block)
+{
+	u32 data_blkaddr = le32_to_cpu(sbi->raw_super->data_blkaddr);
+
+	return block >= data_blkaddr && block - data_blkaddr <
+		le32_to_cpu(sbi->raw_super->block_count_data);
+}
+
+static inline u32 sfs_block_group(struct sfs_sb_info *sbi, u32 block)
+{
+	return (block - le32_to_cpu(sbi->raw_super->data_blkaddr)) /
+		SFS_BLOCKS_PER_GROUP;
+}
+
+static inline spinlock_t *sfs_group_lock(struct sfs_sb_info *sbi,
+					 unsigned int group)
+{
+	return bgl_lock_ptr(sbi->s_blockgroup_lock, group);
+}
+
+/*
+ * Inode addresses count inode slots from the start of the device, dentries
+ * refer to inodes by them. This is the only place that knows how inode
+ * numbers are laid out on disk.
+ */
+static inline u32 sfs_ino_to_addr(struct sfs_sb_info *sbi, ino_t ino)
+{
+	return le32_to_cpu(sbi->raw_super->inodes_blkaddr) *
+		sbi->s_inodes_per_block + (ino - SFS_ROOT_INO);
+}
+
+static inline ino_t sfs_addr_to_ino(struct sfs_sb_info *sbi, u32 addr)
+{
+	return addr - le32_to_cpu(sbi->raw_super->inodes_blkaddr) *
+		sbi->s_inodes_per_block + SFS_ROOT_INO;
+}
+
+/* block holding inode address @addr, and the offset within it */
+static inline u32 sfs_inode_block(struct sfs_sb_info *sbi, u32 addr)
+{
+	return addr / sbi->s_inodes_per_block;
+}
+
+static inline unsigned int sfs_inode_offset(struct sfs_sb_info *sbi, u32 addr)
+{
+	return (addr % sbi->s_inodes_per_block) * sbi->s_inode_size;
+}
+
+/* super.c */
+extern void sfs_msg(struct super_block *sb, const char *level,
+		    const char *fmt, ...);
+extern void sfs_error(struct super_block *sb, const char *fmt, ...);
+extern int sfs_getattr(const struct path *path, struct kstat *stat,
+		       u32 request_mask, unsigned int query_flags);
+extern int sfs_setattr(struct dentry *dentry, struct iattr *iattr);
+extern struct inode_operations sfs_dir_inode_operations;
+extern struct file_operations sfs_dir_operations;
+
+/* file.c */
+extern int sfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+extern struct inode_operations sfs_file_inode_operations;
+extern const struct file_operations sfs_file_operations;
+
+/* sysfs.c */
+extern u64 sfs_stat_sum(struct sfs_sb_info *sbi, int stat);
+extern int sfs_register_sysfs(struct super_block *sb);
+extern void sfs_unregister_sysfs(struct super_block *sb);
+extern int __init sfs_init_sysfs(void);
+extern void sfs_exit_sysfs(void);
+
+/* ioctl.c */
+extern long sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+extern long sfs_compat_ioctl(struct file *filp, unsigned int cmd,
+			     unsigned long arg);
+
+/* super.c */
+extern int sfs_commit_super(struct super_block *sb, int wait);
+
+/* inode.c */
+extern struct sfs_inode *sfs_get_raw_inode(struct super_block *sb, ino_t ino,
+					   struct buffer_head **bhp);
+extern void sfs_set_inode_ops(struct inode *inode);
+extern struct inode *sfs_iget(struct super_block *sb, unsigned long ino);
+extern int sfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+extern void sfs_dirty_inode(struct inode *inode, int flags);
+extern void sfs_evict_inode(struct inode *inode);
+extern int sfs_setsize(struct inode *inode, loff_t newsize);
+
+/* data.c */
+#define SFS_MAP_RESERVE		0x01	/* reserve holes for delayed allocation */
+#define SFS_MAP_ALLOC		0x02	/* allocate reserved blocks */
+#define SFS_MAP_UNRESERVE	0x04	/* drop unused reservations */
+#define SFS_MAP_DIRECT		0x08	/* allocate whole holes for direct I/O */
+#define SFS_MAP_DAX		0x10	/* zero new blocks, align PMD-sized runs */
+#define SFS_MAP_NOWAIT		0x20	/* lookup only, -EAGAIN rather than block */
+
+#define SFS_MAP_NEW		0x01	/* m_flags: blocks were just allocated
+					   or reserved */
+#define SFS_MAP_BOUNDARY	0x02	/* m_flags: run cut at a pointer array end */
+
+#define SFS_PMD_BLOCKS		(PMD_SIZE >> SFS_LOG_BLOCK_SIZE)
+
+/*
+ * DAX maps a 2 MiB fault with one PMD only when the blocks behind it are
+ * 2 MiB aligned on the device as well, so a run starting on such a file
+ * offset asks the allocator for an aligned goal.
+ */
+static inline u32 sfs_dax_goal(struct inode *inode, sector_t lblk, u32 goal,
+			       unsigned int count)
+{
+	struct sfs_sb_info *sbi = SFS_SB(inode->i_sb);
+
+	if (lblk % SFS_PMD_BLOCKS || count < SFS_PMD_BLOCKS)
+		return goal;
+	if (!sfs_block_in_data(sbi, goal))
+		goal = le32_to_cpu(sbi->raw_super->data_blkaddr);
+	return round_up(goal, SFS_PMD_BLOCKS);
+}
+
+/*
+ * Lookups share i_map_sem, any other @flags of a map call change the block
+ * map and take it for write.
+ */
+static inline int sfs_map_lock(struct inode *inode, int flags)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+
+	if (flags & SFS_MAP_NOWAIT)
+		return down_read_trylock(&si->i_map_sem) ? 0 : -EAGAIN;
+	if (flags)
+		down_write(&si->i_map_sem);
+	else
+		down_read(&si->i_map_sem);
+	return 0;
+}
+
+static inline void sfs_map_unlock(struct inode *inode, int flags)
+{
+	struct sfs_inode_info *si = SFS_I(inode);
+
+	if (flags & ~SFS_MAP_NOWAIT)
+		up_write(&si->i_map_sem);
+	else
+		up_read(&si->i_map_sem);
+}
+
+/*
+ * a run of logical blocks and where it lives on disk
+ */
+struct sfs_map {
+	sector_t m_lblk;
+	sector_t m_pblk;
+	unsigned int m_len;
+	unsigned int m_flags;
+};
+
+extern int sfs_map_blocks(struct inode *inode, struct sfs_map *map, int flags);
+extern void sfs_truncate_blocks(struct inode *inode, loff_t size);
+extern const struct iomap_ops sfs_iomap_ops;
+extern const struct address_space_operations sfs_aops;
+extern const struct address_space_operations sfs_dax_aops;
+
+/* extents.c */
+extern void sfs_ext_init(struct inode *inode);
+extern int sfs_ext_map_blocks(struct inode *inode, struct sfs_map *map,
+			      int flags);
+extern bool sfs_ext_truncate(struct inode *inode, u32 start, u32 *end);
+
+/* extent_cache.c */
+extern bool sfs_es_lookup(struct inode *inode, struct sfs_map *map);
+extern void sfs_es_insert(struct inode *inode, u32 lblk, u32 pblk, u32 len);
+extern void sfs_es_invalidate(struct inode *inode, u32 start);
+extern void sfs_es_drop(struct inode *inode);
+extern bool sfs_da_lookup(struct inode *inode, u32 lblk, unsigned int *len);
+extern int sfs_da_insert(struct inode *inode, u32 lblk, u32 len);
+extern unsigned int sfs_da_remove(struct inode *inode, u32 lblk, u32 len);
+extern int sfs_es_register(struct sfs_sb_info *sbi);
+extern void sfs_es_unregister(struct sfs_sb_info *sbi);
+extern int __init sfs_init_es_cache(void);
+extern void sfs_destroy_es_cache(void);
+
+/* bitmap.c */
+extern int sfs_bitmap_load(struct super_block *sb, struct sfs_bitmap *bm,
+			   u32 blkaddr, u32 count);
+extern void sfs_bitmap_release(struct sfs_bitmap *bm);
+extern struct buffer_head *sfs_bitmap_get(struct sfs_bitmap *bm, u32 n);
+extern void sfs_bitmap_dirty(struct sfs_bitmap *bm, u32 n);
+extern int sfs_bitmap_flush(struct sfs_bitmap *bm, int wait);
+
+/* journal.c */
+extern void sfs_journal_start(struct super_block *sb, struct sfs_handle *handle);
+extern void sfs_journal_stop(struct sfs_handle *handle);
+extern void sfs_journal_inode(struct inode *inode, bool datasync);
+extern void sfs_journal_dirty(struct super_block *sb, struct buffer_head *bh,
+			      struct inode *inode);
+extern bool sfs_journal_free_blocks(struct super_block *sb, u32 start, u32 len);
+extern bool sfs_journal_checkpoint(struct super_block *sb);
+extern int sfs_journal_commit_tid(struct super_block *sb, u32 tid);
+extern int sfs_journal_force_commit(struct super_block *sb);
+extern int sfs_journal_load(struct super_block *sb);
+extern void sfs_journal_destroy(struct super_block *sb);
+extern int __init sfs_init_journal_cache(void);
+extern void sfs_destroy_journal_cache(void);
+
+static inline bool sfs_journaled(struct super_block *sb)
+{
+	return SFS_SB(sb)->s_journal != NULL;
+}
+
+/* discard.c */
+extern bool sfs_discard_queue(struct super_block *sb, u32 start, u32 len);
+extern bool sfs_discard_flush(struct super_block *sb);
+extern int sfs_discard_init(struct super_block *sb);
+extern void sfs_discard_destroy(struct super_block *sb);
+
+/* balloc.c */
+extern int sfs_build_alloc_groups(struct super_block *sb);
+extern void sfs_destroy_alloc_groups(struct sfs_sb_info *sbi);
+extern int __init sfs_init_free_extent_cache(void);
+extern void sfs_destroy_free_extent_cache(void);
+extern int sfs_reserve_blocks(struct sfs_sb_info *sbi, unsigned int count);
+extern void sfs_release_blocks(struct sfs_sb_info *sbi, unsigned int count);
+extern bool sfs_reclaim_held_blocks(struct super_block *sb);
+extern u32 sfs_new_blocks(struct inode *inode, u32 goal, unsigned int *count,
+			  bool reserved, int *err);
+extern void sfs_put_free_blocks(struct sfs_sb_info *sbi, u32 block, u32 len);
+extern void sfs_free_blocks(struct inode *inode, u32 block, unsigned int count);
+extern void sfs_free_meta_blocks(struct inode *inode, u32 block,
+				 unsigned int count);
+extern int sfs_trim_fs(struct super_block *sb, u32 start, u32 end, u32 minlen,
+		       u64 *trimmed);
+
+/* ialloc.c */
+extern int sfs_build_inode_groups(struct super_block *sb);
+extern void sfs_destroy_inode_groups(struct sfs_sb_info *sbi);
+extern ino_t sfs_new_ino(struct inode *dir, u32 group, int *err);
+extern void sfs_free_ino(struct super_block *sb, ino_t ino);
+extern struct inode *sfs_new_inode(struct inode *dir, umode_t mode,
+				   const struct qstr *qstr);
+
+/* inline.c */
+struct iomap;
+extern int sfs_iomap_inline(struct inode *inode, loff_t offset, loff_t length,
+			    struct iomap *iomap);
+extern int sfs_write_inline_page(struct page *page,
+				 struct writeback_control *wbc, void *data);
+extern int sfs_convert_inline(struct inode *inode);
+extern int sfs_truncate_inline(struct inode *inode, loff_t size);
+
+/* dir.c */
+extern struct sfs_dir_entry *sfs_find_entry(struct inode *dir,
+		const struct qstr *name, struct buffer_head **res_bh);
+extern int sfs_inode_by_name(struct inode *dir, const struct qstr *name,
+			     ino_t *ino);
+extern int sfs_add_link(struct dentry *dentry, struct inode *inode);
+extern int sfs_delete_entry(struct inode *dir, struct sfs_dir_entry *de,
+			    struct buffer_head *bh);
+extern int sfs_make_empty(struct inode *inode, struct inode *parent);
+extern int sfs_empty_dir(struct inode *inode);
+extern int sfs_readdir(struct file *file, struct dir_context *ctx);
+
+/* namei.c */
+extern struct dentry *sfs_lookup(struct inode *dir, struct dentry *dentry,
+				 unsigned int flags);
+extern int sfs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
+		      bool excl);
+extern int sfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
+extern int sfs_unlink(struct inode *dir, struct dentry *dentry);
+extern int sfs_rmdir(struct inode *dir, struct dentry *dentry);
+
 
 #endif /* _SFS_H */
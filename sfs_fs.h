@@ -102,8 +102,73 @@ struct sfs_super_block {
         __le32 block_count_data;        /* # of blocks for data */
         __le32 root_addr;               /* root inode blkaddr */
 	char path[MAX_PATH_LEN];
+	__le64 free_block_count;	/* # of free data blocks */
+	__le32 free_inode_count;	/* # of free inodes */
+	__le16 state;			/* mount state */
+	__le32 feature;			/* SFS_FEATURE_* */
+	__le32 inode_count;		/* # of inodes */
+	__le32 journal_blkaddr;		/* start block address of journal */
+	__le32 block_count_journal;	/* # of blocks for journal */
 } __attribute__((packed));
 
+/*
+ * feature flags
+ *
+ * With SFS_FEATURE_DENSE_INODE the inode area holds SFS_INODES_PER_BLOCK
+ * inodes of SFS_INODE_SLOT_SIZE bytes per block and inode_count tells how
+ * many there are. Without it every inode takes a whole block. Either way
+ * the inode address kept in dentries and root_addr is
+ * inodes_blkaddr * (inodes per block) + (ino - SFS_ROOT_INO).
+ */
+#define SFS_FEATURE_DENSE_INODE		0x00000001
+#define SFS_FEATURE_EXTENTS		0x00000002	/* new files use extents */
+#define SFS_FEATURE_JOURNAL		0x00000004	/* metadata journal */
+
+#define SFS_INODE_SLOT_SIZE		256
+#define SFS_INODES_PER_BLOCK		(SFS_BLKSIZE / SFS_INODE_SLOT_SIZE)
+
+/*
+ * metadata journal
+ *
+ * The first block of the journal area is its super block, the rest is a
+ * circular log. Every transaction is one or more descriptor blocks, each
+ * followed by the blocks it lists, and a commit block. All of them carry
+ * the sequence number of the transaction. js_start is 0 when every logged
+ * block is home, otherwise replay starts there with the sequence of the
+ * journal super block.
+ */
+#define SFS_JOURNAL_MAGIC		0x53464a4c	/* "SFJL" */
+
+#define SFS_JOURNAL_SUPER		1
+#define SFS_JOURNAL_DESC		2
+#define SFS_JOURNAL_COMMIT		3
+
+struct sfs_journal_header {
+	__le32 jh_magic;
+	__le32 jh_type;			/* SFS_JOURNAL_* */
+	__le32 jh_sequence;
+} __attribute__((packed));
+
+struct sfs_journal_super {
+	struct sfs_journal_header js_header;
+	__le32 js_len;			/* # of blocks, this one included */
+	__le32 js_start;		/* journal block of the oldest transaction */
+} __attribute__((packed));
+
+struct sfs_journal_desc {
+	struct sfs_journal_header jd_header;
+	__le32 jd_count;		/* # of blocks that follow */
+	__le32 jd_blocks[];		/* their home addresses */
+} __attribute__((packed));
+
+#define SFS_JOURNAL_DESC_MAX	\
+	((SFS_BLKSIZE - sizeof(struct sfs_journal_desc)) / sizeof(__le32))
+#define SFS_JOURNAL_MIN_BLOCKS	16
+
+/* super block state */
+#define SFS_VALID_FS		0x0001	/* cleanly unmounted, counts valid */
+#define SFS_ERROR_FS		0x0002	/* corruption was found */
+
 #define DEF_ADDRS_PER_INODE     12      /* Address Pointers in Inode */
 #define DEF_IDPS_PER_INODE      3       /* Indirect Pointers in Inode */
 #define DEF_SFS_N_BLOCKS	DEF_ADDRS_PER_INODE + DEF_IDPS_PER_INODE
@@ -170,6 +235,53 @@ struct sfs_dentry_block {
         struct sfs_dir_entry dentry[DENTRY_IN_BLOCK];
 } __attribute__((packed));
 
+/* dentry slots that fit in a 4KB block after the bitmap */
+#define NR_DENTRY_IN_BLOCK	((SFS_BLKSIZE - SIZE_OF_DENTRY_BITMAP) / \
+					sizeof(struct sfs_dir_entry))
+
+/*
+ * Hash-indexed directories (SFS_INDEX_FL)
+ *
+ * Level n of the directory holds 2^n buckets of SFS_DIR_BUCKET_BLOCKS
+ * dentry blocks, right after the blocks of level n - 1. A name is only
+ * stored in the bucket (hash % 2^n) of some level, so lookup reads one
+ * bucket per level. "." and ".." live in the first block of level 0.
+ * i_size always ends on a level boundary.
+ */
+#define SFS_DIR_BUCKET_BLOCKS	2
+#define SFS_MAX_DIR_HASH_DEPTH	20
+
+/* i_inline flags */
+#define SFS_INLINE_DATA		0x01	/* file data follows the inode */
+
+/* inode flags */
+#define SFS_INDEX_FL		0x00001000	/* hash-indexed directory */
+#define SFS_EXTENTS_FL		0x00080000	/* blocks mapped by extents */
+
+/*
+ * Extent tree (SFS_EXTENTS_FL)
+ *
+ * The root node takes the place of d_addr/i_addr in the inode, the other
+ * nodes are whole blocks. A node is a header followed by eh_entries
+ * entries sorted by e_lblk. In leaves (eh_depth 0) an entry maps e_len
+ * blocks from e_lblk to e_pblk, in index nodes e_pblk is the child node
+ * and e_lblk a lower bound of the blocks it maps.
+ */
+#define SFS_EXT_MAGIC		0x5345	/* "ES" */
+
+struct sfs_extent_header {
+	__le16 eh_magic;		/* SFS_EXT_MAGIC */
+	__le16 eh_entries;		/* # of valid entries */
+	__le16 eh_max;			/* capacity of the node */
+	__le16 eh_depth;		/* 0 for leaves */
+} __attribute__((packed));
+
+struct sfs_extent {
+	__le32 e_lblk;			/* first logical block */
+	__le32 e_len;			/* # of blocks, 0 in index nodes */
+	__le32 e_pblk;			/* first physical block or child node */
+} __attribute__((packed));
+
 /* file types used in inode_info->flags */
 enum {
         SFS_UNKNOWN,
@@ -181,6 +293,7 @@ enum {
 #define SFS_IMAP_BLK_OFFSET		2	/* imap block offset is 1 */
 #define SFS_IMAP_BYTE_OFFSET		4096	/* imap byte offset is 4096 */
 #define MAP_SIZE_ALIGN(size)		((size) + SFS_BLKSIZE) / SFS_BLKSIZE
+#define SFS_MAP_BITS_PER_BLK		SFS_BLKSIZE	/* entries per map block */
 
 #define SFS_NODE_RATIO			128	/* node : data ratio is 1 : 128 */
 
@@ -0,0 +1,270 @@
+/*
+ * sfs_trace.h
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sfs
+
+#if !defined(_SFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SFS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/writeback.h>
+
+/*
+ * Every event carries the latency of the operation in nanoseconds. The
+ * callers only read the clock for an event that is enabled, see
+ * sfs_trace_clock().
+ */
+
+TRACE_EVENT(sfs_map_blocks,
+	TP_PROTO(struct inode *inode, struct sfs_map *map, int flags, int err,
+		 u64 lat),
+	TP_ARGS(inode, map, flags, err, lat),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(u32,		lblk)
+		__field(u32,		pblk)
+		__field(unsigned int,	len)
+		__field(int,		flags)
+		__field(int,		m_flags)
+		__field(int,		err)
+		__field(u64,		lat)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->lblk	= map->m_lblk;
+		__entry->pblk	= map->m_pblk;
+		__entry->len	= map->m_len;
+		__entry->flags	= flags;
+		__entry->m_flags = map->m_flags;
+		__entry->err	= err;
+		__entry->lat	= lat;
+	),
+
+	TP_printk("dev %d,%d ino %lu lblk %u pblk %u len %u flags 0x%x "
+		  "m_flags 0x%x err %d lat %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->lblk, __entry->pblk,
+		  __entry->len, __entry->flags, __entry->m_flags, __entry->err,
+		  __entry->lat)
+);
+
+TRACE_EVENT(sfs_alloc_blocks,
+	TP_PROTO(struct inode *inode, u32 goal, unsigned int want, u32 pblk,
+		 unsigned int len, int err, u64 lat),
+	TP_ARGS(inode, goal, want, pblk, len, err, lat),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(u32,		goal)
+		__field(unsigned int,	want)
+		__field(u32,		pblk)
+		__field(unsigned int,	len)
+		__field(int,		err)
+		__field(u64,		lat)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->goal	= goal;
+		__entry->want	= want;
+		__entry->pblk	= pblk;
+		__entry->len	= len;
+		__entry->err	= err;
+		__entry->lat	= lat;
+	),
+
+	TP_printk("dev %d,%d ino %lu goal %u want %u pblk %u len %u err %d "
+		  "lat %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->goal, __entry->want,
+		  __entry->pblk, __entry->len, __entry->err, __entry->lat)
+);
+
+TRACE_EVENT(sfs_free_blocks,
+	TP_PROTO(struct inode *inode, u32 pblk, unsigned int len, bool meta,
+		 u64 lat),
+	TP_ARGS(inode, pblk, len, meta, lat),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(u32,		pblk)
+		__field(unsigned int,	len)
+		__field(bool,		meta)
+		__field(u64,		lat)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pblk	= pblk;
+		__entry->len	= len;
+		__entry->meta	= meta;
+		__entry->lat	= lat;
+	),
+
+	TP_printk("dev %d,%d ino %lu pblk %u len %u meta %d lat %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->pblk, __entry->len,
+		  __entry->meta, __entry->lat)
+);
+
+DECLARE_EVENT_CLASS(sfs_dir_op,
+	TP_PROTO(struct inode *dir, const struct qstr *name, ino_t ino,
+		 int err, u64 lat),
+	TP_ARGS(dir, name, ino, err, lat),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		dir)
+		__field(ino_t,		ino)
+		__field(int,		err)
+		__field(u64,		lat)
+		__dynamic_array(char,	name, name->len + 1)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dir->i_sb->s_dev;
+		__entry->dir	= dir->i_ino;
+		__entry->ino	= ino;
+		__entry->err	= err;
+		__entry->lat	= lat;
+		memcpy(__get_str(name), name->name, name->len);
+		__get_str(name)[name->len] = '\0';
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s ino %lu err %d lat %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->dir, __get_str(name),
+		  (unsigned long)__entry->ino, __entry->err, __entry->lat)
+);
+
+/* ino is 0 if the name is not there */
+DEFINE_EVENT(sfs_dir_op, sfs_dir_lookup,
+	TP_PROTO(struct inode *dir, const struct qstr *name, ino_t ino,
+		 int err, u64 lat),
+	TP_ARGS(dir, name, ino, err, lat)
+);
+
+DEFINE_EVENT(sfs_dir_op, sfs_dir_insert,
+	TP_PROTO(struct inode *dir, const struct qstr *name, ino_t ino,
+		 int err, u64 lat),
+	TP_ARGS(dir, name, ino, err, lat)
+);
+
+DECLARE_EVENT_CLASS(sfs_inode_io,
+	TP_PROTO(struct super_block *sb, ino_t ino, int sync, int err,
+		 u64 lat),
+	TP_ARGS(sb, ino, sync, err, lat),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(int,		sync)
+		__field(int,		err)
+		__field(u64,		lat)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->ino	= ino;
+		__entry->sync	= sync;
+		__entry->err	= err;
+		__entry->lat	= lat;
+	),
+
+	TP_printk("dev %d,%d ino %lu sync %d err %d lat %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->sync, __entry->err,
+		  __entry->lat)
+);
+
+DEFINE_EVENT(sfs_inode_io, sfs_read_inode,
+	TP_PROTO(struct super_block *sb, ino_t ino, int sync, int err,
+		 u64 lat),
+	TP_ARGS(sb, ino, sync, err, lat)
+);
+
+DEFINE_EVENT(sfs_inode_io, sfs_write_inode,
+	TP_PROTO(struct super_block *sb, ino_t ino, int sync, int err,
+		 u64 lat),
+	TP_ARGS(sb, ino, sync, err, lat)
+);
+
+TRACE_EVENT(sfs_writepages,
+	TP_PROTO(struct inode *inode, struct writeback_control *wbc,
+		 long nr_to_write, int err, u64 lat),
+	TP_ARGS(inode, wbc, nr_to_write, err, lat),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(pgoff_t,	start)
+		__field(pgoff_t,	end)
+		__field(long,		written)
+		__field(int,		sync_mode)
+		__field(int,		err)
+		__field(u64,		lat)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->start	= wbc->range_start >> PAGE_SHIFT;
+		__entry->end	= wbc->range_end >> PAGE_SHIFT;
+		__entry->written = nr_to_write - wbc->nr_to_write;
+		__entry->sync_mode = wbc->sync_mode;
+		__entry->err	= err;
+		__entry->lat	= lat;
+	),
+
+	TP_printk("dev %d,%d ino %lu pages %lu-%lu written %ld sync_mode %d "
+		  "err %d lat %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->start, __entry->end,
+		  __entry->written, __entry->sync_mode, __entry->err,
+		  __entry->lat)
+);
+
+TRACE_EVENT(sfs_sync_fs,
+	TP_PROTO(struct super_block *sb, int wait, int err, u64 lat),
+	TP_ARGS(sb, wait, err, lat),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(int,		wait)
+		__field(int,		err)
+		__field(u64,		lat)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->wait	= wait;
+		__entry->err	= err;
+		__entry->lat	= lat;
+	),
+
+	TP_printk("dev %d,%d wait %d err %d lat %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->wait,
+		  __entry->err, __entry->lat)
+);
+
+#endif /* _SFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sfs_trace
+#include <trace/define_trace.h>
@@ -28,6 +28,9 @@
 //#include <linux/sfs_fs.h>
 #include "sfs.h"
 
+#define CREATE_TRACE_POINTS
+#include "sfs_trace.h"
+
 void sfs_msg(struct super_block *sb, const char *level, const char *fmt, ...)
 {
 	struct va_format vaf;
@@ -40,12 +43,41 @@ void sfs_msg(struct super_block *sb, const char *level, const char *fmt, ...)
 	va_end(args);
 }
 
+/*
+ * Report corruption found while running. SFS_ERROR_FS stays set in the
+ * superblock, clean unmounts included, so later mounts warn about it.
+ */
+void sfs_error(struct super_block *sb, const char *fmt, ...)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct va_format vaf;
+	va_list args;
+
+	va_start(args, fmt);
+	vaf.fmt = fmt;
+	vaf.va = &args;
+	printk(KERN_ERR "SFS error (%s): %pV\n", sb->s_id, &vaf);
+	va_end(args);
+
+	if (sb_rdonly(sb) ||
+	    (sbi->raw_super->state & cpu_to_le16(SFS_ERROR_FS)))
+		return;
+	sbi->raw_super->state |= cpu_to_le16(SFS_ERROR_FS);
+	sfs_commit_super(sb, 0);
+}
+
 static struct kmem_cache *sfs_inode_cachep;
 
 static void init_once(void *foo)
 {
 	struct sfs_inode_info *si = (struct sfs_inode_info *) foo;
 
+	init_rwsem(&si->i_map_sem);
+#ifdef CONFIG_FS_DAX
+	init_rwsem(&si->i_dax_sem);
+#endif
+	rwlock_init(&si->i_es_lock);
+	INIT_LIST_HEAD(&si->i_es_list);
 	inode_init_once(&si->vfs_inode);
 }
 
@@ -88,12 +120,12 @@ static void destroy_inode_cache(void)
 int sfs_getattr(const struct path *path, struct kstat *stat,
 		u32 request_mask, unsigned int query_flags)
 {
-	printk(KERN_ERR "sfs_getattr");
 	struct inode *inode = d_inode(path->dentry);
-//	struct ext2_inode_info ei = SFS_I(inode);
-	unsigned int flag;
 
 	generic_fillattr(inode, stat);
+	/* delayed allocations are not in i_blocks until writeback */
+	stat->blocks += (u64)READ_ONCE(SFS_I(inode)->i_da_blocks) <<
+			(inode->i_blkbits - 9);
 
 	return 0;
 }
@@ -107,26 +139,32 @@ int sfs_setattr(struct dentry *dentry, struct iattr *iattr)
 	if (error)
 		return error;
 
+	if ((iattr->ia_valid & ATTR_SIZE) && iattr->ia_size != inode->i_size) {
+		error = sfs_setsize(inode, iattr->ia_size);
+		if (error)
+			return error;
+	}
+
+	setattr_copy(inode, iattr);
+	mark_inode_dirty(inode);
 	return error;
 }
 
 struct inode_operations sfs_dir_inode_operations = {
-/*
 	.create		= sfs_create,
 	.lookup         = sfs_lookup,
-*/	
-/*
-	.link           = sfs_link,
 	.unlink         = sfs_unlink,
-	.symlink        = sfs_symlink,
 	.mkdir          = sfs_mkdir,
 	.rmdir          = sfs_rmdir,
+/*
+	.link           = sfs_link,
+	.symlink        = sfs_symlink,
 	.mknod          = sfs_mknod,
 	.rename         = sfs_rename,
 */	
-/*
 	.getattr        = sfs_getattr,
 	.setattr        = sfs_setattr,
+/*
 	.get_acl        = sfs_get_acl,
 	.set_acl        = sfs_set_acl,
 	.tmpfile        = sfs_tmpfile,
@@ -151,14 +189,12 @@ struct inode_operations sfs_dir_inode_operations = {
 struct file_operations sfs_dir_operations = {
         .llseek         = generic_file_llseek,
         .read           = generic_read_dir,
-/*
 	.iterate_shared = sfs_readdir,
 	.unlocked_ioctl = sfs_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl   = sfs_compat_ioctl,
 #endif
 	.fsync          = sfs_fsync,
-*/	
 };
 
 
@@ -176,28 +212,6 @@ struct file_operations sfs_dir_operations = {
 
 
 
-const struct file_operations sfs_file_operations = {
-	.llseek		= generic_file_llseek,
-/*
-	.read_iter	= sfs_file_read_iter,
-	.write_iter	= sfs_file_write_iter,
-	.unlocked_ioctl = sfs_ioctl,
-#ifdef CONFIG_COMPAT
-	.compat_ioctl	= sfs_compat_ioctl,
-#endif
-*/
-	.mmap		= generic_file_mmap,
-/*
-	.open		= dquot_file_open,
-	.release	= sfs_release_file,
-	.fsync		= sfs_fsync,
-	.get_unmapped_area = thp_get_unmapped_area,
-*/	
-	.splice_read	= generic_file_splice_read,
-/*
-	.splice_write	= iter_file_splice_write,
-*/	
-};
 
 
 
@@ -218,50 +232,437 @@ static struct inode *sfs_alloc_inode(struct super_block *sb)
 	if (!si)
 		return NULL;
 	inode_set_iversion(&si->vfs_inode, 1);
+	si->i_alloc_goal = 0;
+	si->i_es_tree = RB_ROOT;
+	si->i_es_nr = 0;
+	si->i_es_ref = false;
+	si->i_da_tree = RB_ROOT;
+	si->i_da_blocks = 0;
+	si->i_sync_state = 0;
+	si->i_sync_tid = 0;
+	si->i_datasync_tid = 0;
 
 	return &si->vfs_inode;
 }
 
+static void sfs_free_inode(struct inode *inode)
+{
+	kmem_cache_free(sfs_inode_cachep, SFS_I(inode));
+}
+
+/*
+ * write the in-memory super block with the current free counts, if they
+ * differ from what is on disk
+ */
+int sfs_commit_super(struct super_block *sb, int wait)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_super_block *raw_super = sbi->raw_super;
+	struct buffer_head *bh;
+	int err = 0;
+
+	if (!(bh = sb_bread(sb, 0))) {
+		sfs_msg(sb, KERN_ERR, "unable to read superblock");
+		return -EIO;
+	}
+
+	raw_super->free_block_count = cpu_to_le64(
+		percpu_counter_sum_positive(&sbi->s_freeblocks_counter));
+	raw_super->free_inode_count = cpu_to_le32(
+		percpu_counter_sum_positive(&sbi->s_freeinodes_counter));
+
+	lock_buffer(bh);
+	/* a sync with nothing changed since the last one writes nothing */
+	if (buffer_uptodate(bh) && !buffer_dirty(bh) &&
+	    !buffer_write_io_error(bh) &&
+	    !memcmp(bh->b_data + SFS_SUPER_OFFSET, raw_super,
+		    sizeof(*raw_super))) {
+		unlock_buffer(bh);
+		brelse(bh);
+		return 0;
+	}
+	memcpy(bh->b_data + SFS_SUPER_OFFSET, raw_super, sizeof(*raw_super));
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	if (wait) {
+		sync_dirty_buffer(bh);
+		if (buffer_write_io_error(bh)) {
+			sfs_msg(sb, KERN_ERR, "IO error syncing superblock");
+			clear_buffer_write_io_error(bh);
+			set_buffer_uptodate(bh);
+			err = -EIO;
+		}
+	}
+	brelse(bh);
+	return err;
+}
+
+static int sfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	u64 t0 = sfs_trace_clock(sfs_sync_fs);
+	int err, ret;
+
+	/* with a journal the bitmaps go with the commit */
+	if (sfs_journaled(sb)) {
+		ret = wait ? sfs_journal_force_commit(sb) : 0;
+		goto out;
+	}
+
+	/* imap comes before dmap on disk */
+	ret = sfs_bitmap_flush(&sbi->s_imap, wait);
+	err = sfs_bitmap_flush(&sbi->s_dmap, wait);
+	if (!ret)
+		ret = err;
+out:
+	err = sfs_commit_super(sb, wait);
+	if (!ret)
+		ret = err;
+	trace_sfs_sync_fs(sb, wait, ret, sfs_trace_since(t0));
+	return ret;
+}
+
+static int sfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+	s64 bfree;
+
+	bfree = percpu_counter_read_positive(&sbi->s_freeblocks_counter) -
+		percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+
+	buf->f_type = SFS_SUPER_MAGIC;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = le32_to_cpu(sbi->raw_super->block_count_data);
+	buf->f_bfree = max_t(s64, bfree, 0);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sbi->s_inodes_count;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->s_freeinodes_counter);
+	buf->f_namelen = SFS_NAME_LEN;
+	buf->f_fsid = u64_to_fsid(id);
+	return 0;
+}
+
+/*
+ * The allocator index already knows the free space of every group, so the
+ * counters are seeded from it without another pass over the bitmaps. The
+ * counts saved at the last clean unmount are only cross-checked.
+ */
+static int sfs_init_counters(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_super_block *raw_super = sbi->raw_super;
+	u64 free_blocks = 0, free_inodes = 0;
+	u32 group;
+	int err;
+
+	for (group = 0; group < sbi->s_ngroups; group++)
+		free_blocks += sbi->s_groups[group].ag_free;
+	for (group = 0; group < sbi->s_ninode_groups; group++)
+		free_inodes += sbi->s_inode_groups[group].ig_free;
+
+	if ((le16_to_cpu(raw_super->state) & SFS_VALID_FS) &&
+	    (le64_to_cpu(raw_super->free_block_count) != free_blocks ||
+	     le32_to_cpu(raw_super->free_inode_count) != free_inodes))
+		sfs_msg(sb, KERN_WARNING, "free counts in superblock are "
+			"stale, using the bitmaps");
+
+	err = percpu_counter_init(&sbi->s_freeblocks_counter, free_blocks,
+				  GFP_KERNEL);
+	if (err)
+		return err;
+	err = percpu_counter_init(&sbi->s_freeinodes_counter, free_inodes,
+				  GFP_KERNEL);
+	if (err)
+		goto destroy_freeblocks;
+	err = percpu_counter_init(&sbi->s_dirtyblocks_counter, 0, GFP_KERNEL);
+	if (err)
+		goto destroy_freeinodes;
+	return 0;
+
+destroy_freeinodes:
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+destroy_freeblocks:
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	return err;
+}
+
+static void sfs_destroy_counters(struct sfs_sb_info *sbi)
+{
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+}
+
+static void sfs_es_report(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	u64 hits = sfs_stat_sum(sbi, SFS_STAT_MAP_CACHE_HITS);
+	u64 misses = sfs_stat_sum(sbi, SFS_STAT_MAP_CACHE_MISSES);
+
+	if (hits + misses)
+		sfs_msg(sb, KERN_INFO, "mapping cache: %llu hits, %llu misses "
+			"(%llu%%)", hits, misses, div64_u64(hits * 100,
+							    hits + misses));
+}
+
+static void sfs_put_super(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+
+	/* empty the log first, it holds back freed blocks */
+	sfs_journal_destroy(sb);
+	sfs_discard_destroy(sb);
+
+	if (!sb_rdonly(sb)) {
+		sbi->raw_super->state |= cpu_to_le16(SFS_VALID_FS);
+		sfs_commit_super(sb, 1);
+	}
+
+	sfs_unregister_sysfs(sb);
+	sfs_es_unregister(sbi);
+	sfs_es_report(sb);
+	sb->s_fs_info = NULL;
+	sfs_destroy_counters(sbi);
+	sfs_destroy_inode_groups(sbi);
+	sfs_destroy_alloc_groups(sbi);
+	sfs_bitmap_release(&sbi->s_dmap);
+	sfs_bitmap_release(&sbi->s_imap);
+	kfree(sbi->s_blockgroup_lock);
+	fs_put_dax(sbi->s_daxdev);
+	kfree(sbi->raw_super);
+	free_percpu(sbi->s_stats);
+	kfree(sbi);
+}
+
+static int sfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct sfs_sb_info *sbi = SFS_SB(root->d_sb);
+
+	if (sbi->s_commit_interval != SFS_DEF_COMMIT_INTERVAL)
+		seq_printf(seq, ",commit=%lu", sbi->s_commit_interval / HZ);
+	if (test_opt(sbi, BESTFIT))
+		seq_puts(seq, ",alloc=bestfit");
+	if (sbi->s_ra_pages)
+		seq_printf(seq, ",readahead=%lu",
+			   (unsigned long)sbi->s_ra_pages << (PAGE_SHIFT - 10));
+	if (sbi->s_es_max)
+		seq_printf(seq, ",mapcache=%lu", sbi->s_es_max);
+	if (test_opt(sbi, DISCARD_ASYNC))
+		seq_puts(seq, ",discard=async");
+	if (test_opt(sbi, DAX))
+		seq_puts(seq, ",dax");
+	return 0;
+}
+
+static int sfs_remount(struct super_block *sb, int *flags, char *data);
+
 static const struct super_operations sfs_sops = {
 	.alloc_inode    = sfs_alloc_inode,
-/*
-	.free_inode     = sfs_free_inode,
 	.write_inode    = sfs_write_inode,
+	.dirty_inode    = sfs_dirty_inode,
 	.evict_inode    = sfs_evict_inode,
 	.put_super      = sfs_put_super,
 	.sync_fs        = sfs_sync_fs,
-	.freeze_fs      = sfs_freeze,
-	.unfreeze_fs    = sfs_unfreeze,
 	.statfs         = sfs_statfs,
-	.remount_fs     = sfs_remount,
+	.free_inode     = sfs_free_inode,
 	.show_options   = sfs_show_options,
+	.remount_fs     = sfs_remount,
+/*
+	.freeze_fs      = sfs_freeze,
+	.unfreeze_fs    = sfs_unfreeze,
 */	
 };
 
+enum {
+	Opt_commit, Opt_alloc_nextfit, Opt_alloc_bestfit, Opt_readahead,
+	Opt_mapcache, Opt_discard_async, Opt_nodiscard, Opt_dax, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_commit, "commit=%u"},
+	{Opt_alloc_nextfit, "alloc=nextfit"},
+	{Opt_alloc_bestfit, "alloc=bestfit"},
+	{Opt_readahead, "readahead=%u"},
+	{Opt_mapcache, "mapcache=%u"},
+	{Opt_discard_async, "discard=async"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_dax, "dax"},
+	{Opt_err, NULL}
+};
+
+/*
+ * Parse @options over the values already in @opts. The atime options and
+ * lazytime are handled by the VFS.
+ */
+static int parse_options(struct super_block *sb, char *options,
+			 struct sfs_mount_options *opts)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int arg;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		int token;
+
+		if (!*p)
+			continue;
+
+		token = match_token(p, tokens, args);
+		switch (token) {
+		case Opt_commit:
+		case Opt_readahead:
+		case Opt_mapcache:
+			if (match_int(&args[0], &arg) || arg < 0)
+				goto bad_value;
+			if (token == Opt_commit)
+				opts->s_commit_interval = arg ?
+					(unsigned long)arg * HZ :
+					SFS_DEF_COMMIT_INTERVAL;
+			else if (token == Opt_readahead)
+				opts->s_ra_pages = arg >> (PAGE_SHIFT - 10);
+			else
+				opts->s_es_max = arg;
+			break;
+		case Opt_alloc_nextfit:
+			clear_opt(opts, BESTFIT);
+			break;
+		case Opt_alloc_bestfit:
+			set_opt(opts, BESTFIT);
+			break;
+		case Opt_discard_async:
+			set_opt(opts, DISCARD_ASYNC);
+			break;
+		case Opt_nodiscard:
+			clear_opt(opts, DISCARD_ASYNC);
+			break;
+		case Opt_dax:
+			set_opt(opts, DAX);
+			break;
+		default:
+			sfs_msg(sb, KERN_ERR, "unrecognized mount option \"%s\"",
+				p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+
+bad_value:
+	sfs_msg(sb, KERN_ERR, "bad value in mount option \"%s\"", p);
+	return -EINVAL;
+}
+
+static void sfs_get_options(struct sfs_sb_info *sbi,
+			    struct sfs_mount_options *opts)
+{
+	opts->s_mount_opt = sbi->s_mount_opt;
+	opts->s_commit_interval = sbi->s_commit_interval;
+	opts->s_ra_pages = sbi->s_ra_pages;
+	opts->s_es_max = sbi->s_es_max;
+}
+
+static void sfs_set_options(struct sfs_sb_info *sbi,
+			    struct sfs_mount_options *opts)
+{
+	WRITE_ONCE(sbi->s_mount_opt, opts->s_mount_opt);
+	WRITE_ONCE(sbi->s_commit_interval, opts->s_commit_interval);
+	WRITE_ONCE(sbi->s_ra_pages, opts->s_ra_pages);
+	WRITE_ONCE(sbi->s_es_max, opts->s_es_max);
+}
+
+/*
+ * Everything but dax can change on remount. Turning discard=async off
+ * drains the queue, going read-only writes the final counts like an
+ * unmount does.
+ */
+static int sfs_remount(struct super_block *sb, int *flags, char *data)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	struct sfs_mount_options opts;
+	int err;
+
+	sync_filesystem(sb);
+
+	sfs_get_options(sbi, &opts);
+	err = parse_options(sb, data, &opts);
+	if (err)
+		return err;
+
+	if ((opts.s_mount_opt ^ sbi->s_mount_opt) & SFS_MOUNT_DAX) {
+		sfs_msg(sb, KERN_WARNING, "dax cannot be changed on remount");
+		return -EINVAL;
+	}
+	if (test_opt(&opts, DISCARD_ASYNC) && !sbi->s_discard) {
+		sfs_msg(sb, KERN_WARNING, "device does not support discard, "
+			"discard=async ignored");
+		clear_opt(&opts, DISCARD_ASYNC);
+	}
+
+	sfs_set_options(sbi, &opts);
+	if (!test_opt(sbi, DISCARD_ASYNC))
+		sfs_discard_flush(sb);
+
+	if ((bool)(*flags & SB_RDONLY) == sb_rdonly(sb))
+		return 0;
+
+	if (*flags & SB_RDONLY) {
+		sfs_journal_force_commit(sb);
+		sfs_journal_checkpoint(sb);
+		sfs_discard_flush(sb);
+		sbi->raw_super->state |= cpu_to_le16(SFS_VALID_FS);
+	} else {
+		sbi->raw_super->state &= ~cpu_to_le16(SFS_VALID_FS);
+	}
+	return sfs_commit_super(sb, 1);
+}
+
+/*
+ * Maximal file size covered by d_addr[] and the single, double and triple
+ * indirect blocks.
+ */
+static loff_t sfs_max_size(void)
+{
+	loff_t blocks = DEF_ADDRS_PER_INODE;
+	loff_t per_level = 1;
+	int i;
+
+	for (i = 0; i < DEF_IDPS_PER_INODE; i++) {
+		per_level *= DEF_ADDRS_PER_BLOCK;
+		blocks += per_level;
+	}
+	return min_t(loff_t, blocks << SFS_LOG_BLOCK_SIZE, MAX_LFS_FILESIZE);
+}
+
 static int sfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head *bh;
 	struct sfs_sb_info *sbi;
-	struct sfs_super_block *raw_super;
+	struct sfs_super_block *raw_super = NULL;
+	struct sfs_mount_options opts;
 	struct inode *root;
-
-	struct sfs_inode_info *si;
 	unsigned long block;
-	struct sfs_inode *raw_inode;
-	int n;
-	uid_t i_uid;
-	gid_t i_gid;
-
-	ino_t ino = SFS_ROOT_INO;
-	unsigned long offset;
+	int ret = -EINVAL;
 
 	sbi = kzalloc(sizeof(struct sfs_sb_info), GFP_KERNEL);
 	if (!sbi) {
 		sfs_msg(sb, KERN_ERR, "unable to alloc sbi");
-		goto free_sbi;
+		return -ENOMEM;
 	}
 
-	//sbi->sb = sb;
+	sbi->sb = sb;
+	spin_lock_init(&sbi->s_lock);
+
+	/* first, everything from here on counts into it */
+	sbi->s_stats = alloc_percpu(struct sfs_stats);
+	if (!sbi->s_stats) {
+		sfs_msg(sb, KERN_ERR, "unable to alloc statistics");
+		ret = -ENOMEM;
+		goto free_sbi;
+	}
 
 	if (unlikely(!sb_set_blocksize(sb, SFS_BLKSIZE))) {
 		sfs_msg(sb, KERN_ERR, "unable to set blocksize");
@@ -272,94 +673,228 @@ static int sfs_fill_super(struct super_block *sb, void *data, int silent)
 	raw_super = kzalloc(sizeof(struct sfs_super_block), GFP_KERNEL);
 	if (!raw_super) {
 		sfs_msg(sb, KERN_ERR, "unable to alloc super");
-		goto free_raw_super;
+		ret = -ENOMEM;
+		goto free_sbi;
 	}
 
 	block = 0;
 	if (!(bh = sb_bread(sb, block))) {
 		sfs_msg(sb, KERN_ERR, "unable to read superblock");
-		goto brelse_bh;
+		ret = -EIO;
+		goto free_raw_super;
 	}
 
 	memcpy(raw_super, bh->b_data + SFS_SUPER_OFFSET, sizeof(*raw_super));
+	brelse(bh);
 // }
 
 	sb->s_fs_info = sbi;
 	sbi->raw_super = raw_super;
-	sb->s_magic = le64_to_cpu(raw_super->magic);	
+	sb->s_magic = le32_to_cpu(raw_super->magic);
 
 	if (sb->s_magic != SFS_SUPER_MAGIC) {
-		sfs_msg(sb, KERN_ERR, "unable to get magic");
+		if (!silent)
+			sfs_msg(sb, KERN_ERR, "unable to get magic");
 		goto failed;
 	}
 
-	sb->s_op = &sfs_sops;
+	if (raw_super->state & cpu_to_le16(SFS_ERROR_FS))
+		sfs_msg(sb, KERN_WARNING, "mounting a file system with errors, "
+			"running fsck is recommended");
 
-// sfs_iget {
-	root = iget_locked(sb, ino);		
+	if (le32_to_cpu(raw_super->feature) & ~SFS_FEATURE_SUPP) {
+		sfs_msg(sb, KERN_ERR, "unsupported features: 0x%x",
+			le32_to_cpu(raw_super->feature) & ~SFS_FEATURE_SUPP);
+		goto failed;
+	}
 
-	si = SFS_I(root);
-	root->i_sb = sb;
+	if (raw_super->feature & cpu_to_le32(SFS_FEATURE_DENSE_INODE)) {
+		sbi->s_inode_size = SFS_INODE_SLOT_SIZE;
+		sbi->s_inodes_count = le32_to_cpu(raw_super->inode_count);
+	} else {
+		sbi->s_inode_size = SFS_BLKSIZE;
+		sbi->s_inodes_count = le32_to_cpu(raw_super->block_count_inodes);
+	}
+	sbi->s_inodes_per_block = SFS_BLKSIZE / sbi->s_inode_size;
+	if (sbi->s_inodes_count > (u64)le32_to_cpu(raw_super->block_count_inodes) *
+				  sbi->s_inodes_per_block) {
+		sfs_msg(sb, KERN_ERR, "inode count %u exceeds the inode area",
+			sbi->s_inodes_count);
+		goto failed;
+	}
+	if (DIV_ROUND_UP(sbi->s_inodes_count, SFS_MAP_BITS_PER_BLK) >
+	    le32_to_cpu(raw_super->block_count_imap) ||
+	    DIV_ROUND_UP(le32_to_cpu(raw_super->block_count_data),
+			 SFS_MAP_BITS_PER_BLK) >
+	    le32_to_cpu(raw_super->block_count_dmap)) {
+		sfs_msg(sb, KERN_ERR, "bitmaps too small for the inode or "
+			"data area");
+		goto failed;
+	}
 
-	//sfs_get_inode {
-	offset = (ino - SFS_ROOT_INO);
-	block = SFS_GET_SB(sb, inodes_blkaddr) + offset;
-	if (!(bh = sb_bread(sb, block))) {
-		sfs_msg(sb, KERN_ERR, "unable to read root inode");
+	opts.s_mount_opt = 0;
+	opts.s_commit_interval = SFS_DEF_COMMIT_INTERVAL;
+	opts.s_ra_pages = 0;
+	opts.s_es_max = 0;
+	ret = parse_options(sb, data, &opts);
+	if (ret)
 		goto failed;
+	sfs_set_options(sbi, &opts);
+
+	if (test_opt(sbi, DAX)) {
+		sbi->s_daxdev = fs_dax_get_by_bdev(sb->s_bdev);
+		if (!bdev_dax_supported(sb->s_bdev, SFS_BLKSIZE)) {
+			sfs_msg(sb, KERN_ERR, "DAX unsupported by the device, "
+				"dax ignored");
+			clear_opt(sbi, DAX);
+			fs_put_dax(sbi->s_daxdev);
+			sbi->s_daxdev = NULL;
+		}
 	}
-	raw_inode = (struct sfs_inode *)bh->b_data;
-	// }
-	
-	root->i_mode = le16_to_cpu(raw_inode->i_mode);
-	i_uid = (uid_t)le16_to_cpu(raw_inode->i_uid);
-	i_gid = (gid_t)le16_to_cpu(raw_inode->i_gid);
-	i_uid_write(root, i_uid);
-	i_gid_write(root, i_gid);
-	set_nlink(root, le16_to_cpu(raw_inode->i_links));
-	root->i_size = le32_to_cpu(raw_inode->i_size);
-	root->i_atime.tv_sec = (signed)le32_to_cpu(raw_inode->i_atime);
-	root->i_ctime.tv_sec = (signed)le32_to_cpu(raw_inode->i_ctime);
-	root->i_mtime.tv_sec = (signed)le32_to_cpu(raw_inode->i_mtime);
-	root->i_atime.tv_nsec = root->i_mtime.tv_nsec = root->i_ctime.tv_nsec = 0;
-	root->i_blocks = le32_to_cpu(raw_inode->i_blocks);
-
-	si->i_dir_start_lookup = 0;
-	for (n = 0; n < DEF_ADDRS_PER_INODE; n++)
-		si->i_data[n] = raw_inode->d_addr[n];
-	for (; n < DEF_SFS_N_BLOCKS; n++)
-		si->i_data[n] = raw_inode->i_addr[n - DEF_ADDRS_PER_BLOCK];
-	
 
-	if (S_ISREG(root->i_mode)) {
+	sb->s_maxbytes = sfs_max_size();
+	sb->s_op = &sfs_sops;
 
-	} else if (S_ISDIR(root->i_mode)) {
-		root->i_op = &sfs_dir_inode_operations;
-		root->i_fop = &sfs_dir_operations;
-	} else {
+	/* replay before any metadata is read */
+	ret = sfs_journal_load(sb);
+	if (ret) {
+		sfs_msg(sb, KERN_ERR, "unable to load journal");
+		goto failed;
+	}
 
-	}	
-// }
+	sbi->s_blockgroup_lock =
+		kzalloc(sizeof(struct blockgroup_lock), GFP_KERNEL);
+	if (!sbi->s_blockgroup_lock) {
+		sfs_msg(sb, KERN_ERR, "unable to alloc blockgroup lock");
+		ret = -ENOMEM;
+		goto free_journal;
+	}
+	bgl_lock_init(sbi->s_blockgroup_lock);
+
+	ret = sfs_bitmap_load(sb, &sbi->s_imap,
+			le32_to_cpu(raw_super->imap_blkaddr),
+			DIV_ROUND_UP(sbi->s_inodes_count, SFS_MAP_BITS_PER_BLK));
+	if (ret) {
+		sfs_msg(sb, KERN_ERR, "unable to load inode bitmap");
+		goto free_bgl;
+	}
+
+	ret = sfs_bitmap_load(sb, &sbi->s_dmap,
+			le32_to_cpu(raw_super->dmap_blkaddr),
+			DIV_ROUND_UP(le32_to_cpu(raw_super->block_count_data),
+				     SFS_MAP_BITS_PER_BLK));
+	if (ret) {
+		sfs_msg(sb, KERN_ERR, "unable to load data bitmap");
+		goto free_imap;
+	}
+
+	ret = sfs_build_alloc_groups(sb);
+	if (ret) {
+		sfs_msg(sb, KERN_ERR, "unable to build allocation groups");
+		goto free_dmap;
+	}
+
+	ret = sfs_build_inode_groups(sb);
+	if (ret) {
+		sfs_msg(sb, KERN_ERR, "unable to build inode groups");
+		goto free_groups;
+	}
+
+	ret = sfs_init_counters(sb);
+	if (ret) {
+		sfs_msg(sb, KERN_ERR, "unable to init counters");
+		goto free_inode_groups;
+	}
+
+	ret = sfs_es_register(sbi);
+	if (ret) {
+		sfs_msg(sb, KERN_ERR, "unable to register mapping cache shrinker");
+		goto free_counters;
+	}
+
+	ret = sfs_discard_init(sb);
+	if (ret) {
+		sfs_msg(sb, KERN_ERR, "unable to set up discard");
+		goto free_shrinker;
+	}
+
+	ret = sfs_register_sysfs(sb);
+	if (ret) {
+		sfs_msg(sb, KERN_ERR, "unable to register in sysfs");
+		goto free_discard;
+	}
+
+	root = sfs_iget(sb, SFS_ROOT_INO);
+	if (IS_ERR(root)) {
+		sfs_msg(sb, KERN_ERR, "unable to read root inode");
+		ret = PTR_ERR(root);
+		goto free_sysfs;
+	}
+
+	if (!S_ISDIR(root->i_mode)) {
+		sfs_msg(sb, KERN_ERR, "root is not a directory");
+		iput(root);
+		ret = -EINVAL;
+		goto free_sysfs;
+	}
 
 	sb->s_root = d_make_root(root);
+	if (!sb->s_root) {
+		sfs_msg(sb, KERN_ERR, "unable to get root dentry");
+		ret = -ENOMEM;
+		goto free_sysfs;
+	}
+
+	/* counts on disk are stale until the next clean unmount */
+	if (!sb_rdonly(sb)) {
+		sbi->raw_super->state &= ~cpu_to_le16(SFS_VALID_FS);
+		sfs_commit_super(sb, 1);
+	}
 
-	brelse(bh);
-	
 	return 0;
 
-failed:
+free_sysfs:
+	sfs_unregister_sysfs(sb);
 
+free_discard:
+	sfs_discard_destroy(sb);
 
-brelse_bh:
-	brelse(bh);
+free_shrinker:
+	sfs_es_unregister(sbi);
+
+free_counters:
+	sfs_destroy_counters(sbi);
+
+free_inode_groups:
+	sfs_destroy_inode_groups(sbi);
+
+free_groups:
+	sfs_destroy_alloc_groups(sbi);
+
+free_dmap:
+	sfs_bitmap_release(&sbi->s_dmap);
+
+free_imap:
+	sfs_bitmap_release(&sbi->s_imap);
+
+free_bgl:
+	kfree(sbi->s_blockgroup_lock);
+
+free_journal:
+	sfs_journal_destroy(sb);
+
+failed:
+	fs_put_dax(sbi->s_daxdev);
+	sb->s_fs_info = NULL;
 
 free_raw_super:
-	kvfree(raw_super);
+	kfree(raw_super);
 
 free_sbi:
-	kvfree(sbi);
+	free_percpu(sbi->s_stats);
+	kfree(sbi);
 
-	return -1;
+	return ret;
 }
 
 static struct dentry *sfs_mount(struct file_system_type *fs_type, int flags,
@@ -383,19 +918,44 @@ static int __init init_sfs_fs(void)
 	err = init_inode_cache();
 	if (err)
 		return err;
+	err = sfs_init_free_extent_cache();
+	if (err)
+		goto free_inode_cache;
+	err = sfs_init_es_cache();
+	if (err)
+		goto free_extent_cache;
+	err = sfs_init_journal_cache();
+	if (err)
+		goto free_es_cache;
+	err = sfs_init_sysfs();
+	if (err)
+		goto free_journal_cache;
 	err = register_filesystem(&sfs_fs_type);
 	if (err)
-		goto fail;
+		goto free_sysfs;
 	
 	return 0;
 
-fail:
+free_sysfs:
+	sfs_exit_sysfs();
+free_journal_cache:
+	sfs_destroy_journal_cache();
+free_es_cache:
+	sfs_destroy_es_cache();
+free_extent_cache:
+	sfs_destroy_free_extent_cache();
+free_inode_cache:
+	destroy_inode_cache();
 	return err;
 }
 
 static void __exit exit_sfs_fs(void)
 {
 	unregister_filesystem(&sfs_fs_type);
+	sfs_exit_sysfs();
+	sfs_destroy_journal_cache();
+	sfs_destroy_es_cache();
+	sfs_destroy_free_extent_cache();
 	destroy_inode_cache();
 }
 
@@ -0,0 +1,182 @@
+/*
+ * sysfs.c
+ *
+ * Copyright 2020 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/percpu.h>
+#include <linux/sysfs.h>
+
+#include "sfs.h"
+
+/*
+ * /sys/fs/sfs/<dev>/ shows the statistics of a mount. Every counter is
+ * one file holding the sum over all CPUs. A latency file holds one line
+ * of SFS_LAT_BUCKETS counts, bucket n counting the operations that took
+ * 2^n to 2^(n+1) microseconds; the first one also holds those under a
+ * microsecond, the last one everything slower. The counters are per-CPU
+ * and never reset, so updating them costs no shared cache line.
+ */
+
+static struct kset *sfs_kset;
+
+struct sfs_attr {
+	struct attribute attr;
+	int sa_stat;			/* SFS_STAT_*, or -1 */
+	int sa_lat;			/* SFS_LAT_*, or -1 */
+};
+
+#define SFS_STAT_ATTR(_name, _stat)					\
+static struct sfs_attr sfs_attr_##_name = {				\
+	.attr = { .name = __stringify(_name), .mode = 0444 },		\
+	.sa_stat = _stat,						\
+	.sa_lat = -1,							\
+}
+
+#define SFS_LAT_ATTR(_name, _lat)					\
+static struct sfs_attr sfs_attr_##_name = {				\
+	.attr = { .name = __stringify(_name), .mode = 0444 },		\
+	.sa_stat = -1,							\
+	.sa_lat = _lat,							\
+}
+
+SFS_STAT_ATTR(map_lookups, SFS_STAT_MAP_LOOKUPS);
+SFS_STAT_ATTR(map_cache_hits, SFS_STAT_MAP_CACHE_HITS);
+SFS_STAT_ATTR(map_cache_misses, SFS_STAT_MAP_CACHE_MISSES);
+SFS_STAT_ATTR(indirect_reads, SFS_STAT_INDIRECT_READS);
+SFS_STAT_ATTR(allocs, SFS_STAT_ALLOCS);
+SFS_STAT_ATTR(alloc_groups_scanned, SFS_STAT_ALLOC_GROUPS);
+SFS_STAT_ATTR(alloc_blocks, SFS_STAT_ALLOC_BLOCKS);
+SFS_STAT_ATTR(dir_lookups, SFS_STAT_DIR_LOOKUPS);
+SFS_STAT_ATTR(dir_hits, SFS_STAT_DIR_HITS);
+SFS_STAT_ATTR(dir_misses, SFS_STAT_DIR_MISSES);
+SFS_STAT_ATTR(dir_blocks_scanned, SFS_STAT_DIR_BLOCKS);
+SFS_STAT_ATTR(bitmap_flushes, SFS_STAT_BITMAP_FLUSHES);
+SFS_STAT_ATTR(bitmap_blocks_written, SFS_STAT_BITMAP_BLOCKS);
+SFS_STAT_ATTR(journal_commits, SFS_STAT_JOURNAL_COMMITS);
+SFS_STAT_ATTR(journal_blocks_logged, SFS_STAT_JOURNAL_BLOCKS);
+SFS_LAT_ATTR(map_latency, SFS_LAT_MAP);
+SFS_LAT_ATTR(alloc_latency, SFS_LAT_ALLOC);
+SFS_LAT_ATTR(dir_lookup_latency, SFS_LAT_DIR_LOOKUP);
+SFS_LAT_ATTR(bitmap_flush_latency, SFS_LAT_BITMAP_FLUSH);
+SFS_LAT_ATTR(journal_commit_latency, SFS_LAT_JOURNAL_COMMIT);
+
+static struct attribute *sfs_attrs[] = {
+	&sfs_attr_map_lookups.attr,
+	&sfs_attr_map_cache_hits.attr,
+	&sfs_attr_map_cache_misses.attr,
+	&sfs_attr_indirect_reads.attr,
+	&sfs_attr_allocs.attr,
+	&sfs_attr_alloc_groups_scanned.attr,
+	&sfs_attr_alloc_blocks.attr,
+	&sfs_attr_dir_lookups.attr,
+	&sfs_attr_dir_hits.attr,
+	&sfs_attr_dir_misses.attr,
+	&sfs_attr_dir_blocks_scanned.attr,
+	&sfs_attr_bitmap_flushes.attr,
+	&sfs_attr_bitmap_blocks_written.attr,
+	&sfs_attr_journal_commits.attr,
+	&sfs_attr_journal_blocks_logged.attr,
+	&sfs_attr_map_latency.attr,
+	&sfs_attr_alloc_latency.attr,
+	&sfs_attr_dir_lookup_latency.attr,
+	&sfs_attr_bitmap_flush_latency.attr,
+	&sfs_attr_journal_commit_latency.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(sfs);
+
+u64 sfs_stat_sum(struct sfs_sb_info *sbi, int stat)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->s_stats, cpu)->st_count[stat];
+	return sum;
+}
+
+static ssize_t sfs_attr_show(struct kobject *kobj, struct attribute *attr,
+			     char *buf)
+{
+	struct sfs_sb_info *sbi = container_of(kobj, struct sfs_sb_info,
+					       s_kobj);
+	struct sfs_attr *a = container_of(attr, struct sfs_attr, attr);
+	u64 hist[SFS_LAT_BUCKETS] = { 0 };
+	int cpu, n;
+	ssize_t len = 0;
+
+	if (a->sa_lat < 0)
+		return scnprintf(buf, PAGE_SIZE, "%llu\n",
+				 sfs_stat_sum(sbi, a->sa_stat));
+
+	for_each_possible_cpu(cpu)
+		for (n = 0; n < SFS_LAT_BUCKETS; n++)
+			hist[n] += per_cpu_ptr(sbi->s_stats, cpu)->
+					st_lat[a->sa_lat][n];
+	for (n = 0; n < SFS_LAT_BUCKETS; n++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%llu",
+				 n ? " " : "", hist[n]);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+
+static void sfs_sb_release(struct kobject *kobj)
+{
+	struct sfs_sb_info *sbi = container_of(kobj, struct sfs_sb_info,
+					       s_kobj);
+
+	complete(&sbi->s_kobj_unregister);
+}
+
+static const struct sysfs_ops sfs_attr_ops = {
+	.show	= sfs_attr_show,
+};
+
+static struct kobj_type sfs_sb_ktype = {
+	.default_groups	= sfs_groups,
+	.sysfs_ops	= &sfs_attr_ops,
+	.release	= sfs_sb_release,
+};
+
+int sfs_register_sysfs(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+	int err;
+
+	init_completion(&sbi->s_kobj_unregister);
+	sbi->s_kobj.kset = sfs_kset;
+	err = kobject_init_and_add(&sbi->s_kobj, &sfs_sb_ktype, NULL, "%s",
+				   sb->s_id);
+	if (err) {
+		kobject_put(&sbi->s_kobj);
+		wait_for_completion(&sbi->s_kobj_unregister);
+	}
+	return err;
+}
+
+void sfs_unregister_sysfs(struct super_block *sb)
+{
+	struct sfs_sb_info *sbi = SFS_SB(sb);
+
+	kobject_del(&sbi->s_kobj);
+	kobject_put(&sbi->s_kobj);
+	wait_for_completion(&sbi->s_kobj_unregister);
+}
+
+int __init sfs_init_sysfs(void)
+{
+	sfs_kset = kset_create_and_add("sfs", NULL, fs_kobj);
+	if (!sfs_kset)
+		return -ENOMEM;
+	return 0;
+}
+
+void sfs_exit_sysfs(void)
+{
+	kset_unregister(sfs_kset);
+}